@@ -18,6 +18,33 @@ benchmark_config::benchmark_config(const std::string& config_file_name)
 		("benchmark.width", bpo::value(&benchmark_width_)->default_value(benchmark_width_), "Number of width used.")
 		("benchmark.height", bpo::value(&benchmark_height_)->default_value(benchmark_height_), "Non-counted warm-up kernel runs.")
 		("benchmark.kernel-runs", bpo::value(&benchmark_kernel_runs_)->default_value(benchmark_kernel_runs_), "Kernel runs (including warmups).")
+		("scene.file", bpo::value(&scene_file_)->default_value(scene_file_), "Scene to render: an OBJ file with its MTL file next to it, or a prebuilt .rtscene file.")
+		("scene.export", bpo::value(&scene_export_)->default_value(scene_export_), "Write the built scene to this .rtscene file, empty disables the export.")
+		("scene.bvh-builder", bpo::value(&scene_bvh_builder_)->default_value(scene_bvh_builder_), "BVH builder: 'sah' (binned SAH on the host), 'sbvh' (SAH with spatial splits on the host) or 'lbvh' (Morton codes on the device).")
+		("scene.lbvh-treelet-passes", bpo::value(&scene_lbvh_treelet_passes_)->default_value(scene_lbvh_treelet_passes_), "Treelet restructuring passes applied to the LBVH, 0 disables refinement.")
+		("scene.sbvh-budget", bpo::value(&scene_sbvh_budget_)->default_value(scene_sbvh_budget_), "Triangle references the SBVH may add by spatial splits, as a fraction of the triangle count.")
+		("scene.bvh-cache", bpo::value(&scene_bvh_cache_)->default_value(scene_bvh_cache_), "Load the host-built BVH from a cache file next to the mesh, or write it there after the build. A loaded BVH reports its time as bvh_load_time, bvh_build_time is 0 then.")
+		("scene.bvh-width", bpo::value(&scene_bvh_width_)->default_value(scene_bvh_width_), "Children per BVH node of the host builders: 2 (binary nodes), 4 or 8 (compressed wide nodes).")
+		("scene.compress-vertices", bpo::value(&scene_compress_vertices_)->default_value(scene_compress_vertices_), "Store vertex normals octahedral-encoded in 32 bits and texcoords as half2 instead of full precision floats.")
+		("scene.environment", bpo::value(&scene_environment_)->default_value(scene_environment_), "Radiance .hdr environment map.")
+		("scene.environment-cache", bpo::value(&scene_environment_cache_)->default_value(scene_environment_cache_), "Map the environment mip chain from a .hdrcache file next to the map, or write it there after the build.")
+		("scene.environment-budget", bpo::value(&scene_environment_budget_)->default_value(scene_environment_budget_), "Device memory for the environment mip chain in MiB, the finest levels are dropped until it fits. 0 keeps every level.")
+		("render.pipeline", bpo::value(&render_pipeline_)->default_value(render_pipeline_), "Path tracing pipeline: 'megakernel' (one kernel traces whole paths) or 'wavefront' (generate, extend, shade, connect and accumulate kernels).")
+		("render.max-depth", bpo::value(&render_max_depth_)->default_value(render_max_depth_), "Maximum path vertices, compiled into the render kernels.")
+		("render.rr-min-depth", bpo::value(&render_rr_min_depth_)->default_value(render_rr_min_depth_), "Path vertices before Russian roulette may end a path based on its throughput. A value of max-depth or more disables it.")
+		("render.kernel-features", bpo::value(&render_kernel_features_)->default_value(render_kernel_features_), "Space separated kernel features to compile in: DOF (depth of field), BLINN (Blinn-Phong instead of GGX), GAMMA_CORRECTION (gamma corrected output).")
+		("render.kernel-cache", bpo::value(&render_kernel_cache_)->default_value(render_kernel_cache_), "Directory for compiled program binaries, reused while the sources, options and device stay the same. Empty compiles on every start.")
+		("render.wavefront-paths", bpo::value(&render_wavefront_paths_)->default_value(render_wavefront_paths_), "Paths the wavefront pipeline keeps state for, larger frames are rendered in several waves.")
+		("render.persistent-threads", bpo::value(&render_persistent_threads_)->default_value(render_persistent_threads_), "Launch a fixed number of megakernel work-groups that take batches of pixels from an atomic counter, instead of one work-item per pixel.")
+		("render.persistent-groups", bpo::value(&render_persistent_groups_)->default_value(render_persistent_groups_), "Work-groups per compute unit launched with persistent threads.")
+		("render.path-regeneration", bpo::value(&render_path_regeneration_)->default_value(render_path_regeneration_), "Megakernel work-items trace one bounce per loop iteration and start the path of the next pixel as soon as theirs ends. Implies the persistent threads launch.")
+		("render.adaptive-threshold", bpo::value(&render_adaptive_threshold_)->default_value(render_adaptive_threshold_), "Relative standard error of a pixel's luminance below which adaptive sampling stops tracing it. 0 traces every pixel in every frame.")
+		("render.adaptive-min-samples", bpo::value(&render_adaptive_min_samples_)->default_value(render_adaptive_min_samples_), "Samples every pixel gets before adaptive sampling trusts its error estimate.")
+		("render.denoise-iterations", bpo::value(&render_denoise_iterations_)->default_value(render_denoise_iterations_), "A-trous filter passes over every stored frame, guided by first hit albedo, normal and depth and by the variance of the accumulated radiance. 0 disables the denoiser and the feature buffers, so does render.store-frames=false.")
+		("render.store-frames", bpo::value(&render_store_frames_)->default_value(render_store_frames_), "Write every frame to out_<frame>.<image-format>, read back and encoded in the background while the next frames render.")
+		("render.image-format", bpo::value(&render_image_format_)->default_value(render_image_format_), "File format of stored frames: 'bmp', 'png' (tonemapped) or 'pfm', 'exr' (linear radiance, half float for exr).")
+		("render.output-format", bpo::value(&render_output_format_)->default_value(render_output_format_), "Packed pixels the tonemap kernel writes for stored bmp and png frames: 'rgba8' or 'rgb10a2'.")
+		("opencl.compile_options", bpo::value(&opencl_compile_options_)->default_value(opencl_compile_options_), "Compile options of the OpenCL config, part of the program binary cache key.")
 	;
 
 	parse(config_file_name);
@@ -22,6 +22,36 @@ public:
 	const size_t& benchmark_height() const { return benchmark_height_; }
 	const size_t& benchmark_kernel_runs() const { return benchmark_kernel_runs_; }
 
+	const std::string& scene_file() const { return scene_file_; }
+	const std::string& scene_export() const { return scene_export_; }
+	const std::string& scene_bvh_builder() const { return scene_bvh_builder_; }
+	const size_t& scene_lbvh_treelet_passes() const { return scene_lbvh_treelet_passes_; }
+	const float& scene_sbvh_budget() const { return scene_sbvh_budget_; }
+	const bool& scene_bvh_cache() const { return scene_bvh_cache_; }
+	const size_t& scene_bvh_width() const { return scene_bvh_width_; }
+	const bool& scene_compress_vertices() const { return scene_compress_vertices_; }
+	const std::string& scene_environment() const { return scene_environment_; }
+	const bool& scene_environment_cache() const { return scene_environment_cache_; }
+	const float& scene_environment_budget() const { return scene_environment_budget_; }
+
+	const std::string& render_pipeline() const { return render_pipeline_; }
+	const size_t& render_max_depth() const { return render_max_depth_; }
+	const size_t& render_rr_min_depth() const { return render_rr_min_depth_; }
+	const std::string& render_kernel_features() const { return render_kernel_features_; }
+	const std::string& render_kernel_cache() const { return render_kernel_cache_; }
+	const size_t& render_wavefront_paths() const { return render_wavefront_paths_; }
+	const bool& render_persistent_threads() const { return render_persistent_threads_; }
+	const size_t& render_persistent_groups() const { return render_persistent_groups_; }
+	const bool& render_path_regeneration() const { return render_path_regeneration_; }
+	const float& render_adaptive_threshold() const { return render_adaptive_threshold_; }
+	const size_t& render_adaptive_min_samples() const { return render_adaptive_min_samples_; }
+	const size_t& render_denoise_iterations() const { return render_denoise_iterations_; }
+	const bool& render_store_frames() const { return render_store_frames_; }
+	const std::string& render_image_format() const { return render_image_format_; }
+	const std::string& render_output_format() const { return render_output_format_; }
+
+	const std::string& opencl_compile_options() const { return opencl_compile_options_; }
+
 private:
 	boost::program_options::options_description desc_;
 
@@ -30,6 +60,36 @@ private:
 	size_t benchmark_height_ = 720;
 	size_t benchmark_kernel_runs_ = 1;
 
+	std::string scene_file_ = "meshes/dragon.obj";
+	std::string scene_export_ = "";
+	std::string scene_bvh_builder_ = "sah";
+	size_t scene_lbvh_treelet_passes_ = 0;
+	float scene_sbvh_budget_ = 0.3f;
+	bool scene_bvh_cache_ = false;
+	size_t scene_bvh_width_ = 2;
+	bool scene_compress_vertices_ = false;
+	std::string scene_environment_ = "textures/Topanga_Forest_B_3k.hdr";
+	bool scene_environment_cache_ = false;
+	float scene_environment_budget_ = 0.0f;
+
+	std::string render_pipeline_ = "megakernel";
+	size_t render_max_depth_ = 5;
+	size_t render_rr_min_depth_ = 3;
+	std::string render_kernel_features_ = "GAMMA_CORRECTION";
+	std::string render_kernel_cache_ = "kernel_cache";
+	size_t render_wavefront_paths_ = 1 << 20;
+	bool render_persistent_threads_ = false;
+	size_t render_persistent_groups_ = 8;
+	bool render_path_regeneration_ = false;
+	float render_adaptive_threshold_ = 0.0f;
+	size_t render_adaptive_min_samples_ = 16;
+	size_t render_denoise_iterations_ = 0;
+	bool render_store_frames_ = false;
+	std::string render_image_format_ = "bmp";
+	std::string render_output_format_ = "rgba8";
+
+	std::string opencl_compile_options_ = "";
+
 };
 
 #endif // benchmark_config_hpp
@@ -0,0 +1,101 @@
+#include "frame_writer.hpp"
+#include "utils/cl_exception.hpp"
+#include <iostream>
+
+FrameWriter::FrameWriter(unsigned int width, unsigned int height, ImageFormat_t format, PixelFormat_t pixelFormat, size_t slotCount)
+    : m_Width(width)
+    , m_Height(height)
+    , m_Format(format)
+    , m_PixelFormat(pixelFormat)
+    , m_InFlight(0)
+    , m_Shutdown(false)
+{
+    for (size_t i = 0; i < slotCount; ++i)
+    {
+        m_Slots.push_back(std::vector<char>(size_t(width) * height * ImageWriter::GetPixelSize(format)));
+        m_FreeSlots.push_back(i);
+    }
+    m_Writer = std::thread(&FrameWriter::WriterLoop, this);
+
+}
+
+FrameWriter::~FrameWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Shutdown = true;
+    }
+    m_Condition.notify_all();
+    m_Writer.join();
+
+}
+
+size_t FrameWriter::AcquireSlot()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Condition.wait(lock, [this] { return !m_FreeSlots.empty(); });
+    size_t slot = m_FreeSlots.back();
+    m_FreeSlots.pop_back();
+    return slot;
+}
+
+void FrameWriter::Submit(size_t slot, const cl::Event& ready, const std::string& filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Pending.push_back({ slot, ready, filename });
+        ++m_InFlight;
+    }
+    m_Condition.notify_all();
+}
+
+void FrameWriter::Flush()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Condition.wait(lock, [this] { return m_InFlight == 0; });
+}
+
+void FrameWriter::WriterLoop()
+{
+    while (true)
+    {
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            // Pending frames are still written on shutdown
+            m_Condition.wait(lock, [this] { return m_Shutdown || !m_Pending.empty(); });
+            if (m_Pending.empty())
+            {
+                return;
+            }
+            frame = m_Pending.front();
+            m_Pending.pop_front();
+        }
+
+        // Errors cannot reach the render loop from here, a failed frame is reported and skipped
+        cl_int errCode = frame.ready.wait();
+        if (errCode)
+        {
+            std::cerr << "Failed to read back " << frame.filename << ": " << GetClErrorString(errCode) << std::endl;
+        }
+        else
+        {
+            try
+            {
+                ImageWriter::Write(frame.filename, m_Format, m_Width, m_Height, m_Slots[frame.slot].data(), m_PixelFormat);
+            }
+            catch (const std::exception& ex)
+            {
+                std::cerr << "Failed to write " << frame.filename << ": " << ex.what() << std::endl;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_FreeSlots.push_back(frame.slot);
+            --m_InFlight;
+        }
+        m_Condition.notify_all();
+    }
+
+}
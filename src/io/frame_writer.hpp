@@ -0,0 +1,69 @@
+#ifndef FRAME_WRITER_HPP
+#define FRAME_WRITER_HPP
+
+#include "io/image_writer.hpp"
+#include <CL/cl.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes rendered frames on a background thread. Frames are read back into
+// one of several host staging slots, as packed pixels or linear radiance
+// depending on the image format. A slot is encoded and written once its read
+// event completed and is reused afterwards. The render loop only waits when
+// all slots are still in flight.
+class FrameWriter
+{
+public:
+    // _pixelFormat_ describes the packed pixels of formats that are not linear
+    FrameWriter(unsigned int width, unsigned int height, ImageFormat_t format, PixelFormat_t pixelFormat, size_t slotCount);
+    ~FrameWriter();
+
+    ImageFormat_t GetFormat() const { return m_Format; }
+    size_t GetSlotCount() const { return m_Slots.size(); }
+    // Bytes of a frame the slots hold
+    size_t GetFrameSize() const { return m_Slots[0].size(); }
+
+    // Blocks until a slot is free and returns it, the caller reads the frame into its pixels
+    size_t AcquireSlot();
+    void* GetPixels(size_t slot) { return m_Slots[slot].data(); }
+
+    // Writes _slot_ to _filename_ once _ready_ completed, then frees the slot
+    void Submit(size_t slot, const cl::Event& ready, const std::string& filename);
+    // Blocks until every submitted frame is written
+    void Flush();
+
+private:
+    FrameWriter(const FrameWriter&) = delete;
+    FrameWriter& operator=(const FrameWriter&) = delete;
+
+    struct Frame
+    {
+        size_t slot;
+        cl::Event ready;
+        std::string filename;
+    };
+
+    void WriterLoop();
+
+private:
+    unsigned int m_Width;
+    unsigned int m_Height;
+    ImageFormat_t m_Format;
+    PixelFormat_t m_PixelFormat;
+    std::vector<std::vector<char>> m_Slots;
+    std::vector<size_t> m_FreeSlots;
+    std::deque<Frame> m_Pending;
+    // Frames submitted but not written yet, including the one the writer works on
+    size_t m_InFlight;
+    bool m_Shutdown;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+    std::thread m_Writer;
+
+};
+
+#endif // FRAME_WRITER_HPP
@@ -7,202 +7,237 @@ from http://www.flipcode.com/archives/HDR_Image_Reader.shtml
 ************************************************************************************/
 
 #include "hdr_loader.hpp"
-
-#define _CRT_SECURE_NO_WARNINGS
+#include "io/mapped_file.hpp"
+#include "utils/task_scheduler.hpp"
+#include <algorithm>
 #include <cmath>
-#include <memory>
 #include <cstdio>
 #include <cstring>
-
-typedef unsigned char RGBE[4];
-#define R			0
-#define G			1
-#define B			2
-#define E			3
+#include <string>
 
 #define  MINELEN	8				// minimum scanline length for encoding
 #define  MAXELEN	0x7fff			// maximum scanline length for encoding
 
-static void WorkOnRGBE(RGBE *scan, int len, float *cols);
-static bool Decrunch(RGBE *scanline, int len, FILE *file);
-static bool OldDecrunch(RGBE *scanline, int len, FILE *file);
+// Scanlines decoded per task
+static const size_t SCANLINE_GRAIN = 16;
 
-bool HDRLoader::Load(const char *fileName, Image &res)
+// Reads one header line, returns false at the end of the data
+static bool ReadLine(const char*& p, const char* end, std::string& line)
 {
-    int i;
-    char str[200];
-    FILE *file;
-
-    file = fopen(fileName, "rb");
-    if (!file)
-        return false;
-
-    fread(str, 10, 1, file);
-    if (memcmp(str, "#?RADIANCE", 10)) {  // check RADIANCE renderer format
-        fclose(file);
-        return false;
-    }
-
-    fseek(file, 1, SEEK_CUR);
-
-    char cmd[200];
-    i = 0;
-    char c = 0, oldc;
-    while (true) {
-        oldc = c;
-        c = fgetc(file);
-        if (c == 0xa && oldc == 0xa)
-            break;
-        cmd[i++] = c;
-    }
-
-    char reso[200];
-    i = 0;
-    while (true) {
-        c = fgetc(file);
-        reso[i++] = c;
-        if (c == 0xa)
-            break;
-    }
-
-    long w, h;
-    if (!sscanf(reso, "-Y %ld +X %ld", &h, &w))
+    if (p >= end)
     {
-        fclose(file);
         return false;
     }
-
-    res.width = w;
-    res.height = h;
-
-    float *cols = new float[w * h * 4];
-    res.colors = cols;
-
-    RGBE *scanline = new RGBE[w];
-    if (!scanline)
+    const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (!newline)
     {
-        fclose(file);
         return false;
     }
-
-    // convert image 
-    for (int y = h - 1; y >= 0; y--)
-    {
-        if (Decrunch(scanline, w, file) == false)
-            break;
-        WorkOnRGBE(scanline, w, cols);
-        cols += w * 4;
-    }
-
-    delete[] scanline;
-    fclose(file);
-
+    line.assign(p, newline);
+    p = newline + 1;
     return true;
 }
 
-float ConvertComponent(int expo, int val)
+static bool IsNewRLE(const unsigned char* p, const unsigned char* end, int width)
 {
-    float v = val / 256.0f;
-    float d = powf(2.0f, expo);
-    return v * d;
+    return width >= MINELEN && width <= MAXELEN && end - p >= 4 &&
+        p[0] == 2 && p[1] == 2 && (p[2] & 128) == 0;
 }
 
-void WorkOnRGBE(RGBE *scan, int len, float *cols)
+// Returns the start of the next scanline, nullptr if the scanline is malformed
+static const unsigned char* SkipScanline(const unsigned char* p, const unsigned char* end, int width)
 {
-    while (len-- > 0)
+    if (IsNewRLE(p, end, width))
     {
-        int expo = scan[0][E] - 128;
-        cols[0] = ConvertComponent(expo, scan[0][R]);
-        cols[1] = ConvertComponent(expo, scan[0][G]);
-        cols[2] = ConvertComponent(expo, scan[0][B]);
-        cols += 4;
-        scan++;
-    }
-}
-
-bool Decrunch(RGBE *scanline, int len, FILE *file)
-{
-    int  i, j;
-
-    if (len < MINELEN || len > MAXELEN)
-    {
-        return OldDecrunch(scanline, len, file);
-    }
-
-    i = fgetc(file);
-    if (i != 2)
-    {
-        fseek(file, -1, SEEK_CUR);
-        return OldDecrunch(scanline, len, file);
+        if (((p[2] << 8) | p[3]) != width)
+        {
+            return nullptr;
+        }
+        p += 4;
+        // Every component is run-length encoded separately
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < width;)
+            {
+                if (p >= end)
+                {
+                    return nullptr;
+                }
+                unsigned char code = *p++;
+                int count = code > 128 ? code & 127 : code;
+                p += code > 128 ? 1 : count;
+                if (count == 0 || j + count > width)
+                {
+                    return nullptr;
+                }
+                j += count;
+            }
+        }
+        return p <= end ? p : nullptr;
     }
 
-    scanline[0][G] = fgetc(file);
-    scanline[0][B] = fgetc(file);
-    i = fgetc(file);
-
-    if (scanline[0][G] != 2 || scanline[0][B] & 128)
+    // Flat pixels, 1 1 1 n repeats the previous pixel
+    int rshift = 0;
+    for (int j = 0; j < width; p += 4)
     {
-        scanline[0][R] = 2;
-        scanline[0][E] = i;
-        return OldDecrunch(scanline + 1, len - 1, file);
+        if (end - p < 4)
+        {
+            return nullptr;
+        }
+        if (p[0] == 1 && p[1] == 1 && p[2] == 1)
+        {
+            // Runs do not continue the previous scanline, that would serialize the decode
+            int count = p[3] << rshift;
+            if (j == 0 || j + count > width)
+            {
+                return nullptr;
+            }
+            j += count;
+            rshift += 8;
+        }
+        else
+        {
+            ++j;
+            rshift = 0;
+        }
     }
+    return p;
+}
 
-    // read each component
-    for (i = 0; i < 4; i++)
+// Decodes a scanline that SkipScanline accepted into RGBE quadruples
+static void DecodeScanline(const unsigned char* p, const unsigned char* end, int width, unsigned char* rgbe)
+{
+    if (IsNewRLE(p, end, width))
     {
-        for (j = 0; j < len;)
+        p += 4;
+        for (int i = 0; i < 4; ++i)
         {
-            unsigned char code = fgetc(file);
-            if (code > 128) { // run
-                code &= 127;
-                unsigned char val = fgetc(file);
-                while (code--)
+            for (int j = 0; j < width;)
+            {
+                unsigned char code = *p++;
+                if (code > 128)
                 {
-                    scanline[j++][i] = val;
+                    unsigned char value = *p++;
+                    for (code &= 127; code > 0; --code)
+                    {
+                        rgbe[4 * j++ + i] = value;
+                    }
                 }
-            }
-            else 
-            {	// non-run
-                while (code--)
+                else
                 {
-                    scanline[j++][i] = fgetc(file);
+                    for (; code > 0; --code)
+                    {
+                        rgbe[4 * j++ + i] = *p++;
+                    }
                 }
             }
         }
+        return;
     }
 
-    return feof(file) ? false : true;
+    int rshift = 0;
+    for (int j = 0; j < width; p += 4)
+    {
+        if (p[0] == 1 && p[1] == 1 && p[2] == 1)
+        {
+            for (int count = p[3] << rshift; count > 0; --count, ++j)
+            {
+                memcpy(&rgbe[4 * j], &rgbe[4 * (j - 1)], 4);
+            }
+            rshift += 8;
+        }
+        else
+        {
+            memcpy(&rgbe[4 * j++], p, 4);
+            rshift = 0;
+        }
+    }
 }
 
-bool OldDecrunch(RGBE *scanline, int len, FILE *file)
+bool HDRLoader::Decode(const char* data, size_t size, Image& res)
 {
-    int rshift = 0;
+    const char* p = data;
+    const char* end = data + size;
+
+    std::string line;
+    if (!ReadLine(p, end, line) || (line.compare(0, 10, "#?RADIANCE") != 0 && line.compare(0, 6, "#?RGBE") != 0))
+    {
+        return false;
+    }
+    // Header variables up to the empty line
+    while (true)
+    {
+        if (!ReadLine(p, end, line))
+        {
+            return false;
+        }
+        if (line.empty())
+        {
+            break;
+        }
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+        {
+            return false;
+        }
+    }
 
-    while (len > 0)
+    long w, h;
+    if (!ReadLine(p, end, line) || sscanf(line.c_str(), "-Y %ld +X %ld", &h, &w) != 2 || w <= 0 || h <= 0 || w > MAXELEN * 16 || h > MAXELEN * 16)
     {
-        scanline[0][R] = fgetc(file);
-        scanline[0][G] = fgetc(file);
-        scanline[0][B] = fgetc(file);
-        scanline[0][E] = fgetc(file);
-        if (feof(file))
+        return false;
+    }
+    int width = static_cast<int>(w);
+    int height = static_cast<int>(h);
+
+    // Scanlines have no size prefix, only walking the runs finds where the next one starts
+    const unsigned char* pixels = reinterpret_cast<const unsigned char*>(p);
+    const unsigned char* pixelsEnd = reinterpret_cast<const unsigned char*>(end);
+    std::vector<const unsigned char*> scanlines(height + 1);
+    scanlines[0] = pixels;
+    for (int y = 0; y < height; ++y)
+    {
+        scanlines[y + 1] = SkipScanline(scanlines[y], pixelsEnd, width);
+        if (!scanlines[y + 1])
+        {
             return false;
+        }
+    }
 
-        if (scanline[0][R] == 1 &&
-            scanline[0][G] == 1 &&
-            scanline[0][B] == 1) {
-            for (unsigned char i = scanline[0][E] << rshift; i > 0; i--)
+    float scales[256];
+    for (int e = 0; e < 256; ++e)
+    {
+        scales[e] = std::ldexp(1.0f, e - 128 - 8);
+    }
+
+    res.m_Storage.resize(size_t(width) * height * 4);
+    float* colors = res.m_Storage.data();
+    TaskScheduler::Get().ParallelFor(0, height, SCANLINE_GRAIN, [&](size_t first, size_t last)
+    {
+        std::vector<unsigned char> rgbe(size_t(width) * 4);
+        for (size_t y = first; y < last; ++y)
+        {
+            DecodeScanline(scanlines[y], scanlines[y + 1], width, rgbe.data());
+            float* row = colors + y * width * 4;
+            for (int x = 0; x < width; ++x)
             {
-                memcpy(&scanline[0][0], &scanline[-1][0], 4);
-                scanline++;
-                len--;
+                const unsigned char* texel = &rgbe[4 * x];
+                float scale = scales[texel[3]];
+                row[4 * x + 0] = texel[0] * scale;
+                row[4 * x + 1] = texel[1] * scale;
+                row[4 * x + 2] = texel[2] * scale;
+                row[4 * x + 3] = 1.0f;
             }
-            rshift += 8;
-        }
-        else {
-            scanline++;
-            len--;
-            rshift = 0;
         }
-    }
+    });
+
+    res.width = width;
+    res.height = height;
+    res.colors = colors;
     return true;
 }
+
+bool HDRLoader::Load(const char *fileName, Image &res)
+{
+    MappedFile file;
+    return file.Open(fileName) && Decode(file.GetData(), file.GetSize(), res);
+}
@@ -1,18 +1,33 @@
 #ifndef IMAGE_LOADER_HPP
 #define IMAGE_LOADER_HPP
 
+#include <cstddef>
+#include <vector>
+
 class Image
 {
 public:
+    Image() : width(0), height(0), colors(nullptr) {}
+
     int width, height;
     // each pixel takes 4 32-bit floats, each component can be of any value...
     float* colors;
+
+private:
+    friend class HDRLoader;
+    std::vector<float> m_Storage;
+
 };
 
+// Radiance RGBE loader. The file is mapped, a serial pass finds the start of
+// every scanline and the scanlines are then decoded in parallel.
 class HDRLoader
 {
 public:
     static bool Load(const char *fileName, Image &res);
+
+private:
+    static bool Decode(const char* data, size_t size, Image& res);
 };
 
 #endif // IMAGE_LOADER_HPP
@@ -0,0 +1,367 @@
+#include "image_writer.hpp"
+#include "io/store_bmp.hpp"
+#include "mathlib/mathlib.hpp"
+#include "utils/task_scheduler.hpp"
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+// Rows per task of the conversion loops
+static const size_t ROW_GRAIN = 16;
+// Filtered PNG data one task compresses, strips are deflated independently and concatenated
+static const size_t PNG_STRIP_SIZE = 256 * 1024;
+// Frames are dumped while rendering goes on, speed matters more than the last few percent of size
+static const int PNG_COMPRESSION_LEVEL = Z_BEST_SPEED;
+// Largest finite half, brighter pixels would turn into infinity
+static const float MAX_HALF = 65504.0f;
+
+ImageFormat_t ImageWriter::ParseFormat(const std::string& name)
+{
+    if (name == "bmp")
+    {
+        return ImageFormat_t::BMP;
+    }
+    else if (name == "png")
+    {
+        return ImageFormat_t::PNG;
+    }
+    else if (name == "pfm")
+    {
+        return ImageFormat_t::PFM;
+    }
+    else if (name == "exr")
+    {
+        return ImageFormat_t::EXR;
+    }
+    throw std::runtime_error("Unknown image format: " + name);
+}
+
+const char* ImageWriter::GetExtension(ImageFormat_t format)
+{
+    static const char* extensions[] = { "bmp", "png", "pfm", "exr" };
+    return extensions[static_cast<unsigned int>(format)];
+}
+
+void ImageWriter::Write(const std::string& filename, ImageFormat_t format, unsigned int width, unsigned int height,
+    const void* pixels, PixelFormat_t packedFormat)
+{
+    std::vector<char> file;
+    switch (format)
+    {
+    case ImageFormat_t::BMP:
+        // The packed pixels already are the bitmap, it needs no encoding
+        StoreBMP::Store(filename.c_str(), width, height, static_cast<const uint32_t*>(pixels), packedFormat);
+        return;
+    case ImageFormat_t::PNG:
+        EncodePNG(width, height, static_cast<const uint32_t*>(pixels), packedFormat, file);
+        break;
+    case ImageFormat_t::PFM:
+        EncodePFM(width, height, static_cast<const float*>(pixels), file);
+        break;
+    case ImageFormat_t::EXR:
+        EncodeEXR(width, height, static_cast<const float*>(pixels), file);
+        break;
+    }
+
+    WriteFile(filename, file);
+}
+
+static void PutBigEndian(char* out, uint32_t value)
+{
+    out[0] = static_cast<char>(value >> 24);
+    out[1] = static_cast<char>(value >> 16);
+    out[2] = static_cast<char>(value >> 8);
+    out[3] = static_cast<char>(value);
+}
+
+static void AppendBigEndian(std::vector<char>& file, uint32_t value)
+{
+    char bytes[4];
+    PutBigEndian(bytes, value);
+    file.insert(file.end(), bytes, bytes + 4);
+}
+
+// Appends the length and type of a PNG chunk, returns the offset of the type for EndChunk
+static size_t BeginChunk(std::vector<char>& file, const char* type)
+{
+    AppendBigEndian(file, 0);
+    size_t start = file.size();
+    file.insert(file.end(), type, type + 4);
+    return start;
+}
+
+// Patches the length of the chunk starting at _start_ and appends the CRC of its type and data
+static void EndChunk(std::vector<char>& file, size_t start)
+{
+    size_t size = file.size() - start - 4;
+    PutBigEndian(&file[start - 4], static_cast<uint32_t>(size));
+    uLong crc = crc32(0, reinterpret_cast<const Bytef*>(&file[start]), static_cast<uInt>(size + 4));
+    AppendBigEndian(file, static_cast<uint32_t>(crc));
+}
+
+namespace
+{
+    struct PNGStrip
+    {
+        // Uncompressed size and Adler-32 of the filtered rows, for the checksum of the whole stream
+        size_t rawSize;
+        uLong adler;
+        std::vector<Bytef> data;
+    };
+}
+
+void ImageWriter::EncodePNG(unsigned int width, unsigned int height, const uint32_t* pixels, PixelFormat_t format, std::vector<char>& file)
+{
+    // RGB10A2 keeps its precision as 16-bit RGB, its 2 bit alpha is dropped
+    bool wide = format == PixelFormat_t::RGB10A2;
+    size_t pixelSize = wide ? 6 : 4;
+    size_t rowSize = size_t(width) * pixelSize + 1;
+    size_t rowsPerStrip = std::max<size_t>(PNG_STRIP_SIZE / rowSize, 1);
+    size_t stripCount = (height + rowsPerStrip - 1) / rowsPerStrip;
+
+    // Every strip is deflated on its own with a sync flush, which ends it on a byte boundary,
+    // so the strips concatenate into one stream. Only the last one finishes the stream.
+    // Matches can't reach back into the previous strip, which costs little at this strip size.
+    // The frame writer thread spawns the tasks like the main thread does, the render loop does
+    // not use the scheduler while frames are written.
+    std::vector<PNGStrip> strips(stripCount);
+    std::atomic<bool> failed(false);
+    TaskScheduler::Get().ParallelFor(0, stripCount, 1, [&](size_t first, size_t last)
+    {
+        std::vector<Bytef> raw;
+        for (size_t i = first; i < last; ++i)
+        {
+            size_t firstRow = i * rowsPerStrip;
+            size_t lastRow = std::min<size_t>(firstRow + rowsPerStrip, height);
+            raw.resize((lastRow - firstRow) * rowSize);
+
+            for (size_t y = firstRow; y < lastRow; ++y)
+            {
+                // PNG rows are top-down
+                const uint32_t* source = &pixels[(height - 1 - y) * width];
+                Bytef* row = &raw[(y - firstRow) * rowSize];
+                Bytef* bytes = row + 1;
+                for (size_t x = 0; x < width; ++x)
+                {
+                    uint32_t pixel = source[x];
+                    if (wide)
+                    {
+                        for (unsigned int c = 0; c < 3; ++c)
+                        {
+                            uint32_t value = (pixel >> (c * 10)) & 0x3FF;
+                            value = (value << 6) | (value >> 4);
+                            bytes[x * 6 + c * 2] = static_cast<Bytef>(value >> 8);
+                            bytes[x * 6 + c * 2 + 1] = static_cast<Bytef>(value);
+                        }
+                    }
+                    else
+                    {
+                        for (unsigned int c = 0; c < 4; ++c)
+                        {
+                            bytes[x * 4 + c] = static_cast<Bytef>(pixel >> (c * 8));
+                        }
+                    }
+                }
+
+                // Sub filter, from the back so the unfiltered left neighbours are still there
+                row[0] = 1;
+                for (size_t j = rowSize - 1; j-- > pixelSize;)
+                {
+                    bytes[j] = static_cast<Bytef>(bytes[j] - bytes[j - pixelSize]);
+                }
+            }
+
+            PNGStrip& strip = strips[i];
+            strip.rawSize = raw.size();
+            strip.adler = adler32(adler32(0, Z_NULL, 0), raw.data(), static_cast<uInt>(raw.size()));
+
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            // Negative window bits write raw deflate data, the zlib header and checksum come from the encoder
+            if (deflateInit2(&stream, PNG_COMPRESSION_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                failed = true;
+                return;
+            }
+            bool finish = i + 1 == stripCount;
+            // The bound covers a finished stream, the sync flush marker needs a few bytes more
+            strip.data.resize(deflateBound(&stream, static_cast<uLong>(raw.size())) + 16);
+            stream.next_in = raw.data();
+            stream.avail_in = static_cast<uInt>(raw.size());
+            stream.next_out = strip.data.data();
+            stream.avail_out = static_cast<uInt>(strip.data.size());
+            int status = deflate(&stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+            if (finish ? status != Z_STREAM_END : (status != Z_OK || stream.avail_in > 0 || stream.avail_out == 0))
+            {
+                failed = true;
+            }
+            strip.data.resize(stream.total_out);
+            deflateEnd(&stream);
+        }
+    });
+
+    if (failed)
+    {
+        throw std::runtime_error("Failed to compress the PNG image data.");
+    }
+
+    size_t compressedSize = 0;
+    uLong adler = adler32(0, Z_NULL, 0);
+    for (const PNGStrip& strip : strips)
+    {
+        compressedSize += strip.data.size();
+        adler = adler32_combine(adler, strip.adler, static_cast<z_off_t>(strip.rawSize));
+    }
+    file.reserve(compressedSize + 128);
+
+    static const char signature[] = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1A', '\n' };
+    file.insert(file.end(), signature, signature + sizeof(signature));
+
+    size_t chunk = BeginChunk(file, "IHDR");
+    AppendBigEndian(file, width);
+    AppendBigEndian(file, height);
+    file.push_back(wide ? 16 : 8);      // Bits per channel
+    file.push_back(wide ? 2 : 6);       // Color type RGB or RGBA
+    file.push_back(0);                  // Deflate
+    file.push_back(0);                  // Adaptive filtering
+    file.push_back(0);                  // Not interlaced
+    EndChunk(file, chunk);
+
+    chunk = BeginChunk(file, "IDAT");
+    file.push_back('\x78');             // Deflate with a 32 KiB window
+    file.push_back('\x01');             // Fastest compression, no dictionary, header check bits
+    for (const PNGStrip& strip : strips)
+    {
+        file.insert(file.end(), strip.data.begin(), strip.data.end());
+    }
+    AppendBigEndian(file, static_cast<uint32_t>(adler));
+    EndChunk(file, chunk);
+
+    chunk = BeginChunk(file, "IEND");
+    EndChunk(file, chunk);
+}
+
+void ImageWriter::EncodePFM(unsigned int width, unsigned int height, const float* pixels, std::vector<char>& file)
+{
+    // A negative scale marks little endian data, rows are bottom-up like the frames
+    std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    file.resize(header.size() + size_t(width) * height * 3 * sizeof(float));
+    memcpy(file.data(), header.data(), header.size());
+
+    char* data = &file[header.size()];
+    TaskScheduler::Get().ParallelFor(0, height, ROW_GRAIN, [&](size_t first, size_t last)
+    {
+        for (size_t i = first * width; i < last * width; ++i)
+        {
+            memcpy(&data[i * 3 * sizeof(float)], &pixels[i * 4], 3 * sizeof(float));
+        }
+    });
+}
+
+static void AppendLittleEndian(std::vector<char>& file, const void* value, size_t size)
+{
+    const char* bytes = static_cast<const char*>(value);
+    file.insert(file.end(), bytes, bytes + size);
+}
+
+static void AppendEXRAttribute(std::vector<char>& file, const char* name, const char* type, const void* value, int32_t size)
+{
+    file.insert(file.end(), name, name + strlen(name) + 1);
+    file.insert(file.end(), type, type + strlen(type) + 1);
+    AppendLittleEndian(file, &size, sizeof(size));
+    AppendLittleEndian(file, value, size);
+}
+
+void ImageWriter::EncodeEXR(unsigned int width, unsigned int height, const float* pixels, std::vector<char>& file)
+{
+    // Channels are stored in alphabetical order, each one a row of halfs per scanline
+    static const char* channels[] = { "B", "G", "R" };
+    static const unsigned int channelOffsets[] = { 2, 1, 0 };
+    static const int32_t HALF = 1;
+
+    static const char magic[] = { '\x76', '\x2F', '\x31', '\x01' };
+    file.insert(file.end(), magic, magic + sizeof(magic));
+    int32_t version = 2;                // Single part scanline image
+    AppendLittleEndian(file, &version, sizeof(version));
+
+    std::vector<char> channelList;
+    for (const char* channel : channels)
+    {
+        int32_t sampling = 1;
+        char linear[4] = { 0, 0, 0, 0 };  // Not perceptually linear, then reserved bytes
+        channelList.insert(channelList.end(), channel, channel + strlen(channel) + 1);
+        AppendLittleEndian(channelList, &HALF, sizeof(HALF));
+        AppendLittleEndian(channelList, linear, sizeof(linear));
+        AppendLittleEndian(channelList, &sampling, sizeof(sampling));
+        AppendLittleEndian(channelList, &sampling, sizeof(sampling));
+    }
+    channelList.push_back(0);
+
+    int32_t window[4] = { 0, 0, int32_t(width) - 1, int32_t(height) - 1 };
+    char noCompression = 0;
+    char increasingY = 0;
+    float one = 1.0f;
+    float center[2] = { 0.0f, 0.0f };
+    AppendEXRAttribute(file, "channels", "chlist", channelList.data(), int32_t(channelList.size()));
+    AppendEXRAttribute(file, "compression", "compression", &noCompression, sizeof(noCompression));
+    AppendEXRAttribute(file, "dataWindow", "box2i", window, sizeof(window));
+    AppendEXRAttribute(file, "displayWindow", "box2i", window, sizeof(window));
+    AppendEXRAttribute(file, "lineOrder", "lineOrder", &increasingY, sizeof(increasingY));
+    AppendEXRAttribute(file, "pixelAspectRatio", "float", &one, sizeof(one));
+    AppendEXRAttribute(file, "screenWindowCenter", "v2f", center, sizeof(center));
+    AppendEXRAttribute(file, "screenWindowWidth", "float", &one, sizeof(one));
+    file.push_back(0);
+
+    // Uncompressed files store one scanline per block: its y, its size and the channel rows
+    int32_t dataSize = int32_t(width * 3 * sizeof(unsigned short));
+    size_t blockSize = 2 * sizeof(int32_t) + dataSize;
+    size_t tableOffset = file.size();
+    size_t firstBlock = tableOffset + size_t(height) * sizeof(uint64_t);
+    file.resize(firstBlock + height * blockSize);
+
+    TaskScheduler::Get().ParallelFor(0, height, ROW_GRAIN, [&](size_t first, size_t last)
+    {
+        std::vector<unsigned short> halfs(size_t(width) * 3);
+        for (size_t y = first; y < last; ++y)
+        {
+            uint64_t offset = firstBlock + y * blockSize;
+            memcpy(&file[tableOffset + y * sizeof(uint64_t)], &offset, sizeof(offset));
+
+            char* block = &file[offset];
+            int32_t line = int32_t(y);
+            memcpy(block, &line, sizeof(line));
+            memcpy(block + sizeof(line), &dataSize, sizeof(dataSize));
+
+            // EXR scanlines are top-down
+            const float* source = &pixels[(height - 1 - y) * width * 4];
+            for (unsigned int c = 0; c < 3; ++c)
+            {
+                for (size_t x = 0; x < width; ++x)
+                {
+                    halfs[c * width + x] = FloatToHalf(std::min(source[x * 4 + channelOffsets[c]], MAX_HALF));
+                }
+            }
+            // Blocks follow the header without any alignment
+            memcpy(block + 2 * sizeof(int32_t), halfs.data(), dataSize);
+        }
+    });
+}
+
+void ImageWriter::WriteFile(const std::string& filename, const std::vector<char>& file)
+{
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (!out)
+    {
+        throw std::runtime_error("Unable to open the output image file " + filename);
+    }
+
+    bool success = fwrite(file.data(), 1, file.size(), out) == file.size();
+    success = fclose(out) == 0 && success;
+    if (!success)
+    {
+        throw std::runtime_error("Unable to write the output image file " + filename);
+    }
+}
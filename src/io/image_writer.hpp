@@ -0,0 +1,51 @@
+#ifndef IMAGE_WRITER_HPP
+#define IMAGE_WRITER_HPP
+
+#include "utils/pixel_format.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class ImageFormat_t : unsigned int
+{
+    // Packed pixels as they are
+    BMP,
+    // Packed pixels, 8 bits per channel RGBA for RGBA8 and 16 bits per channel RGB for RGB10A2
+    PNG,
+    // Linear radiance as 32-bit float RGB
+    PFM,
+    // Linear radiance as uncompressed half float RGB scanlines
+    EXR,
+};
+
+// Encodes rendered frames into image files. Every file is encoded in memory
+// and written with a single large write. Frames come bottom-up, the order the
+// render kernels produce their rows in, formats that store rows top-down are
+// flipped while encoding.
+class ImageWriter
+{
+public:
+    // Throws on unknown names, the names are the file extensions
+    static ImageFormat_t ParseFormat(const std::string& name);
+    static const char* GetExtension(ImageFormat_t format);
+
+    // PFM and EXR take the linear float4 accumulation buffer, the others the packed pixels of the tonemap kernel
+    static bool IsLinear(ImageFormat_t format) { return format == ImageFormat_t::PFM || format == ImageFormat_t::EXR; }
+    // Bytes per pixel of the frames _format_ takes
+    static size_t GetPixelSize(ImageFormat_t format) { return IsLinear(format) ? 4 * sizeof(float) : sizeof(uint32_t); }
+
+    // _packedFormat_ describes _pixels_ unless the image format is linear
+    static void Write(const std::string& filename, ImageFormat_t format, unsigned int width, unsigned int height,
+        const void* pixels, PixelFormat_t packedFormat);
+
+private:
+    static void EncodePNG(unsigned int width, unsigned int height, const uint32_t* pixels, PixelFormat_t format, std::vector<char>& file);
+    static void EncodePFM(unsigned int width, unsigned int height, const float* pixels, std::vector<char>& file);
+    static void EncodeEXR(unsigned int width, unsigned int height, const float* pixels, std::vector<char>& file);
+
+    static void WriteFile(const std::string& filename, const std::vector<char>& file);
+
+};
+
+#endif // IMAGE_WRITER_HPP
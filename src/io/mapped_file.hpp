@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <string>
+
+// Read-only memory mapping of a whole file, pages are loaded on first access
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Returns false if the file does not exist or cannot be mapped
+    bool Open(const std::string& filename);
+    void Close();
+
+    bool IsOpen() const { return m_Data != nullptr; }
+    const char* GetData() const { return m_Data; }
+    size_t GetSize() const { return m_Size; }
+
+private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+private:
+    const char* m_Data;
+    size_t m_Size;
+#ifdef _WIN32
+    void* m_File;
+    void* m_Mapping;
+#endif
+
+};
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,347 @@
+#include "obj_loader.hpp"
+#include "io/mapped_file.hpp"
+#include "utils/task_scheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+// Chunks smaller than this are not worth a task
+static const size_t MIN_CHUNK_SIZE = 1 << 20;
+static const unsigned int CHUNKS_PER_THREAD = 8;
+
+static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parsed contents of a line aligned part of the file
+struct ObjChunk
+{
+    const char* begin;
+    const char* end;
+    std::vector<float3> positions;
+    std::vector<float2> texcoords;
+    std::vector<float3> normals;
+    std::vector<ObjCorner> corners;
+    std::vector<unsigned int> materials;
+    // Faces before the first usemtl of the chunk use the material of the previous chunk
+    size_t inheritedFaces;
+    bool hasMaterial;
+    unsigned int material;
+    bool failed;
+
+};
+
+static inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline void SkipSpaces(const char*& p, const char* end)
+{
+    while (p < end && IsSpace(*p))
+    {
+        ++p;
+    }
+}
+
+static inline void SkipLine(const char*& p, const char* end)
+{
+    const char* newline = static_cast<const char*>(memchr(p, '\n', end - p));
+    p = newline ? newline + 1 : end;
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// Decimal float with optional exponent. Up to 17 significant digits are exact,
+// the result is correctly rounded for the short numbers OBJ exporters write.
+static bool ParseFloat(const char*& p, const char* end, float& value)
+{
+    SkipSpaces(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p++ == '-';
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; p < end && IsDigit(*p); ++p)
+    {
+        digits = true;
+        if (mantissa < 10000000000000000ULL)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        else
+        {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && IsDigit(*p); ++p)
+        {
+            digits = true;
+            if (mantissa < 10000000000000000ULL)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
+            }
+        }
+    }
+    if (!digits)
+    {
+        return false;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negativeExponent = *p++ == '-';
+        }
+        int e = 0;
+        bool exponentDigits = false;
+        for (; p < end && IsDigit(*p); ++p)
+        {
+            exponentDigits = true;
+            e = std::min(e * 10 + (*p - '0'), 100000);
+        }
+        if (!exponentDigits)
+        {
+            return false;
+        }
+        exponent += negativeExponent ? -e : e;
+    }
+
+    double result = static_cast<double>(mantissa);
+    if (exponent < 0)
+    {
+        result = exponent >= -22 ? result / POWERS_OF_TEN[-exponent] : result / std::pow(10.0, -exponent);
+    }
+    else if (exponent > 0)
+    {
+        result = exponent <= 22 ? result * POWERS_OF_TEN[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = static_cast<float>(negative ? -result : result);
+    return true;
+}
+
+// Positive 1-based OBJ index, returned 0-based
+static bool ParseIndex(const char*& p, const char* end, unsigned int& index)
+{
+    uint64_t value = 0;
+    const char* start = p;
+    for (; p < end && IsDigit(*p) && value <= 0xFFFFFFFFULL; ++p)
+    {
+        value = value * 10 + (*p - '0');
+    }
+    if (p == start || value == 0 || value > 0xFFFFFFFFULL)
+    {
+        return false;
+    }
+    index = static_cast<unsigned int>(value - 1);
+    return true;
+}
+
+static bool ParseCorner(const char*& p, const char* end, ObjCorner& corner)
+{
+    SkipSpaces(p, end);
+    return ParseIndex(p, end, corner.position) &&
+        p < end && *p++ == '/' && ParseIndex(p, end, corner.texcoord) &&
+        p < end && *p++ == '/' && ParseIndex(p, end, corner.normal);
+}
+
+static inline bool MatchKeyword(const char* p, const char* end, const char* keyword, size_t length)
+{
+    return static_cast<size_t>(end - p) > length && memcmp(p, keyword, length) == 0 && IsSpace(p[length]);
+}
+
+static void ParseChunk(ObjChunk& chunk, const std::unordered_map<std::string, unsigned int>& materialIndices)
+{
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+    while (p < end)
+    {
+        SkipSpaces(p, end);
+        if (MatchKeyword(p, end, "v", 1))
+        {
+            float3 position;
+            p += 1;
+            if (!ParseFloat(p, end, position.x) || !ParseFloat(p, end, position.y) || !ParseFloat(p, end, position.z))
+            {
+                chunk.failed = true;
+                return;
+            }
+            chunk.positions.push_back(position);
+        }
+        else if (MatchKeyword(p, end, "vt", 2))
+        {
+            float2 texcoord;
+            p += 2;
+            if (!ParseFloat(p, end, texcoord.x) || !ParseFloat(p, end, texcoord.y))
+            {
+                chunk.failed = true;
+                return;
+            }
+            chunk.texcoords.push_back(texcoord);
+        }
+        else if (MatchKeyword(p, end, "vn", 2))
+        {
+            float3 normal;
+            p += 2;
+            if (!ParseFloat(p, end, normal.x) || !ParseFloat(p, end, normal.y) || !ParseFloat(p, end, normal.z))
+            {
+                chunk.failed = true;
+                return;
+            }
+            chunk.normals.push_back(normal);
+        }
+        else if (MatchKeyword(p, end, "f", 1))
+        {
+            ObjCorner corners[3];
+            p += 1;
+            for (unsigned int i = 0; i < 3; ++i)
+            {
+                if (!ParseCorner(p, end, corners[i]))
+                {
+                    chunk.failed = true;
+                    return;
+                }
+            }
+            chunk.corners.insert(chunk.corners.end(), corners, corners + 3);
+            chunk.materials.push_back(chunk.material);
+            chunk.inheritedFaces += !chunk.hasMaterial;
+        }
+        else if (MatchKeyword(p, end, "usemtl", 6))
+        {
+            p += 6;
+            SkipSpaces(p, end);
+            const char* name = p;
+            while (p < end && !IsSpace(*p) && *p != '\n')
+            {
+                ++p;
+            }
+            // Unknown materials keep the current one
+            auto found = materialIndices.find(std::string(name, p));
+            if (found != materialIndices.end())
+            {
+                chunk.material = found->second;
+                chunk.hasMaterial = true;
+            }
+        }
+        SkipLine(p, end);
+    }
+}
+
+size_t ObjLoader::Load(const std::string& filename, const std::unordered_map<std::string, unsigned int>& materialIndices, ObjMesh& mesh)
+{
+    MappedFile file;
+    if (!file.Open(filename))
+    {
+        throw std::runtime_error("Failed to open scene file!");
+    }
+
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    const char* data = file.GetData();
+    size_t size = file.GetSize();
+    size_t nChunks = std::max<size_t>(1, std::min<size_t>(size / MIN_CHUNK_SIZE, scheduler.GetThreadCount() * CHUNKS_PER_THREAD));
+
+    // Chunks start at the beginning of a line
+    std::vector<ObjChunk> chunks(nChunks);
+    for (size_t i = 0; i < nChunks; ++i)
+    {
+        ObjChunk& chunk = chunks[i];
+        chunk.begin = i == 0 ? data : chunks[i - 1].end;
+        chunk.end = data + size;
+        if (i + 1 < nChunks)
+        {
+            const char* split = std::max(data + size * (i + 1) / nChunks, chunk.begin);
+            SkipLine(split, data + size);
+            chunk.end = split;
+        }
+        chunk.inheritedFaces = 0;
+        chunk.hasMaterial = false;
+        chunk.material = ~0u;
+        chunk.failed = false;
+    }
+
+    scheduler.ParallelFor(0, nChunks, 1, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            ParseChunk(chunks[i], materialIndices);
+        }
+    });
+
+    // Offsets of every chunk in the merged arrays, and the material a chunk starts with
+    std::vector<size_t> positionOffsets(nChunks + 1, 0), texcoordOffsets(nChunks + 1, 0), normalOffsets(nChunks + 1, 0), faceOffsets(nChunks + 1, 0);
+    std::vector<unsigned int> startMaterials(nChunks);
+    unsigned int material = ~0u;
+    for (size_t i = 0; i < nChunks; ++i)
+    {
+        if (chunks[i].failed)
+        {
+            throw std::runtime_error("Failed to load face!");
+        }
+        positionOffsets[i + 1] = positionOffsets[i] + chunks[i].positions.size();
+        texcoordOffsets[i + 1] = texcoordOffsets[i] + chunks[i].texcoords.size();
+        normalOffsets[i + 1] = normalOffsets[i] + chunks[i].normals.size();
+        faceOffsets[i + 1] = faceOffsets[i] + chunks[i].materials.size();
+        startMaterials[i] = material;
+        if (chunks[i].hasMaterial)
+        {
+            material = chunks[i].material;
+        }
+    }
+
+    mesh.positions.resize(positionOffsets[nChunks]);
+    mesh.texcoords.resize(texcoordOffsets[nChunks]);
+    mesh.normals.resize(normalOffsets[nChunks]);
+    mesh.corners.resize(faceOffsets[nChunks] * 3);
+    mesh.materials.resize(faceOffsets[nChunks]);
+
+    std::vector<char> invalidChunks(nChunks, 0);
+    scheduler.ParallelFor(0, nChunks, 1, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            ObjChunk& chunk = chunks[i];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + positionOffsets[i]);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), mesh.texcoords.begin() + texcoordOffsets[i]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + normalOffsets[i]);
+            std::copy(chunk.materials.begin(), chunk.materials.end(), mesh.materials.begin() + faceOffsets[i]);
+            std::fill_n(mesh.materials.begin() + faceOffsets[i], chunk.inheritedFaces, startMaterials[i]);
+
+            for (const ObjCorner& corner : chunk.corners)
+            {
+                if (corner.position >= mesh.positions.size() || corner.texcoord >= mesh.texcoords.size() || corner.normal >= mesh.normals.size())
+                {
+                    invalidChunks[i] = 1;
+                }
+            }
+            std::copy(chunk.corners.begin(), chunk.corners.end(), mesh.corners.begin() + faceOffsets[i] * 3);
+
+            std::vector<float3>().swap(chunk.positions);
+            std::vector<float2>().swap(chunk.texcoords);
+            std::vector<float3>().swap(chunk.normals);
+            std::vector<ObjCorner>().swap(chunk.corners);
+            std::vector<unsigned int>().swap(chunk.materials);
+        }
+    });
+
+    if (std::find(invalidChunks.begin(), invalidChunks.end(), 1) != invalidChunks.end())
+    {
+        throw std::runtime_error("Failed to load face!");
+    }
+
+    return size;
+}
@@ -0,0 +1,59 @@
+#ifndef OBJ_LOADER_HPP
+#define OBJ_LOADER_HPP
+
+#include "mathlib/mathlib.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 0-based position, texcoord and normal index of a face corner
+struct ObjCorner
+{
+    unsigned int position, texcoord, normal;
+
+    bool operator==(const ObjCorner& other) const
+    {
+        return position == other.position && texcoord == other.texcoord && normal == other.normal;
+    }
+
+};
+
+struct ObjCornerHash
+{
+    size_t operator()(const ObjCorner& corner) const
+    {
+        uint64_t hash = corner.position * 0x9E3779B97F4A7C15ULL;
+        hash ^= (corner.texcoord + 0x7F4A7C15ULL + (hash << 6) + (hash >> 2)) * 0xC2B2AE3D27D4EB4FULL;
+        hash ^= (corner.normal + 0x27D4EB4FULL + (hash << 6) + (hash >> 2)) * 0x165667B19E3779F9ULL;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+
+};
+
+// Contents of an OBJ file in file order
+struct ObjMesh
+{
+    std::vector<float3> positions;
+    std::vector<float2> texcoords;
+    std::vector<float3> normals;
+    // Three corners per triangle
+    std::vector<ObjCorner> corners;
+    // Material of every triangle, ~0u before the first known usemtl
+    std::vector<unsigned int> materials;
+
+};
+
+// Parses triangles with position/texcoord/normal indices. The mapped file is
+// split into line aligned chunks that are parsed in parallel and merged in
+// file order, so the result does not depend on the thread count.
+class ObjLoader
+{
+public:
+    // Throws std::runtime_error if the file cannot be opened or a face is invalid.
+    // Returns the file size in bytes.
+    static size_t Load(const std::string& filename, const std::unordered_map<std::string, unsigned int>& materialIndices, ObjMesh& mesh);
+};
+
+#endif // OBJ_LOADER_HPP
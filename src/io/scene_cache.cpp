@@ -0,0 +1,191 @@
+#include "scene_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+static const char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E' };
+// Increment whenever the layout of the file or of a cached struct changes
+static const uint32_t SCENE_CACHE_VERSION = 4;
+static const uint64_t SCENE_CACHE_ALIGNMENT = 4096;
+
+struct SceneCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t key;
+    uint64_t fileSize;
+
+};
+
+struct SceneCacheSectionEntry
+{
+    uint32_t type;
+    uint32_t elementSize;
+    uint64_t count;
+    uint64_t offset;
+
+};
+
+static uint64_t AlignOffset(uint64_t offset)
+{
+    return (offset + SCENE_CACHE_ALIGNMENT - 1) & ~(SCENE_CACHE_ALIGNMENT - 1);
+}
+
+uint64_t SceneCache::Hash(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t SceneCache::HashFile(const std::string& filename, uint64_t seed)
+{
+    uint64_t hash = Hash(filename.data(), filename.size(), seed);
+    MappedFile file;
+    if (file.Open(filename))
+    {
+        hash = Hash(file.GetData(), file.GetSize(), hash);
+    }
+    return hash;
+}
+
+uint64_t SceneCache::HashFileStamp(const std::string& filename, uint64_t seed)
+{
+    uint64_t hash = Hash(filename.data(), filename.size(), seed);
+    struct stat status;
+    if (stat(filename.c_str(), &status) == 0)
+    {
+        uint64_t stamp[2] = { static_cast<uint64_t>(status.st_size), static_cast<uint64_t>(status.st_mtime) };
+        hash = Hash(stamp, sizeof(stamp), hash);
+    }
+    return hash;
+}
+
+bool SceneCache::Write(const std::string& filename, uint64_t key, const std::vector<Section>& sections)
+{
+    SceneCacheHeader header;
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCENE_CACHE_VERSION;
+    header.sectionCount = static_cast<uint32_t>(sections.size());
+    header.key = key;
+
+    std::vector<SceneCacheSectionEntry> entries(sections.size());
+    uint64_t offset = sizeof(SceneCacheHeader) + sections.size() * sizeof(SceneCacheSectionEntry);
+    for (size_t i = 0; i < sections.size(); ++i)
+    {
+        offset = AlignOffset(offset);
+        entries[i].type = static_cast<uint32_t>(sections[i].type);
+        entries[i].elementSize = sections[i].elementSize;
+        entries[i].count = sections[i].count;
+        entries[i].offset = offset;
+        offset += sections[i].count * sections[i].elementSize;
+    }
+    header.fileSize = offset;
+
+    // Write to a temporary file first, a crash must not leave a truncated cache behind
+    std::string tempFilename = filename + ".tmp";
+    FILE* file = fopen(tempFilename.c_str(), "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    static const char padding[SCENE_CACHE_ALIGNMENT] = {};
+    bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (!entries.empty())
+    {
+        success = success && fwrite(entries.data(), sizeof(SceneCacheSectionEntry), entries.size(), file) == entries.size();
+    }
+    uint64_t position = sizeof(SceneCacheHeader) + entries.size() * sizeof(SceneCacheSectionEntry);
+    for (size_t i = 0; i < sections.size() && success; ++i)
+    {
+        size_t paddingSize = static_cast<size_t>(entries[i].offset - position);
+        size_t dataSize = static_cast<size_t>(sections[i].count * sections[i].elementSize);
+        success = fwrite(padding, 1, paddingSize, file) == paddingSize &&
+            (dataSize == 0 || fwrite(sections[i].data, 1, dataSize, file) == dataSize);
+        position = entries[i].offset + dataSize;
+    }
+    success = fclose(file) == 0 && success;
+
+    if (success)
+    {
+        remove(filename.c_str());
+        success = rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+    if (!success)
+    {
+        remove(tempFilename.c_str());
+    }
+    return success;
+}
+
+bool SceneCache::Load(const std::string& filename, uint64_t key)
+{
+    return Open(filename, &key);
+}
+
+bool SceneCache::Load(const std::string& filename)
+{
+    return Open(filename, nullptr);
+}
+
+bool SceneCache::Open(const std::string& filename, const uint64_t* key)
+{
+    if (!m_File.Open(filename))
+    {
+        return false;
+    }
+
+    const SceneCacheHeader* header = reinterpret_cast<const SceneCacheHeader*>(m_File.GetData());
+    if (m_File.GetSize() < sizeof(SceneCacheHeader) ||
+        memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SCENE_CACHE_VERSION ||
+        (key && header->key != *key) ||
+        header->fileSize != m_File.GetSize() ||
+        m_File.GetSize() < sizeof(SceneCacheHeader) + header->sectionCount * sizeof(SceneCacheSectionEntry))
+    {
+        m_File.Close();
+        return false;
+    }
+
+    return true;
+}
+
+void SceneCache::Close()
+{
+    m_File.Close();
+}
+
+const void* SceneCache::GetSection(SceneCacheSection_t type, uint32_t elementSize, uint64_t& count) const
+{
+    count = 0;
+    if (!m_File.IsOpen())
+    {
+        return nullptr;
+    }
+
+    const SceneCacheHeader* header = reinterpret_cast<const SceneCacheHeader*>(m_File.GetData());
+    const SceneCacheSectionEntry* entries = reinterpret_cast<const SceneCacheSectionEntry*>(header + 1);
+    for (uint32_t i = 0; i < header->sectionCount; ++i)
+    {
+        const SceneCacheSectionEntry& entry = entries[i];
+        if (entry.type != static_cast<uint32_t>(type))
+        {
+            continue;
+        }
+        if (entry.elementSize != elementSize || entry.offset + entry.count * entry.elementSize > m_File.GetSize())
+        {
+            return nullptr;
+        }
+        count = entry.count;
+        return m_File.GetData() + entry.offset;
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,84 @@
+#ifndef SCENE_CACHE_HPP
+#define SCENE_CACHE_HPP
+
+#include "io/mapped_file.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class SceneCacheSection_t : uint32_t
+{
+    NODES,
+    TRIANGLE_GEOMETRY,
+    MATERIALS,
+    WIDE_NODES,
+    TRIANGLE_ATTRIBUTES,
+    VERTEX_ATTRIBUTES,
+    COMPRESSED_VERTEX_ATTRIBUTES,
+    SCENE_INFO,
+    ENVIRONMENT_LEVELS,
+    ENVIRONMENT_TEXELS,
+    ENVIRONMENT_ALIASES,
+    PROGRAM_BINARY,
+};
+
+// Layout parameters of the stored arrays, the SCENE_INFO section holds one
+struct SceneInfo
+{
+    uint32_t bvhWidth;
+    uint32_t compressedVertices;
+
+};
+
+// Versioned binary file of flat scene arrays, used for the BVH cache and for
+// .rtscene files, also for the environment and OpenCL program binary caches. Every section starts on a page boundary, so the mapped data
+// can be used in place, also directly as OpenCL host memory.
+//
+// Layout: header, section table, section data
+class SceneCache
+{
+public:
+    struct Section
+    {
+        SceneCacheSection_t type;
+        uint32_t elementSize;
+        uint64_t count;
+        const void* data;
+    };
+
+    // FNV-1a hash, chain _seed_ to combine several inputs into one key
+    static uint64_t Hash(const void* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+    // Hashes the file contents, a missing file hashes its name only
+    static uint64_t HashFile(const std::string& filename, uint64_t seed = 14695981039346656037ULL);
+    // Hashes the name, size and modification time only, for inputs that are too large to hash on every start
+    static uint64_t HashFileStamp(const std::string& filename, uint64_t seed = 14695981039346656037ULL);
+
+    static bool Write(const std::string& filename, uint64_t key, const std::vector<Section>& sections);
+
+    // Maps the file, fails if it is missing, of another version or built for another key
+    bool Load(const std::string& filename, uint64_t key);
+    // Maps the file regardless of its key
+    bool Load(const std::string& filename);
+    void Close();
+    bool IsOpen() const { return m_File.IsOpen(); }
+
+    // Mapped section data, nullptr if the section is missing or has another element size
+    const void* GetSection(SceneCacheSection_t type, uint32_t elementSize, uint64_t& count) const;
+
+    template <typename T>
+    const T* GetSection(SceneCacheSection_t type, uint64_t& count) const
+    {
+        return static_cast<const T*>(GetSection(type, sizeof(T), count));
+    }
+
+    size_t GetSize() const { return m_File.GetSize(); }
+
+private:
+    bool Open(const std::string& filename, const uint64_t* key);
+
+private:
+    MappedFile m_File;
+
+};
+
+#endif // SCENE_CACHE_HPP
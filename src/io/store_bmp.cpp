@@ -1,8 +1,7 @@
 // Adapted from https://github.com/sol-prog/cpp-bmp-images/blob/master/BMP.h (GNU General Public License v3.0)
 
 #include <fstream>
-#include <cmath>
-#include <memory>
+#include <stdexcept>
 #include "store_bmp.hpp"
 
 #pragma pack(push, 1)
@@ -29,38 +28,51 @@ struct BMPInfoHeader {
     uint32_t colors_used{ 0 };             // No. color indexes in the color table. Use 0 for the max number of colors allowed by bit_count
     uint32_t colors_important{ 0 };        // No. of colors used for displaying the bitmap. If 0 all colors are required
 };
-#pragma pack(pop)
 
-bool StoreBMP::Store(const char *fileName, const std::shared_ptr<Viewport>& vp) {
+struct BMPColorHeader {
+    uint32_t red_mask{ 0x000000ff };         // Bit mask for the red channel
+    uint32_t green_mask{ 0x0000ff00 };       // Bit mask for the green channel
+    uint32_t blue_mask{ 0x00ff0000 };        // Bit mask for the blue channel
+    uint32_t alpha_mask{ 0xff000000 };       // Bit mask for the alpha channel
+    uint32_t color_space_type{ 0x73524742 }; // Default "sRGB" (0x73524742)
+    uint32_t unused[16]{ 0 };                // Unused data for sRGB color space
+};
+#pragma pack(pop)
 
-    if (vp->width % 4 != 0)
-    {
-        throw std::runtime_error("Storing images with width % 4 != 0 is not supported.");
-    }
+bool StoreBMP::Store(const char *fileName, unsigned int width, unsigned int height, const uint32_t* pixels, PixelFormat_t format) {
 
-    std::ofstream of(fileName);
+    std::ofstream of(fileName, std::ios::binary);
     if (of)
     {
         BMPFileHeader file_header;
         BMPInfoHeader bmp_info_header;
+        BMPColorHeader bmp_color_header;
 
-        bmp_info_header.size = sizeof(BMPInfoHeader);
-        bmp_info_header.width = vp->width;
-        bmp_info_header.height = vp->height;
+        bmp_info_header.size = sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+        bmp_info_header.width = width;
+        bmp_info_header.height = height;
         bmp_info_header.bit_count = 32;
+        bmp_info_header.compression = 3;   // BI_BITFIELDS, the masks of the color header apply
 
-        assert(bmp_info_header.width * bmp_info_header.height * bmp_info_header.bit_count % 8 == 0);
+        if (format == PixelFormat_t::RGB10A2)
+        {
+            bmp_color_header.red_mask = 0x000003ff;
+            bmp_color_header.green_mask = 0x000ffc00;
+            bmp_color_header.blue_mask = 0x3ff00000;
+            bmp_color_header.alpha_mask = 0xc0000000;
+        }
 
-        file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader);
-        file_header.file_size = file_header.offset_data + (bmp_info_header.width * bmp_info_header.height * bmp_info_header.bit_count / 8);
+        size_t data_size = size_t(width) * height * sizeof(uint32_t);
+        file_header.offset_data = sizeof(BMPFileHeader) + sizeof(BMPInfoHeader) + sizeof(BMPColorHeader);
+        file_header.file_size = static_cast<uint32_t>(file_header.offset_data + data_size);
 
         of.write((const char *) &file_header, sizeof(file_header));
         of.write((const char *) &bmp_info_header, sizeof(bmp_info_header));
-
-        for (int i = 0; i < vp->width * vp->height * 4; ++i)
+        of.write((const char *) &bmp_color_header, sizeof(bmp_color_header));
+        of.write((const char *) pixels, data_size);
+        if (!of)
         {
-            uint8_t value = static_cast<uint8_t>(roundf(vp->pixels[i] * 255.0f));
-            of << value;
+            throw std::runtime_error("Unable to write the output image file.");
         }
 
     }
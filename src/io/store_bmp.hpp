@@ -1,13 +1,15 @@
 #ifndef RAYTRACING_STORE_BMP_HPP
 #define RAYTRACING_STORE_BMP_HPP
 
-#include <mathlib/mathlib.hpp>
-#include <utils/viewport.hpp>
+#include "utils/pixel_format.hpp"
+#include <cstdint>
 
 class StoreBMP
 {
 public:
-    static bool Store(const char *fileName, const std::shared_ptr<Viewport>& vp);
+    // Writes the packed _pixels_ as they are, bit masks in the header describe the channel layout of _format_.
+    // Rows are stored bottom-up, the order the render kernels produce them in.
+    static bool Store(const char *fileName, unsigned int width, unsigned int height, const uint32_t* pixels, PixelFormat_t format);
 };
 
 #endif //RAYTRACING_STORE_BMP_HPP
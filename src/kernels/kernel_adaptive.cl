@@ -0,0 +1,65 @@
+// Adaptive sampling: rebuilds the list of pixels the next frame traces from the accumulation the
+// render kernels built with ADAPTIVE_SAMPLING. A pixel stays in the list until it has MIN_SAMPLES
+// samples and the standard error of its mean luminance is below _threshold_ relative to the
+// luminance. activePixels[0] holds the count of the pixels that follow, the host zeroes it.
+// Every work-group reserves its range with one atomic, so neighbouring pixels stay together in the
+// list and the render work-groups trace coherent rays.
+
+#ifndef MIN_SAMPLES
+#define MIN_SAMPLES 16
+#endif
+
+// Keeps the relative error of nearly black pixels finite
+#define LUMINANCE_EPSILON 0.01f
+
+float Luminance(float3 color)
+{
+    return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+__kernel void CompactActivePixels
+(
+    const __global float4* accumulation,
+    const __global uint* sampleCounts,
+    __global uint* activePixels,
+    uint pixelCount,
+    float threshold
+)
+{
+    __local uint groupCount;
+    __local uint groupOffset;
+
+    uint pixel = get_global_id(0);
+    if (get_local_id(0) == 0)
+    {
+        groupCount = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Work-items past the end take part in the barriers
+    bool active = false;
+    if (pixel < pixelCount)
+    {
+        uint sampleCount = sampleCounts[pixel];
+        float4 value = accumulation[pixel];
+        float mean = Luminance(value.xyz);
+        float variance = max(value.w - mean * mean, 0.0f);
+        float error = sqrt(variance / max(sampleCount, 1u)) / (mean + LUMINANCE_EPSILON);
+        active = sampleCount < MIN_SAMPLES || error > threshold;
+    }
+
+    uint index = active ? atomic_inc(&groupCount) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0)
+    {
+        groupOffset = atomic_add(&activePixels[0], groupCount);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (active)
+    {
+        activePixels[1 + groupOffset + index] = pixel;
+    }
+
+}
@@ -1,4 +1,5 @@
 #include "src/utils/shared_structs.hpp"
+#include "src/kernels/sampler.cl"
 
 #define MAX_RENDER_DIST 20000.0f
 #define PI 3.14159265359f
@@ -6,6 +7,50 @@
 #define INV_PI 0.31830988618f
 #define INV_TWO_PI 0.15915494309f
 
+#ifdef WIDE_BVH
+#ifndef WIDE_BVH_WIDTH
+#define WIDE_BVH_WIDTH 8
+#endif
+// Every visited node pushes at most WIDE_BVH_WIDTH - 1 more entries than it pops, the host sizes
+// the stack from the depth of the tree it built or loaded
+#ifndef WIDE_BVH_STACK_SIZE
+#define WIDE_BVH_STACK_SIZE ((WIDE_BVH_WIDTH - 1) * 24 + 1)
+#endif
+typedef WideBVHNode BVHNode;
+#else
+typedef LinearBVHNode BVHNode;
+#endif
+
+// Mip levels of the environment map and the level light samples are drawn from, set by the host
+#ifndef ENVIRONMENT_LEVELS
+#define ENVIRONMENT_LEVELS 1
+#endif
+#ifndef ENVIRONMENT_SAMPLING_LEVEL
+#define ENVIRONMENT_SAMPLING_LEVEL 0
+#endif
+// Coarsest level of the prefiltered lookups, set by the host
+#ifndef ENVIRONMENT_MAX_LOD
+#define ENVIRONMENT_MAX_LOD 0
+#endif
+
+// Path vertices, the environment is sampled at each of them, set by the host
+#ifndef MAX_DEPTH
+#define MAX_DEPTH 5
+#endif
+// Vertices before Russian roulette may end a path, set by the host
+#ifndef RR_MIN_DEPTH
+#define RR_MIN_DEPTH 3
+#endif
+// Optional features are defined by the host from render.kernel-features: DOF and BLINN here, GAMMA_CORRECTION in kernel_tonemap.cl
+// AOV_BUFFERS is defined by the host when the denoiser runs, the first hit of every path is averaged into the feature buffers then.
+// ADAPTIVE_SAMPLING is defined with adaptive sampling, frames only trace the pixels in the active pixel list then.
+
+#ifdef COMPRESSED_VERTICES
+typedef CompressedVertexAttributes ShadingVertex;
+#else
+typedef VertexAttributes ShadingVertex;
+#endif
+
 typedef struct
 {
     float3 origin;
@@ -19,16 +64,22 @@ typedef struct
     bool hit;
     Ray ray;
     float t;
+    // Barycentrics and index of the closest hit found so far
+    float u, v;
+    uint primitive;
+    // Filled from the triangle attributes once traversal is done
     float3 pos;
     float3 texcoord;
     float3 normal;
-    const __global Triangle* object;
+    const __global TriangleAttributes* object;
 } IntersectData;
 
 typedef struct
 {
-    __global Triangle* triangles;
-    __global LinearBVHNode* nodes;
+    __global TriangleGeometry* triangles;
+    __global TriangleAttributes* attributes;
+    __global ShadingVertex* vertices;
+    __global BVHNode* nodes;
     __global Material* materials;
 } Scene;
 
@@ -47,41 +98,16 @@ Ray InitRay(float3 origin, float3 dir)
     return r;
 }
 
-unsigned int HashUInt32(unsigned int x)
-{
-#if 0
-    x = (x ^ 61) ^ (x >> 16);
-    x = x + (x << 3);
-    x = x ^ (x >> 4);
-    x = x * 0x27d4eb2d;
-    x = x ^ (x >> 15);
-    return x;
-#else
-    return 1103515245 * x + 12345;
-#endif
-}
-
-float GetRandomFloat(unsigned int* seed)
-{
-    *seed = (*seed ^ 61) ^ (*seed >> 16);
-    *seed = *seed + (*seed << 3);
-    *seed = *seed ^ (*seed >> 4);
-    *seed = *seed * 0x27d4eb2d;
-    *seed = *seed ^ (*seed >> 15);
-    *seed = 1103515245 * (*seed) + 12345;
-
-    return (float)(*seed) * 2.3283064365386963e-10f;
-}
-
 float3 reflect(float3 v, float3 n)
 {
     return -v + 2.0f * dot(v, n) * n;
 }
 
-float3 SampleHemisphereCosine(float3 n, unsigned int* seed)
+float3 SampleHemisphereCosine(float3 n, Sampler* sampler)
 {
-    float phi = TWO_PI * GetRandomFloat(seed);
-    float sinThetaSqr = GetRandomFloat(seed);
+    float2 u = GetRandomFloat2(sampler);
+    float phi = TWO_PI * u.x;
+    float sinThetaSqr = u.y;
     float sinTheta = sqrt(sinThetaSqr);
 
     float3 axis = fabs(n.x) > 0.001f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
@@ -156,10 +182,10 @@ bool RayTriangle(const __global Triangle* triangle, const Ray* r, float* t, floa
 }
 
 #else
-bool RayTriangle(const Ray* r, const __global Triangle* triangle, IntersectData* isect)
+bool RayTriangle(const Ray* r, const __global TriangleGeometry* triangle, uint primitive, IntersectData* isect)
 {
-    float3 e1 = triangle->v2.position - triangle->v1.position;
-    float3 e2 = triangle->v3.position - triangle->v1.position;
+    float3 e1 = triangle->e1;
+    float3 e2 = triangle->e2;
     // Calculate planes normal vector
     float3 pvec = cross(r->dir, e2);
     float det = dot(e1, pvec);
@@ -170,7 +196,7 @@ bool RayTriangle(const Ray* r, const __global Triangle* triangle, IntersectData*
         return false;
     }
     float inv_det = 1.0f / det;
-    float3 tvec = r->origin - triangle->v1.position;
+    float3 tvec = r->origin - triangle->v0;
     float u = dot(tvec, pvec) * inv_det;
     if (u < 0.0f || u > 1.0f)
     {
@@ -186,20 +212,74 @@ bool RayTriangle(const Ray* r, const __global Triangle* triangle, IntersectData*
 
     float t = dot(e2, qvec) * inv_det;
 
-    if (t < isect->t)
+    // Hits behind the origin would occlude shadow rays
+    if (t > 0.0f && t < isect->t)
     {
         isect->hit = true;
         isect->t = t;
-        isect->pos = isect->ray.origin + isect->ray.dir * t;
-        isect->object = triangle;
-        isect->normal = normalize(u * triangle->v2.normal + v * triangle->v3.normal + (1.0f - u - v) * triangle->v1.normal);
-        isect->texcoord = u * triangle->v2.texcoord + v * triangle->v3.texcoord + (1.0f - u - v) * triangle->v1.texcoord;
+        isect->u = u;
+        isect->v = v;
+        isect->primitive = primitive;
     }
 
     return true;
 }
 #endif
 
+#ifdef COMPRESSED_VERTICES
+float3 DecodeOctahedral(uint packed)
+{
+    float2 e = max(convert_float2(as_short2(packed)) / 32767.0f, -1.0f);
+    float3 n = (float3)(e, 1.0f - fabs(e.x) - fabs(e.y));
+    // Unfold the lower hemisphere
+    float t = max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return normalize(n);
+}
+
+float3 GetVertexNormal(const __global ShadingVertex* vertex)
+{
+    return DecodeOctahedral(vertex->normal);
+}
+
+float2 GetVertexTexcoord(const __global ShadingVertex* vertex)
+{
+    return vload_half2(0, (const __global half*)&vertex->texcoord);
+}
+#else
+float3 GetVertexNormal(const __global ShadingVertex* vertex)
+{
+    return vertex->normal;
+}
+
+float2 GetVertexTexcoord(const __global ShadingVertex* vertex)
+{
+    return vertex->texcoord;
+}
+#endif
+
+// Fetches the shading data of the closest hit, traversal only touches the triangle geometry
+void FinalizeIntersection(IntersectData* isect, const Scene* scene)
+{
+    if (!isect->hit)
+    {
+        return;
+    }
+
+    const __global TriangleAttributes* attributes = &scene->attributes[isect->primitive];
+    const __global ShadingVertex* v0 = &scene->vertices[attributes->vertices[0]];
+    const __global ShadingVertex* v1 = &scene->vertices[attributes->vertices[1]];
+    const __global ShadingVertex* v2 = &scene->vertices[attributes->vertices[2]];
+    float u = isect->u;
+    float v = isect->v;
+    isect->pos = isect->ray.origin + isect->ray.dir * isect->t;
+    isect->object = attributes;
+    isect->normal = normalize(u * GetVertexNormal(v1) + v * GetVertexNormal(v2) + (1.0f - u - v) * GetVertexNormal(v0));
+    float2 texcoord = u * GetVertexTexcoord(v1) + v * GetVertexTexcoord(v2) + (1.0f - u - v) * GetVertexTexcoord(v0);
+    isect->texcoord = (float3)(texcoord, 0.0f);
+}
+
 
 bool RayBounds(const __global Bounds3* bounds, const Ray* ray, float t)
 {
@@ -216,7 +296,9 @@ bool RayBounds(const __global Bounds3* bounds, const Ray* ray, float t)
 
 }
 
-IntersectData Intersect(Ray *ray, const Scene* scene)
+#ifndef WIDE_BVH
+// Closest hit, or with _anyHit_ the first hit found
+IntersectData Traverse(Ray *ray, const Scene* scene, bool anyHit)
 {
     IntersectData isect;
     isect.hit = false;
@@ -239,8 +321,9 @@ IntersectData Intersect(Ray *ray, const Scene* scene)
                 // Intersect ray with primitives in leaf BVH node
                 for (int i = 0; i < node->nPrimitives; ++i)
                 {
-                    RayTriangle(ray, &scene->triangles[node->offset + i], &isect);
+                    RayTriangle(ray, &scene->triangles[node->offset + i], node->offset + i, &isect);
                 }
+                if (anyHit && isect.hit) break;
 
                 if (toVisitOffset == 0) break;
                 currentNodeIndex = nodesToVisit[--toVisitOffset];
@@ -270,21 +353,238 @@ IntersectData Intersect(Ray *ray, const Scene* scene)
     return isect;
 }
 
-float3 SampleSky(__read_only image2d_t tex, float3 dir)
+#else
+
+#if WIDE_BVH_WIDTH == 8
+#define floatW float8
+#define vloadW vload8
+#define vstoreW vstore8
+#define convert_floatW convert_float8
+#elif WIDE_BVH_WIDTH == 4
+#define floatW float4
+#define vloadW vload4
+#define vstoreW vstore4
+#define convert_floatW convert_float4
+#else
+#error "WIDE_BVH_WIDTH must be 4 or 8"
+#endif
+
+// Slab test of all child boxes of _node_ at once, returns the entry distances and whether each box is hit
+void IntersectChildren(const __global WideBVHNode* node, const Ray* ray, float tMax, float* tNear, int* hitMask)
+{
+    float3 origin = (float3)(node->origin[0], node->origin[1], node->origin[2]);
+    float3 scale = (float3)(as_float((uint)node->exponent[0] << 23),
+                            as_float((uint)node->exponent[1] << 23),
+                            as_float((uint)node->exponent[2] << 23));
+    // Child box planes relative to the ray origin, scaled by the inverse direction
+    float3 o = (origin - ray->origin) * ray->invDir;
+    float3 s = scale * ray->invDir;
+
+    floatW tx0 = o.x + convert_floatW(vloadW(0, node->qlo[0])) * s.x;
+    floatW tx1 = o.x + convert_floatW(vloadW(0, node->qhi[0])) * s.x;
+    floatW ty0 = o.y + convert_floatW(vloadW(0, node->qlo[1])) * s.y;
+    floatW ty1 = o.y + convert_floatW(vloadW(0, node->qhi[1])) * s.y;
+    floatW tz0 = o.z + convert_floatW(vloadW(0, node->qlo[2])) * s.z;
+    floatW tz1 = o.z + convert_floatW(vloadW(0, node->qhi[2])) * s.z;
+
+    floatW t0 = max(max(min(tx0, tx1), min(ty0, ty1)), max(min(tz0, tz1), 0.0f));
+    // Widen the far distance a little, the planes are computed in a different order than on the host
+    floatW t1 = min(min(min(max(tx0, tx1), max(ty0, ty1)), max(tz0, tz1)) * 1.00001f, tMax);
+    vstoreW(t0, 0, tNear);
+
+    int mask = 0;
+    float tFar[WIDE_BVH_WIDTH];
+    vstoreW(t1, 0, tFar);
+    for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+    {
+        mask |= (tNear[i] <= tFar[i]) << i;
+    }
+    *hitMask = mask;
+}
+
+// Closest hit, or with _anyHit_ the first hit found
+IntersectData Traverse(Ray *ray, const Scene* scene, bool anyHit)
 {
-    //return 0.0f;
-    const sampler_t smp = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_REPEAT | CLK_FILTER_LINEAR;
+    IntersectData isect;
+    isect.hit = false;
+    isect.ray = *ray;
+    isect.t = MAX_RENDER_DIST;
+
+    uint nodesToVisit[WIDE_BVH_STACK_SIZE];
+    int toVisitOffset = 0;
+    uint currentNodeIndex = 0;
+    while (true)
+    {
+        const __global WideBVHNode* node = &scene->nodes[currentNodeIndex];
+
+        float tNear[WIDE_BVH_WIDTH];
+        int hitMask;
+        IntersectChildren(node, ray, isect.t, tNear, &hitMask);
 
-    // Convert (normalized) dir to spherical coordinates.
-    float2 coords = (float2)(atan2(dir.x, dir.y) + PI, acos(dir.z));
+        // Interior children that are hit, sorted by decreasing distance
+        uint hitNodes[WIDE_BVH_WIDTH];
+        float hitDist[WIDE_BVH_WIDTH];
+        int hitCount = 0;
+        for (int i = 0; i < WIDE_BVH_WIDTH; ++i)
+        {
+            uchar meta = node->meta[i];
+            bool inner = (node->innerMask >> i) & 1;
+            if (!((hitMask >> i) & 1) || (!inner && meta == 0))
+            {
+                continue;
+            }
+
+            if (inner)
+            {
+                int j = hitCount++;
+                while (j > 0 && hitDist[j - 1] < tNear[i])
+                {
+                    hitDist[j] = hitDist[j - 1];
+                    hitNodes[j] = hitNodes[j - 1];
+                    --j;
+                }
+                hitDist[j] = tNear[i];
+                hitNodes[j] = node->childBaseIndex + meta;
+            }
+            else
+            {
+                // Intersect ray with the triangles of the leaf right away
+                uint first = node->triangleBaseIndex + (meta & 31);
+                uint count = meta >> 5;
+                for (uint k = 0; k < count; ++k)
+                {
+                    RayTriangle(ray, &scene->triangles[first + k], first + k, &isect);
+                }
+            }
+        }
+        if (anyHit && isect.hit) break;
+
+        // Push far children first, so the nearest one is visited next
+        for (int j = 0; j < hitCount; ++j)
+        {
+            nodesToVisit[toVisitOffset++] = hitNodes[j];
+        }
+
+        if (toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+
+    return isect;
+}
+#endif
+
+IntersectData Intersect(Ray *ray, const Scene* scene)
+{
+    IntersectData isect = Traverse(ray, scene, false);
+    FinalizeIntersection(&isect, scene);
+    return isect;
+}
+
+// Shadow rays stop at the first hit and skip the shading data
+bool Occluded(Ray *ray, const Scene* scene)
+{
+    return Traverse(ray, scene, true).hit;
+}
+
+float3 FetchEnvironment(const __global half* environment, EnvironmentLevel level, int x, int y)
+{
+    return vload_half3(level.offset + y * level.width + x, environment);
+}
+
+// Convert (normalized) dir to spherical coordinates in [0, 1]
+float2 DirectionToEquirect(float3 dir)
+{
+    float2 coords = (float2)(atan2(dir.x, dir.y) + PI, acos(clamp(dir.z, -1.0f, 1.0f)));
     coords.x = coords.x < 0.0f ? coords.x + TWO_PI : coords.x;
     coords.x *= INV_TWO_PI;
     coords.y *= INV_PI;
+    return coords;
+}
 
-    return read_imagef(tex, smp, coords).xyz;
+float3 EquirectToDirection(float2 coords)
+{
+    float phi = coords.x * TWO_PI - PI;
+    float theta = coords.y * PI;
+    float sinTheta = sin(theta);
+    return (float3)(sinTheta * sin(phi), sinTheta * cos(phi), cos(theta));
+}
+
+// _roughness_ is the widest lobe along the path, 0 for camera rays and 1 after diffuse bounces
+float3 SampleSky(const __global half* environment, __constant EnvironmentLevel* levels, float3 dir, float roughness)
+{
+    //return 0.0f;
+    float2 coords = DirectionToEquirect(dir);
+
+    // Level whose texels cover about the solid angle of the lobe, pi * roughness^2
+    // against 2 * pi^2 / (width * height) for a texel of the finest level. A diffuse lobe
+    // would pick a level of a few texels, the clamp keeps the lookup close to the map and
+    // no coarser than the level light samples are drawn from.
+    float lod = 0.5f * log2(max(roughness * roughness * levels[0].width * levels[0].height * INV_TWO_PI, 1.0f));
+    EnvironmentLevel level = levels[min((int)(lod + 0.5f), ENVIRONMENT_MAX_LOD)];
+
+    // Bilinear, repeating around the horizon and clamped at the poles
+    float x = coords.x * level.width - 0.5f;
+    float y = coords.y * level.height - 0.5f;
+    float fx = floor(x);
+    float fy = floor(y);
+    float tx = x - fx;
+    float ty = y - fy;
+    int width = (int)level.width;
+    int height = (int)level.height;
+    int x0 = (int)fx;
+    int x1 = x0 + 1;
+    x0 = x0 < 0 ? width - 1 : x0;
+    x1 = x1 >= width ? 0 : x1;
+    int y0 = clamp((int)fy, 0, height - 1);
+    int y1 = clamp((int)fy + 1, 0, height - 1);
+
+    float3 top = mix(FetchEnvironment(environment, level, x0, y0), FetchEnvironment(environment, level, x1, y0), tx);
+    float3 bottom = mix(FetchEnvironment(environment, level, x0, y1), FetchEnvironment(environment, level, x1, y1), tx);
+    return mix(top, bottom, ty);
 
 }
 
+// Solid angle density of SampleEnvironment, a texel covers 2 * pi^2 * sin(theta) / (width * height)
+float EnvironmentPdf(__constant EnvironmentLevel* levels, const __global EnvironmentAlias* aliases, float3 dir)
+{
+    EnvironmentLevel level = levels[ENVIRONMENT_SAMPLING_LEVEL];
+    float2 coords = DirectionToEquirect(dir);
+    uint x = min((uint)(coords.x * level.width), level.width - 1);
+    uint y = min((uint)(coords.y * level.height), level.height - 1);
+    float sinTheta = sqrt(max(1.0f - dir.z * dir.z, 0.0f));
+    if (sinTheta <= 0.0f)
+    {
+        return 0.0f;
+    }
+    return aliases[y * level.width + x].pdf * level.width * level.height / (2.0f * PI * PI * sinTheta);
+}
+
+// Picks a texel of the sampling level proportional to its luminance times solid angle, then a point inside it
+float3 SampleEnvironment(__constant EnvironmentLevel* levels, const __global EnvironmentAlias* aliases, float* pdf, Sampler* sampler)
+{
+    EnvironmentLevel level = levels[ENVIRONMENT_SAMPLING_LEVEL];
+    uint count = level.width * level.height;
+    float2 u = GetRandomFloat2(sampler);
+    uint index = min((uint)(u.x * count), count - 1);
+    EnvironmentAlias entry = aliases[index];
+    index = u.y < entry.threshold ? index : entry.alias;
+
+    float2 offset = GetRandomFloat2(sampler);
+    float2 coords = (float2)(((index % level.width) + offset.x) / level.width,
+                             ((index / level.width) + offset.y) / level.height);
+    float3 dir = EquirectToDirection(coords);
+    float sinTheta = sin(coords.y * PI);
+    *pdf = sinTheta > 0.0f ? aliases[index].pdf * count / (2.0f * PI * PI * sinTheta) : 0.0f;
+    return dir;
+}
+
+float PowerHeuristic(float pdf, float otherPdf)
+{
+    float pdf2 = pdf * pdf;
+    float sum = pdf2 + otherPdf * otherPdf;
+    return sum > 0.0f ? pdf2 / sum : 0.0f;
+}
+
 float3 saturate(float3 value)
 {
     return min(max(value, 0.0f), 1.0f);
@@ -311,10 +611,11 @@ float DistributionGGX(float cosTheta, float alpha)
     return alpha2 * INV_PI / pow(cosTheta * cosTheta * (alpha2 - 1.0f) + 1.0f, 2.0f);
 }
 
-float3 SampleBlinn(float3 n, float alpha, unsigned int* seed)
+float3 SampleBlinn(float3 n, float alpha, Sampler* sampler)
 {
-    float phi = TWO_PI * GetRandomFloat(seed);
-    float cosTheta = pow(GetRandomFloat(seed), 1.0f / (alpha + 1.0f));
+    float2 u = GetRandomFloat2(sampler);
+    float phi = TWO_PI * u.x;
+    float cosTheta = pow(u.y, 1.0f / (alpha + 1.0f));
     float sinTheta = sqrt(1.0f - cosTheta * cosTheta);
 
     float3 axis = fabs(n.x) > 0.001f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
@@ -325,10 +626,11 @@ float3 SampleBlinn(float3 n, float alpha, unsigned int* seed)
 
 }
 
-float3 SampleBeckmann(float3 n, float alpha, unsigned int* seed)
+float3 SampleBeckmann(float3 n, float alpha, Sampler* sampler)
 {
-    float phi = TWO_PI * GetRandomFloat(seed);
-    float cosTheta = sqrt(1.0f / (1.0f - alpha * alpha * log(GetRandomFloat(seed))));
+    float2 u = GetRandomFloat2(sampler);
+    float phi = TWO_PI * u.x;
+    float cosTheta = sqrt(1.0f / (1.0f - alpha * alpha * log(u.y)));
     float sinTheta = sqrt(1.0f - cosTheta * cosTheta);
 
     float3 axis = fabs(n.x) > 0.001f ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
@@ -339,10 +641,11 @@ float3 SampleBeckmann(float3 n, float alpha, unsigned int* seed)
 
 }
 
-float3 SampleGGX(float3 n, float alpha, float* cosTheta, unsigned int* seed)
+float3 SampleGGX(float3 n, float alpha, float* cosTheta, Sampler* sampler)
 {
-    float phi = TWO_PI * GetRandomFloat(seed);
-    float xi = GetRandomFloat(seed);
+    float2 u = GetRandomFloat2(sampler);
+    float phi = TWO_PI * u.x;
+    float xi = u.y;
     *cosTheta = sqrt((1.0f - xi) / (xi * (alpha * alpha - 1.0f) + 1.0f));
     float sinTheta = sqrt(max(0.0f, 1.0f - (*cosTheta) * (*cosTheta)));
 
@@ -358,25 +661,42 @@ float FresnelShlick(float f0, float nDotWi)
     return f0 + (1.0f - f0) * pow(1.0f - nDotWi, 5.0f);
 }
 
-float3 SampleDiffuse(float3 wo, float3* wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material, unsigned int* seed)
+float3 DiffuseAlbedo(float3 texcoord, const __global Material* material)
+{
+    float3 albedo = (sin(texcoord.x * 64) > 0) * (sin(texcoord.y * 64) > 0) + (sin(texcoord.x * 64 + PI) > 0) * (sin(texcoord.y * 64 + PI) > 0) * 2.0f;
+    return albedo * material->diffuse;
+}
+
+// Reflectance the denoiser divides the radiance by, so that it filters lighting and keeps texture detail
+float3 MaterialAlbedo(float3 texcoord, const __global Material* material)
+{
+    return DiffuseAlbedo(texcoord, material) + material->specular;
+}
+
+float3 SampleDiffuse(float3 wo, float3* wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material, Sampler* sampler)
 {
-    *wi = SampleHemisphereCosine(normal, seed);
+    *wi = SampleHemisphereCosine(normal, sampler);
     *pdf = dot(*wi, normal) * INV_PI;
 
-    float3 albedo = (sin(texcoord.x * 64) > 0) * (sin(texcoord.y * 64) > 0) + (sin(texcoord.x * 64 + PI) > 0) * (sin(texcoord.y * 64 + PI) > 0) * 2.0f;
-    return albedo * material->diffuse * INV_PI;
+    return DiffuseAlbedo(texcoord, material) * INV_PI;
+}
+
+float3 EvaluateDiffuse(float3 wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material)
+{
+    float cosTheta = dot(wi, normal);
+    *pdf = max(cosTheta, 0.0f) * INV_PI;
+    return cosTheta > 0.0f ? DiffuseAlbedo(texcoord, material) * INV_PI : 0.0f;
 }
 
-//#define BLINN
-float3 SampleSpecular(float3 wo, float3* wi, float* pdf, float3 normal, const __global Material* material, unsigned int* seed)
+float3 SampleSpecular(float3 wo, float3* wi, float* pdf, float3 normal, const __global Material* material, Sampler* sampler)
 {
 #ifdef BLINN
     float alpha = 2.0f / pow(material->roughness, 2.0f) - 2.0f;
-    float3 wh = SampleBlinn(normal, alpha, seed);
+    float3 wh = SampleBlinn(normal, alpha, sampler);
 #else
     float alpha = material->roughness;
     float cosTheta;
-    float3 wh = SampleGGX(normal, alpha, &cosTheta, seed);
+    float3 wh = SampleGGX(normal, alpha, &cosTheta, sampler);
 #endif
         *wi = reflect(wo, wh);
     if (dot(*wi, normal) * dot(wo, normal) < 0.0f) return 0.0f;
@@ -390,29 +710,76 @@ float3 SampleSpecular(float3 wo, float3* wi, float* pdf, float3 normal, const __
     return D / (4.0f * dot(*wi, normal) * dot(wo, normal)) * material->specular;
 }
 
-float3 SampleBrdf(float3 wo, float3* wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material, unsigned int* seed)
+// Value and density of SampleSpecular for a given _wi_
+float3 EvaluateSpecular(float3 wo, float3 wi, float* pdf, float3 normal, const __global Material* material)
+{
+    *pdf = 0.0f;
+    if (dot(wi, normal) * dot(wo, normal) <= 0.0f) return 0.0f;
+    float3 wh = normalize(wo + wi);
+    float cosTheta = dot(normal, wh);
+#ifdef BLINN
+    float alpha = 2.0f / pow(material->roughness, 2.0f) - 2.0f;
+    float D = DistributionBlinn(normal, wh, alpha);
+#else
+    float alpha = material->roughness;
+    float D = DistributionGGX(cosTheta, alpha);
+#endif
+    *pdf = D * cosTheta / (4.0f * dot(wo, wh));
+    return D / (4.0f * dot(wi, normal) * dot(wo, normal)) * material->specular;
+}
+
+// Sum of the lobes of _material_, _pdf_ is the density SampleBrdf samples _wi_ with
+float3 EvaluateBrdf(float3 wo, float3 wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material)
+{
+    bool doSpecular = dot(material->specular, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f;
+    bool doDiffuse = dot(material->diffuse, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f;
+
+    float3 f = 0.0f;
+    float specularPdf = 0.0f;
+    float diffusePdf = 0.0f;
+    if (doSpecular)
+    {
+        f += EvaluateSpecular(wo, wi, &specularPdf, normal, material);
+    }
+    if (doDiffuse)
+    {
+        f += EvaluateDiffuse(wi, &diffusePdf, texcoord, normal, material);
+    }
+    *pdf = doSpecular && doDiffuse ? 0.5f * (specularPdf + diffusePdf) : specularPdf + diffusePdf;
+    return f;
+}
+
+// Roughness the environment is looked up with after a bounce off _material_, 1 for diffuse
+float MaterialRoughness(const __global Material* material)
+{
+    return dot(material->diffuse, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f ? 1.0f : material->roughness;
+}
+
+float3 SampleBrdf(float3 wo, float3* wi, float* pdf, float3 texcoord, float3 normal, const __global Material* material, Sampler* sampler)
 {
     bool doSpecular = dot(material->specular, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f;
     bool doDiffuse = dot(material->diffuse, (float3)(1.0f, 1.0f, 1.0f)) > 0.0f;
 
     if (doSpecular && !doDiffuse)
     {
-        return SampleSpecular(wo, wi, pdf, normal, material, seed);
+        return SampleSpecular(wo, wi, pdf, normal, material, sampler);
     }
     else if (!doSpecular && doDiffuse)
     {
-        return SampleDiffuse(wo, wi, pdf, texcoord, normal, material, seed);
+        return SampleDiffuse(wo, wi, pdf, texcoord, normal, material, sampler);
     }
     else if (doSpecular && doDiffuse)
     {
-        if (GetRandomFloat(seed) > 0.5f)
+        // Either lobe picks the direction, both are evaluated, so the density matches EvaluateBrdf for MIS
+        if (GetRandomFloat(sampler) > 0.5f)
         {
-            return SampleSpecular(wo, wi, pdf, normal, material, seed) * 2.0f;
+            SampleSpecular(wo, wi, pdf, normal, material, sampler);
         }
         else
         {
-            return SampleDiffuse(wo, wi, pdf, texcoord, normal, material, seed) * 2.0f;
+            SampleDiffuse(wo, wi, pdf, texcoord, normal, material, sampler);
         }
+        return EvaluateBrdf(wo, *wi, pdf, texcoord, normal, material);
     }
     else
     {
@@ -421,60 +788,187 @@ float3 SampleBrdf(float3 wo, float3* wi, float* pdf, float3 texcoord, float3 nor
 
 }
 
-float3 Render(Ray* ray, const Scene* scene, unsigned int* seed, __read_only image2d_t tex)
+// Environment seen by a ray that left the scene, weighted against the light sample of the vertex that spawned it
+float3 EnvironmentMissRadiance(const __global half* environment, __constant EnvironmentLevel* environmentLevels, const __global EnvironmentAlias* environmentAliases,
+    float3 dir, float brdfPdf, float pathRoughness)
 {
-    float3 radiance = 0.0f;
-    float3 beta = 1.0f;
-            
-    for (int i = 0; i < 5; ++i)
+    float weight = brdfPdf > 0.0f ? PowerHeuristic(brdfPdf, EnvironmentPdf(environmentLevels, environmentAliases, dir)) : 1.0f;
+    return weight * max(SampleSky(environment, environmentLevels, dir, pathRoughness), 0.0f);
+}
+
+// MIS weighted contribution of one environment light sample in direction _wl_, zero if no shadow ray is needed.
+// The last vertex spawns no BRDF sample that could find the environment, its light samples get the full weight.
+float3 SampleEnvironmentLight(const IntersectData* isect, float3 wo, const __global Material* material, const __global half* environment,
+    __constant EnvironmentLevel* environmentLevels, const __global EnvironmentAlias* environmentAliases, float pathRoughness, bool lastVertex,
+    float3* wl, Sampler* sampler)
+{
+    float lightPdf = 0.0f;
+    *wl = SampleEnvironment(environmentLevels, environmentAliases, &lightPdf, sampler);
+    float lightBrdfPdf = 0.0f;
+    float3 f = EvaluateBrdf(wo, *wl, &lightBrdfPdf, isect->texcoord, isect->normal, material);
+    float cosLight = dot(*wl, isect->normal);
+    if (lightPdf <= 0.0f || lightBrdfPdf <= 0.0f || cosLight <= 0.0f)
     {
-        IntersectData isect = Intersect(ray, scene);
+        return 0.0f;
+    }
 
-        if (!isect.hit)
+    float weight = lastVertex ? 1.0f : PowerHeuristic(lightPdf, lightBrdfPdf);
+    return f * cosLight * weight / lightPdf * max(SampleSky(environment, environmentLevels, *wl, pathRoughness), 0.0f);
+}
+
+// State of a path between two bounces
+typedef struct
+{
+    Ray ray;
+    float3 radiance;
+    float3 beta;
+    // Widest lobe bounced off so far, the light samples of the next vertex look the environment up with it
+    float pathRoughness;
+    // Widest lobe before the vertex that spawned _ray_, the lookup of its miss pairs with that vertex's light sample
+    float rayRoughness;
+    // Density of the BRDF sample that spawned _ray_, 0 for camera rays
+    float brdfPdf;
+    int depth;
+#ifdef AOV_BUFFERS
+    // First hit, facing the camera at the render distance if the camera ray left the scene
+    float3 albedo;
+    float3 normal;
+    float hitDistance;
+#endif
+} Path;
+
+Path StartPath(Ray ray)
+{
+    Path path;
+    path.ray = ray;
+    path.radiance = 0.0f;
+    path.beta = 1.0f;
+    path.pathRoughness = 0.0f;
+    path.rayRoughness = 0.0f;
+    path.brdfPdf = 0.0f;
+    path.depth = 0;
+#ifdef AOV_BUFFERS
+    path.albedo = 1.0f;
+    path.normal = -ray.dir;
+    path.hitDistance = MAX_RENDER_DIST;
+#endif
+    return path;
+}
+
+// Russian roulette once a path has _depth_ >= RR_MIN_DEPTH vertices: it continues with a probability
+// that follows its throughput _beta_, and the survivors are weighted up by the same factor, so dim
+// paths end early without biasing the image. Capping the probability ends every path eventually.
+bool SurvivesRoulette(float3* beta, int depth, Sampler* sampler)
+{
+    if (depth < RR_MIN_DEPTH)
+    {
+        return true;
+    }
+
+    float survival = min(max(max(beta->x, beta->y), beta->z), 0.95f);
+    if (GetRandomFloat(sampler) >= survival)
+    {
+        return false;
+    }
+
+    *beta /= survival;
+    return true;
+}
+
+// Traces one bounce of _path_, returns false once the path has ended
+bool ExtendPath(Path* path, const Scene* scene, Sampler* sampler, const __global half* environment, __constant EnvironmentLevel* environmentLevels,
+    const __global EnvironmentAlias* environmentAliases)
+{
+    StartBounce(sampler, path->depth);
+    IntersectData isect = Intersect(&path->ray, scene);
+
+    if (!isect.hit)
+    {
+        path->radiance += path->beta * EnvironmentMissRadiance(environment, environmentLevels, environmentAliases, path->ray.dir, path->brdfPdf, path->rayRoughness);
+        return false;
+    }
+    
+    const __global Material* material = &scene->materials[isect.object->mtlIndex];
+#ifdef AOV_BUFFERS
+    if (path->depth == 0)
+    {
+        path->albedo = MaterialAlbedo(isect.texcoord, material);
+        path->normal = isect.normal;
+        path->hitDistance = isect.t;
+    }
+#endif
+    path->radiance += path->beta * material->emission * 50.0f;
+
+    float3 wo = -path->ray.dir;
+    bool lastVertex = ++path->depth == MAX_DEPTH;
+
+    // Next event estimation towards the environment
+    float3 wl;
+    float3 light = SampleEnvironmentLight(&isect, wo, material, environment, environmentLevels, environmentAliases, path->pathRoughness, lastVertex, &wl, sampler);
+    if (any(light > 0.0f))
+    {
+        Ray shadowRay = InitRay(isect.pos + wl * 0.01f, wl);
+        if (!Occluded(&shadowRay, scene))
         {
-            float3 val = beta * max(SampleSky(tex, ray->dir), 0.0f);
-            radiance += val;
-            break;
+            path->radiance += path->beta * light;
         }
-        
-        const __global Material* material = &scene->materials[isect.object->mtlIndex];
-        radiance += beta * material->emission * 50.0f;
+    }
 
-        float3 wi;
-        float3 wo = -ray->dir;
-        float pdf = 0.0f;
-        float3 f = SampleBrdf(wo, &wi, &pdf, isect.texcoord, isect.normal, material, seed);
-        if (pdf <= 0.0f) break;
+    if (lastVertex)
+    {
+        return false;
+    }
 
-        float3 mul = f * dot(wi, isect.normal) / pdf;
-        beta *= mul;
-        *ray = InitRay(isect.pos + wi * 0.01f, wi);
+    float3 wi;
+    float pdf = 0.0f;
+    float3 f = SampleBrdf(wo, &wi, &pdf, isect.texcoord, isect.normal, material, sampler);
+    if (pdf <= 0.0f)
+    {
+        return false;
+    }
 
+    path->beta *= f * dot(wi, isect.normal) / pdf;
+    if (!SurvivesRoulette(&path->beta, path->depth, sampler))
+    {
+        return false;
     }
-    
-    return max(radiance, 0.0f);
+
+    // The lobe of this vertex only widens the lookups of the vertices after it
+    path->rayRoughness = path->pathRoughness;
+    path->pathRoughness = max(path->pathRoughness, MaterialRoughness(material));
+    path->brdfPdf = pdf;
+    path->ray = InitRay(isect.pos + wi * 0.01f, wi);
+    return true;
+}
+
+Path Render(Ray* ray, const Scene* scene, Sampler* sampler, const __global half* environment, __constant EnvironmentLevel* environmentLevels,
+    const __global EnvironmentAlias* environmentAliases)
+{
+    Path path = StartPath(*ray);
+    while (ExtendPath(&path, scene, sampler, environment, environmentLevels, environmentAliases));
+    return path;
 }
 
-float2 PointInHexagon(unsigned int* seed)
+float2 PointInHexagon(Sampler* sampler)
 {
     float2 hexPoints[3] = { (float2)(-1.0f, 0.0f), (float2)(0.5f, 0.866f), (float2)(0.5f, -0.866f) };
-    int x = floor(GetRandomFloat(seed) * 3.0f);
+    int x = floor(GetRandomFloat(sampler) * 3.0f);
     float2 v1 = hexPoints[x];
     float2 v2 = hexPoints[(x + 1) % 3];
-    float p1 = GetRandomFloat(seed);
-    float p2 = GetRandomFloat(seed);
-    return (float2)(p1 * v1.x + p2 * v2.x, p1 * v1.y + p2 * v2.y);
+    float2 p = GetRandomFloat2(sampler);
+    return (float2)(p.x * v1.x + p.y * v2.x, p.x * v1.y + p.y * v2.y);
 }
 
-Ray CreateRay(uint width, uint height, float3 cameraPos, float3 cameraFront, float3 cameraUp, unsigned int* seed)
+Ray CreateRay(uint pixel, uint width, uint height, float3 cameraPos, float3 cameraFront, float3 cameraUp, Sampler* sampler)
 {
     float invWidth = 1.0f / (float)(width), invHeight = 1.0f / (float)(height);
     float aspectratio = (float)(width) / (float)(height);
     float fov = 45.0f * 3.1415f / 180.0f;
     float angle = tan(0.5f * fov);
 
-    float x = (float)(get_global_id(0) % width) + GetRandomFloat(seed) - 0.5f;
-    float y = (float)(get_global_id(0) / width) + GetRandomFloat(seed) - 0.5f;
+    float2 jitter = GetRandomFloat2(sampler);
+    float x = (float)(pixel % width) + jitter.x - 0.5f;
+    float y = (float)(pixel / width) + jitter.y - 0.5f;
 
     x = (2.0f * ((x + 0.5f) * invWidth) - 1) * angle * aspectratio;
     y = -(1.0f - 2.0f * ((y + 0.5f) * invHeight)) * angle;
@@ -484,9 +978,7 @@ Ray CreateRay(uint width, uint height, float3 cameraPos, float3 cameraFront, flo
 #ifdef DOF
     // Simple Depth of Field
     float3 pointAimed = cameraPos + 60.0f * dir;
-    //float2 dofDir = (float2)(GetRandomFloat(seed), GetRandomFloat(seed));
-    //dofDir = normalize(dofDir * 2.0f - 1.0f) * GetRandomFloat(seed);
-    float2 dofDir = PointInHexagon(seed);
+    float2 dofDir = PointInHexagon(sampler);
     float r = 1.0f;
     float3 newPos = cameraPos + dofDir.x * r * cross(cameraFront, cameraUp) + dofDir.y * r * cameraUp;
     
@@ -496,57 +988,196 @@ Ray CreateRay(uint width, uint height, float3 cameraPos, float3 cameraFront, flo
 #endif
 }
 
-#define GAMMA_CORRECTION
+float Luminance(float3 color)
+{
+    return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+// _sampleCount_ includes _value_, the first sample replaces whatever the buffer held before
+float4 RunningAverage(float4 average, float4 value, unsigned int sampleCount)
+{
+    return sampleCount <= 1 ? value : average + (value - average) / sampleCount;
+}
+
+// Pixels the frame traces: every pixel, or with ADAPTIVE_SAMPLING the ones in _activePixels_,
+// whose first entry is their count
+uint FramePixelCount(uint width, uint height, const __global uint* activePixels)
+{
+#ifdef ADAPTIVE_SAMPLING
+    return activePixels[0];
+#else
+    return width * height;
+#endif
+}
 
-float3 ToGamma(float3 value)
+// Pixel of the frame's _index_th path
+uint FramePixel(uint index, const __global uint* activePixels)
 {
-#ifdef GAMMA_CORRECTION
-    return pow(value, 1.0f / 2.2f);
+#ifdef ADAPTIVE_SAMPLING
+    return activePixels[index + 1];
 #else
-    return value;
+    return index;
 #endif
 }
 
-float3 FromGamma(float3 value)
+// Samples of _pixel_ including the one being added: one per frame, or with ADAPTIVE_SAMPLING the pixel's own count
+uint PixelSampleCount(uint pixel, unsigned int frameCount, const __global uint* sampleCounts)
 {
-#ifdef GAMMA_CORRECTION
-    return pow(value, 2.2f);
+#ifdef ADAPTIVE_SAMPLING
+    return sampleCounts[pixel] + 1;
 #else
-    return value;
+    return frameCount + 1;
 #endif
 }
 
+// Running average of the samples in linear radiance, the tonemap kernel encodes it for output.
+// The average of the squared luminance goes to w, the variance of the pixel is estimated from it.
+// With ADAPTIVE_SAMPLING the sample is counted for the pixel.
+void AccumulateSample(__global float4* result, __global uint* sampleCounts, uint pixel, float3 radiance, unsigned int sampleCount)
+{
+    float luminance = Luminance(radiance);
+    result[pixel] = RunningAverage(result[pixel], (float4)(radiance, luminance * luminance), sampleCount);
+#ifdef ADAPTIVE_SAMPLING
+    sampleCounts[pixel] = sampleCount;
+#endif
+}
+
+#ifdef AOV_BUFFERS
+// Running averages of the first hit features, antialiased like the radiance
+void AccumulateFeatures(__global float4* albedos, __global float4* normalDepths, uint pixel, float3 albedo, float3 normal, float hitDistance,
+    unsigned int sampleCount)
+{
+    albedos[pixel] = RunningAverage(albedos[pixel], (float4)(albedo, 0.0f), sampleCount);
+    normalDepths[pixel] = RunningAverage(normalDepths[pixel], (float4)(normal, hitDistance), sampleCount);
+}
+#endif
+
+void AccumulatePath(const Path* path, uint pixel, __global float4* result, __global float4* albedos, __global float4* normalDepths,
+    __global uint* sampleCounts, unsigned int frameCount)
+{
+    uint sampleCount = PixelSampleCount(pixel, frameCount, sampleCounts);
+#ifdef AOV_BUFFERS
+    AccumulateFeatures(albedos, normalDepths, pixel, path->albedo, path->normal, path->hitDistance, sampleCount);
+#endif
+    AccumulateSample(result, sampleCounts, pixel, max(path->radiance, 0.0f), sampleCount);
+}
+
+// Arguments every render kernel starts with, in the order of RenderKernelArgument_t.
+// The feature buffers are only written with AOV_BUFFERS, the sample counts and active pixels only
+// used with ADAPTIVE_SAMPLING, the host binds null buffers otherwise.
+#define RENDER_KERNEL_ARGUMENTS \
+    __global float4* result, \
+    __global TriangleGeometry* triangles, \
+    __global TriangleAttributes* attributes, \
+    __global ShadingVertex* vertices, \
+    __global BVHNode* nodes, \
+    __global Material* materials, \
+    uint width, \
+    uint height, \
+    float3 cameraPos, \
+    float3 cameraFront, \
+    float3 cameraUp, \
+    unsigned int frameCount, \
+    const __global half* environment, \
+    __constant EnvironmentLevel* environmentLevels, \
+    const __global EnvironmentAlias* environmentAliases, \
+    __global float4* albedos, \
+    __global float4* normalDepths, \
+    __global uint* sampleCounts, \
+    const __global uint* activePixels
+
+void RenderPixel(uint pixel, RENDER_KERNEL_ARGUMENTS)
+{
+    Scene scene = { triangles, attributes, vertices, nodes, materials };
+
+    Sampler sampler = StartSampler(pixel, PixelSampleCount(pixel, frameCount, sampleCounts) - 1);
+    Ray ray = CreateRay(pixel, width, height, cameraPos, cameraFront, cameraUp, &sampler);
+    Path path = Render(&ray, &scene, &sampler, environment, environmentLevels, environmentAliases);
+    AccumulatePath(&path, pixel, result, albedos, normalDepths, sampleCounts, frameCount);
+}
+
+#define RENDER_PIXEL(pixel) RenderPixel(pixel, result, triangles, attributes, vertices, nodes, materials, width, height, \
+    cameraPos, cameraFront, cameraUp, frameCount, environment, environmentLevels, environmentAliases, albedos, normalDepths, \
+    sampleCounts, activePixels)
+
 __kernel void KernelEntry
 (
-    // Output
-    // Input
-    __global float3* result,
-    __global Triangle* triangles,
-    __global LinearBVHNode* nodes,
-    __global Material* materials,
-    uint width,
-    uint height,
-    float3 cameraPos,
-    float3 cameraFront,
-    float3 cameraUp,
-    unsigned int frameCount,
-    __read_only image2d_t tex
+    RENDER_KERNEL_ARGUMENTS
 )
 {
-    Scene scene = { triangles, nodes, materials };
+    RENDER_PIXEL(FramePixel(get_global_id(0), activePixels));
 
-    unsigned int seed = get_global_id(0) + HashUInt32(frameCount);
-    
-    Ray ray = CreateRay(width, height, cameraPos, cameraFront, cameraUp, &seed);
-    float3 radiance = Render(&ray, &scene, &seed, tex);
-        
-    if (frameCount == 0)
+}
+
+// Pixels a work-item takes from the work counter at once
+#ifndef PERSISTENT_BATCH_SIZE
+#define PERSISTENT_BATCH_SIZE 4
+#endif
+
+// Persistent threads: just enough work-groups to fill the device take batches of pixels from
+// _workCounter_ until the frame is done. A work-item whose paths ended early fetches new pixels
+// instead of waiting for a whole work-group of pixels to be retired and replaced.
+// The host zeroes _workCounter_ before every launch.
+__kernel void KernelEntryPersistent
+(
+    RENDER_KERNEL_ARGUMENTS,
+    __global uint* workCounter
+)
+{
+    uint pixelCount = FramePixelCount(width, height, activePixels);
+    while (true)
     {
-        result[get_global_id(0)] = ToGamma(radiance);
+        uint first = atomic_add(workCounter, PERSISTENT_BATCH_SIZE);
+        if (first >= pixelCount)
+        {
+            break;
+        }
+
+        uint last = min(first + PERSISTENT_BATCH_SIZE, pixelCount);
+        for (uint index = first; index < last; ++index)
+        {
+            RENDER_PIXEL(FramePixel(index, activePixels));
+        }
     }
-    else
+
+}
+
+// Path regeneration: like KernelEntryPersistent, but every loop iteration traces one bounce, and a
+// work-item whose path ended starts the path of the next pixel from _workCounter_ right away. Lanes
+// stay busy with new camera rays while their neighbours are still bouncing, instead of idling until
+// the longest path of their SIMD group is done.
+__kernel void KernelEntryRegenerate
+(
+    RENDER_KERNEL_ARGUMENTS,
+    __global uint* workCounter
+)
+{
+    Scene scene = { triangles, attributes, vertices, nodes, materials };
+    uint pixelCount = FramePixelCount(width, height, activePixels);
+    uint pixel = 0;
+    Sampler sampler;
+    Path path;
+    bool active = false;
+
+    while (true)
     {
-        result[get_global_id(0)] = ToGamma((FromGamma(result[get_global_id(0)]) * (frameCount - 1) + radiance) / frameCount);
+        if (!active)
+        {
+            uint index = atomic_inc(workCounter);
+            if (index >= pixelCount)
+            {
+                break;
+            }
+            pixel = FramePixel(index, activePixels);
+            sampler = StartSampler(pixel, PixelSampleCount(pixel, frameCount, sampleCounts) - 1);
+            path = StartPath(CreateRay(pixel, width, height, cameraPos, cameraFront, cameraUp, &sampler));
+        }
+
+        active = ExtendPath(&path, &scene, &sampler, environment, environmentLevels, environmentAliases);
+        if (!active)
+        {
+            AccumulatePath(&path, pixel, result, albedos, normalDepths, sampleCounts, frameCount);
+        }
     }
 
 }
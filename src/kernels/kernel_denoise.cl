@@ -0,0 +1,148 @@
+// Edge-avoiding a-trous wavelet filter over the accumulated frame, after SVGF. The radiance is divided
+// by the albedo of the first hit, so that only the lighting is blurred, filtered by a few passes of a
+// 5x5 B3 spline kernel with doubling gaps and multiplied by the albedo again. Neighbours contribute
+// as far as their normal and depth match the pixel's and their luminance lies within a few standard
+// deviations of its estimated noise. The variance is filtered along with the radiance.
+//
+// Filter buffers hold the demodulated radiance and its variance in w, the feature buffers come from
+// the render kernels built with AOV_BUFFERS: albedo, and the normal with the hit distance in w.
+// With ADAPTIVE_SAMPLING every pixel averaged its own number of samples.
+
+// Standard deviations of noise the luminance of a neighbour may differ by
+#ifndef SIGMA_LUMINANCE
+#define SIGMA_LUMINANCE 4.0f
+#endif
+// Exponent of the normal similarity
+#ifndef SIGMA_NORMAL
+#define SIGMA_NORMAL 128.0f
+#endif
+// Relative hit distance difference per pixel of offset
+#ifndef SIGMA_DEPTH
+#define SIGMA_DEPTH 0.02f
+#endif
+
+float Luminance(float3 color)
+{
+    return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Surfaces that reflect next to nothing keep their radiance, dividing by their albedo would blow it up
+float3 DemodulationAlbedo(float4 albedo)
+{
+    return select(albedo.xyz, (float3)(1.0f), albedo.xyz < 0.001f);
+}
+
+__kernel void DenoisePrepare
+(
+    const __global float4* accumulation,
+    const __global float4* albedos,
+    const __global uint* sampleCounts,
+    __global float4* output,
+    uint pixelCount,
+    uint sampleCount
+)
+{
+    uint pixel = get_global_id(0);
+    if (pixel >= pixelCount)
+    {
+        return;
+    }
+
+    // The accumulation holds the average radiance and the average squared luminance, their difference
+    // is the variance of one sample and the average of _sampleCount_ samples has a fraction of it
+#ifdef ADAPTIVE_SAMPLING
+    sampleCount = max(sampleCounts[pixel], 1u);
+#endif
+    float4 value = accumulation[pixel];
+    float3 albedo = DemodulationAlbedo(albedos[pixel]);
+    float mean = Luminance(value.xyz);
+    float variance = max(value.w - mean * mean, 0.0f) / sampleCount;
+    float albedoLuminance = max(Luminance(albedo), 0.001f);
+    output[pixel] = (float4)(max(value.xyz, 0.0f) / albedo, variance / (albedoLuminance * albedoLuminance));
+
+}
+
+__kernel void DenoiseFilter
+(
+    const __global float4* input,
+    const __global float4* normalDepths,
+    __global float4* output,
+    uint width,
+    uint height,
+    int stepSize
+)
+{
+    uint pixel = get_global_id(0);
+    if (pixel >= width * height)
+    {
+        return;
+    }
+
+    const float kernelWeights[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+    int x = pixel % width;
+    int y = pixel / width;
+
+    float4 center = input[pixel];
+    float4 centerFeature = normalDepths[pixel];
+    // The features are averaged over the frames, the normal is no longer unit length
+    float3 centerNormal = centerFeature.xyz * rsqrt(max(dot(centerFeature.xyz, centerFeature.xyz), 1e-12f));
+    float centerLuminance = Luminance(center.xyz);
+    float luminanceScale = 1.0f / (SIGMA_LUMINANCE * sqrt(center.w) + 1e-6f);
+
+    float3 radiance = 0.0f;
+    float variance = 0.0f;
+    float weightSum = 0.0f;
+    for (int dy = -2; dy <= 2; ++dy)
+    {
+        int qy = y + dy * stepSize;
+        if (qy < 0 || qy >= (int)height)
+        {
+            continue;
+        }
+        for (int dx = -2; dx <= 2; ++dx)
+        {
+            int qx = x + dx * stepSize;
+            if (qx < 0 || qx >= (int)width)
+            {
+                continue;
+            }
+
+            uint q = qy * width + qx;
+            float4 sample = input[q];
+            float4 feature = normalDepths[q];
+            float3 normal = feature.xyz * rsqrt(max(dot(feature.xyz, feature.xyz), 1e-12f));
+
+            float offset = stepSize * length((float2)((float)dx, (float)dy));
+            float normalWeight = pow(max(dot(centerNormal, normal), 0.0f), SIGMA_NORMAL);
+            float depthWeight = exp(-fabs(centerFeature.w - feature.w) / (SIGMA_DEPTH * centerFeature.w * offset + 1e-4f));
+            float luminanceWeight = exp(-fabs(centerLuminance - Luminance(sample.xyz)) * luminanceScale);
+            float weight = kernelWeights[abs(dx)] * kernelWeights[abs(dy)] * normalWeight * depthWeight * luminanceWeight;
+
+            radiance += weight * sample.xyz;
+            variance += weight * weight * sample.w;
+            weightSum += weight;
+        }
+    }
+
+    // Only a pixel without a valid normal can reject itself, it stays as it is
+    output[pixel] = weightSum > 0.0f ? (float4)(radiance / weightSum, variance / (weightSum * weightSum)) : center;
+
+}
+
+__kernel void DenoiseFinish
+(
+    const __global float4* input,
+    const __global float4* albedos,
+    __global float4* output,
+    uint pixelCount
+)
+{
+    uint pixel = get_global_id(0);
+    if (pixel >= pixelCount)
+    {
+        return;
+    }
+
+    output[pixel] = (float4)(input[pixel].xyz * DemodulationAlbedo(albedos[pixel]), 1.0f);
+
+}
@@ -0,0 +1,539 @@
+#include "src/utils/shared_structs.hpp"
+
+// Linear BVH construction after Karras 2012, optional treelet restructuring after Karras & Aila 2013.
+// Internal nodes are numbered 0..n-2 with the root at 0, leaf i (in Morton order) is node n-1+i.
+
+#ifndef LBVH_GROUP_SIZE
+#define LBVH_GROUP_SIZE 256
+#endif
+// Keys sorted by one work-group in a radix pass
+#define LBVH_SORT_BLOCK (LBVH_GROUP_SIZE * 4)
+#define LBVH_INVALID 0xFFFFFFFF
+
+// Leaves of a treelet, the optimization enumerates all 2^n subsets
+#define LBVH_TREELET_SIZE 5
+#define LBVH_COST_INTERNAL 1.2f
+#define LBVH_COST_TRIANGLE 1.0f
+
+float3 TriangleMin(const __global TriangleGeometry* triangle)
+{
+    return triangle->v0 + min(min(triangle->e1, triangle->e2), 0.0f);
+}
+
+float3 TriangleMax(const __global TriangleGeometry* triangle)
+{
+    return triangle->v0 + max(max(triangle->e1, triangle->e2), 0.0f);
+}
+
+float SurfaceArea(float3 bmin, float3 bmax)
+{
+    float3 d = bmax - bmin;
+    return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+void ReduceLocalBounds(__local float4* localMin, __local float4* localMax, float4* bmin, float4* bmax)
+{
+    uint lid = get_local_id(0);
+    localMin[lid] = *bmin;
+    localMax[lid] = *bmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint stride = LBVH_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+    {
+        if (lid < stride)
+        {
+            localMin[lid] = min(localMin[lid], localMin[lid + stride]);
+            localMax[lid] = max(localMax[lid], localMax[lid + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    *bmin = localMin[0];
+    *bmax = localMax[0];
+}
+
+// Exclusive prefix sum over the work-group, all work-items have to call it
+uint ScanLocalExclusive(__local uint* temp, uint value, uint* total)
+{
+    uint lid = get_local_id(0);
+    temp[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint offset = 1; offset < LBVH_GROUP_SIZE; offset <<= 1)
+    {
+        uint add = lid >= offset ? temp[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        temp[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    *total = temp[LBVH_GROUP_SIZE - 1];
+    uint result = temp[lid] - value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return result;
+}
+
+// Partial bounds of the triangle centroids, one min/max pair per work-group
+__kernel void ComputeCentroidBounds(const __global TriangleGeometry* triangles, uint n, __global float4* partialBounds)
+{
+    __local float4 localMin[LBVH_GROUP_SIZE];
+    __local float4 localMax[LBVH_GROUP_SIZE];
+
+    float4 bmin = (float4)(FLT_MAX);
+    float4 bmax = (float4)(-FLT_MAX);
+    for (uint i = get_global_id(0); i < n; i += get_global_size(0))
+    {
+        float4 centroid = (float4)((TriangleMin(&triangles[i]) + TriangleMax(&triangles[i])) * 0.5f, 0.0f);
+        bmin = min(bmin, centroid);
+        bmax = max(bmax, centroid);
+    }
+
+    ReduceLocalBounds(localMin, localMax, &bmin, &bmax);
+    if (get_local_id(0) == 0)
+    {
+        partialBounds[get_group_id(0) * 2] = bmin;
+        partialBounds[get_group_id(0) * 2 + 1] = bmax;
+    }
+}
+
+// Launched with a single work-group
+__kernel void ReduceBounds(const __global float4* partialBounds, uint count, __global float4* sceneBounds)
+{
+    __local float4 localMin[LBVH_GROUP_SIZE];
+    __local float4 localMax[LBVH_GROUP_SIZE];
+
+    float4 bmin = (float4)(FLT_MAX);
+    float4 bmax = (float4)(-FLT_MAX);
+    for (uint i = get_local_id(0); i < count; i += LBVH_GROUP_SIZE)
+    {
+        bmin = min(bmin, partialBounds[i * 2]);
+        bmax = max(bmax, partialBounds[i * 2 + 1]);
+    }
+
+    ReduceLocalBounds(localMin, localMax, &bmin, &bmax);
+    if (get_local_id(0) == 0)
+    {
+        sceneBounds[0] = bmin;
+        sceneBounds[1] = bmax;
+    }
+}
+
+// Spreads the lower 10 bits of v so that there are two zero bits between each
+uint ExpandBits(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+__kernel void ComputeMortonCodes(const __global TriangleGeometry* triangles, uint n, const __global float4* sceneBounds,
+    __global uint* codes, __global uint* indices)
+{
+    uint i = get_global_id(0);
+    if (i >= n) return;
+
+    float3 sceneMin = sceneBounds[0].xyz;
+    float3 extent = max(sceneBounds[1].xyz - sceneMin, 1e-20f);
+    float3 centroid = (TriangleMin(&triangles[i]) + TriangleMax(&triangles[i])) * 0.5f;
+    float3 p = clamp((centroid - sceneMin) / extent * 1024.0f, 0.0f, 1023.0f);
+
+    codes[i] = ExpandBits((uint)p.x) * 4 + ExpandBits((uint)p.y) * 2 + ExpandBits((uint)p.z);
+    indices[i] = i;
+}
+
+// One bit LSD radix sort pass: count, scan, stable scatter
+
+__kernel void RadixCountZeros(const __global uint* keys, uint n, uint bit, __global uint* groupZeros)
+{
+    __local uint localCount[LBVH_GROUP_SIZE];
+
+    uint lid = get_local_id(0);
+    uint blockStart = get_group_id(0) * LBVH_SORT_BLOCK;
+    uint blockEnd = min(blockStart + LBVH_SORT_BLOCK, n);
+
+    uint count = 0;
+    for (uint i = blockStart + lid; i < blockEnd; i += LBVH_GROUP_SIZE)
+    {
+        count += ((keys[i] >> bit) & 1) == 0;
+    }
+
+    localCount[lid] = count;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = LBVH_GROUP_SIZE / 2; stride > 0; stride >>= 1)
+    {
+        if (lid < stride)
+        {
+            localCount[lid] += localCount[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+    {
+        groupZeros[get_group_id(0)] = localCount[0];
+    }
+}
+
+// Launched with a single work-group, turns the counts into offsets and stores the total at groupZeros[nGroups]
+__kernel void ScanGroupZeros(__global uint* groupZeros, uint nGroups)
+{
+    __local uint temp[LBVH_GROUP_SIZE];
+
+    uint carry = 0;
+    for (uint base = 0; base < nGroups; base += LBVH_GROUP_SIZE)
+    {
+        uint i = base + get_local_id(0);
+        uint value = i < nGroups ? groupZeros[i] : 0;
+        uint total;
+        uint prefix = ScanLocalExclusive(temp, value, &total);
+        if (i < nGroups)
+        {
+            groupZeros[i] = carry + prefix;
+        }
+        carry += total;
+    }
+
+    if (get_local_id(0) == 0)
+    {
+        groupZeros[nGroups] = carry;
+    }
+}
+
+__kernel void RadixScatter(const __global uint* keysIn, const __global uint* valuesIn,
+    __global uint* keysOut, __global uint* valuesOut, uint n, uint bit,
+    const __global uint* groupZeros, uint nGroups)
+{
+    __local uint temp[LBVH_GROUP_SIZE];
+
+    uint lid = get_local_id(0);
+    uint blockStart = get_group_id(0) * LBVH_SORT_BLOCK;
+    uint zeroBase = groupZeros[get_group_id(0)];
+    // All blocks in front of this one are full
+    uint oneBase = groupZeros[nGroups] + blockStart - zeroBase;
+
+    uint zerosSoFar = 0, onesSoFar = 0;
+    for (uint chunk = 0; chunk < LBVH_SORT_BLOCK; chunk += LBVH_GROUP_SIZE)
+    {
+        uint chunkStart = blockStart + chunk;
+        uint i = chunkStart + lid;
+        bool valid = i < n;
+        uint key = valid ? keysIn[i] : 0;
+        uint isZero = (valid && ((key >> bit) & 1) == 0) ? 1 : 0;
+
+        uint chunkZeros;
+        uint zeroRank = ScanLocalExclusive(temp, isZero, &chunkZeros);
+        if (valid)
+        {
+            // Invalid items only occur at the end, so lid - zeroRank counts the ones in front
+            uint dst = isZero ? zeroBase + zerosSoFar + zeroRank : oneBase + onesSoFar + lid - zeroRank;
+            keysOut[dst] = key;
+            valuesOut[dst] = valuesIn[i];
+        }
+
+        uint chunkValid = chunkStart < n ? min(n - chunkStart, (uint)LBVH_GROUP_SIZE) : 0;
+        zerosSoFar += chunkZeros;
+        onesSoFar += chunkValid - chunkZeros;
+    }
+}
+
+// Length of the common prefix of two keys, ties are broken by the key index
+int Delta(const __global uint* codes, uint n, int i, int j)
+{
+    if (j < 0 || j >= (int)n) return -1;
+    uint a = codes[i];
+    uint b = codes[j];
+    if (a == b) return 32 + clz((uint)(i ^ j));
+    return clz(a ^ b);
+}
+
+__kernel void BuildHierarchy(const __global uint* codes, uint n, __global uint2* children, __global uint* parents)
+{
+    int i = get_global_id(0);
+    if (i >= (int)n - 1) return;
+
+    // Direction of the range covered by this node
+    int d = Delta(codes, n, i, i + 1) - Delta(codes, n, i, i - 1) > 0 ? 1 : -1;
+
+    // Upper bound for the range length, then binary search for the other end
+    int deltaMin = Delta(codes, n, i, i - d);
+    int lmax = 2;
+    while (Delta(codes, n, i, i + lmax * d) > deltaMin)
+    {
+        lmax *= 2;
+    }
+    int l = 0;
+    for (int t = lmax / 2; t >= 1; t /= 2)
+    {
+        if (Delta(codes, n, i, i + (l + t) * d) > deltaMin)
+        {
+            l += t;
+        }
+    }
+    int j = i + l * d;
+
+    // Binary search for the split position
+    int deltaNode = Delta(codes, n, i, j);
+    int s = 0;
+    int t = l;
+    do
+    {
+        t = (t + 1) / 2;
+        if (Delta(codes, n, i, i + (s + t) * d) > deltaNode)
+        {
+            s += t;
+        }
+    } while (t > 1);
+    int gamma = i + s * d + min(d, 0);
+
+    uint left = (min(i, j) == gamma) ? n - 1 + gamma : gamma;
+    uint right = (max(i, j) == gamma + 1) ? n - 1 + gamma + 1 : gamma + 1;
+    children[i] = (uint2)(left, right);
+    parents[left] = i;
+    parents[right] = i;
+    if (i == 0)
+    {
+        parents[0] = LBVH_INVALID;
+    }
+}
+
+// Node data is written by other work-items while walking up the tree,
+// volatile keeps the reads from being served by a stale cache
+void UpdateInternalNode(uint node, const volatile __global uint2* children,
+    volatile __global float4* nodeBounds, volatile __global float* nodeCost, volatile __global uint* nodeSize)
+{
+    uint2 c = children[node];
+    float4 bmin = min(nodeBounds[c.x * 2], nodeBounds[c.y * 2]);
+    float4 bmax = max(nodeBounds[c.x * 2 + 1], nodeBounds[c.y * 2 + 1]);
+
+    nodeBounds[node * 2] = bmin;
+    nodeBounds[node * 2 + 1] = bmax;
+    nodeCost[node] = LBVH_COST_INTERNAL * SurfaceArea(bmin.xyz, bmax.xyz) + nodeCost[c.x] + nodeCost[c.y];
+    nodeSize[node] = 1 + nodeSize[c.x] + nodeSize[c.y];
+}
+
+// One work-item per leaf, the second one to arrive at a node processes it
+__kernel void ComputeNodeBounds(const __global TriangleGeometry* triangles, const __global uint* sortedIndices, uint n,
+    const __global uint2* children, const __global uint* parents,
+    volatile __global float4* nodeBounds, volatile __global float* nodeCost, volatile __global uint* nodeSize,
+    __global uint* flags)
+{
+    uint i = get_global_id(0);
+    if (i >= n) return;
+
+    uint node = n - 1 + i;
+    const __global TriangleGeometry* triangle = &triangles[sortedIndices[i]];
+    float3 bmin = TriangleMin(triangle);
+    float3 bmax = TriangleMax(triangle);
+    nodeBounds[node * 2] = (float4)(bmin, 0.0f);
+    nodeBounds[node * 2 + 1] = (float4)(bmax, 0.0f);
+    nodeCost[node] = LBVH_COST_TRIANGLE * SurfaceArea(bmin, bmax);
+    nodeSize[node] = 1;
+
+    uint parent = parents[node];
+    while (parent != LBVH_INVALID)
+    {
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&flags[parent]) == 0) return;
+
+        UpdateInternalNode(parent, children, nodeBounds, nodeCost, nodeSize);
+        parent = parents[parent];
+    }
+}
+
+// Finds the optimal topology for the treelet below _root_ and rebuilds it if that lowers the SAH cost
+void RestructureTreelet(uint root, uint n, volatile __global uint2* children, volatile __global uint* parents,
+    volatile __global float4* nodeBounds, volatile __global float* nodeCost, volatile __global uint* nodeSize)
+{
+    uint leaves[LBVH_TREELET_SIZE];
+    uint internals[LBVH_TREELET_SIZE - 1];
+
+    // Grow the treelet by expanding the leaf with the largest surface area
+    uint2 rootChildren = children[root];
+    leaves[0] = rootChildren.x;
+    leaves[1] = rootChildren.y;
+    internals[0] = root;
+    uint nLeaves = 2;
+    while (nLeaves < LBVH_TREELET_SIZE)
+    {
+        int expand = -1;
+        float largestArea = -1.0f;
+        for (uint k = 0; k < nLeaves; ++k)
+        {
+            if (leaves[k] < n - 1)
+            {
+                float area = SurfaceArea(nodeBounds[leaves[k] * 2].xyz, nodeBounds[leaves[k] * 2 + 1].xyz);
+                if (area > largestArea)
+                {
+                    largestArea = area;
+                    expand = k;
+                }
+            }
+        }
+        if (expand < 0) return;
+
+        uint2 c = children[leaves[expand]];
+        internals[nLeaves - 1] = leaves[expand];
+        leaves[expand] = c.x;
+        leaves[nLeaves++] = c.y;
+    }
+
+    // Optimal cost of every subset of treelet leaves. Proper subsets of s are
+    // numerically smaller than s, so one pass in increasing order suffices.
+    float subsetCost[1 << LBVH_TREELET_SIZE];
+    uchar subsetSplit[1 << LBVH_TREELET_SIZE];
+    for (uint s = 1; s < (1 << LBVH_TREELET_SIZE); ++s)
+    {
+        if (popcount(s) == 1)
+        {
+            subsetCost[s] = nodeCost[leaves[31 - clz(s)]];
+            continue;
+        }
+
+        float4 bmin = (float4)(FLT_MAX);
+        float4 bmax = (float4)(-FLT_MAX);
+        for (uint k = 0; k < LBVH_TREELET_SIZE; ++k)
+        {
+            if (s & (1 << k))
+            {
+                bmin = min(bmin, nodeBounds[leaves[k] * 2]);
+                bmax = max(bmax, nodeBounds[leaves[k] * 2 + 1]);
+            }
+        }
+
+        float bestCost = FLT_MAX;
+        for (uint q = (s - 1) & s; q > 0; q = (q - 1) & s)
+        {
+            float cost = subsetCost[q] + subsetCost[s ^ q];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                subsetSplit[s] = q;
+            }
+        }
+        subsetCost[s] = LBVH_COST_INTERNAL * SurfaceArea(bmin.xyz, bmax.xyz) + bestCost;
+    }
+
+    const uint fullSet = (1 << LBVH_TREELET_SIZE) - 1;
+    if (subsetCost[fullSet] >= nodeCost[root] * 0.9999f) return;
+
+    // Reuse the internal nodes of the treelet for the new topology, the root keeps its index
+    uint stackNode[LBVH_TREELET_SIZE - 1];
+    uint stackSet[LBVH_TREELET_SIZE - 1];
+    uint order[LBVH_TREELET_SIZE - 1];
+    uint stackSize = 1, nOrder = 0, nextInternal = 1;
+    stackNode[0] = root;
+    stackSet[0] = fullSet;
+    while (stackSize > 0)
+    {
+        --stackSize;
+        uint node = stackNode[stackSize];
+        uint set = stackSet[stackSize];
+        uint sides[2] = { subsetSplit[set], set ^ subsetSplit[set] };
+        uint childNodes[2];
+        for (uint k = 0; k < 2; ++k)
+        {
+            if (popcount(sides[k]) == 1)
+            {
+                childNodes[k] = leaves[31 - clz(sides[k])];
+            }
+            else
+            {
+                childNodes[k] = internals[nextInternal++];
+                stackNode[stackSize] = childNodes[k];
+                stackSet[stackSize] = sides[k];
+                ++stackSize;
+            }
+            parents[childNodes[k]] = node;
+        }
+        children[node] = (uint2)(childNodes[0], childNodes[1]);
+        order[nOrder++] = node;
+    }
+
+    // Children were assigned after their parents, update in reverse
+    for (int k = nOrder - 1; k >= 0; --k)
+    {
+        UpdateInternalNode(order[k], children, nodeBounds, nodeCost, nodeSize);
+    }
+}
+
+__kernel void OptimizeTreelets(uint n, volatile __global uint2* children, volatile __global uint* parents,
+    volatile __global float4* nodeBounds, volatile __global float* nodeCost, volatile __global uint* nodeSize,
+    __global uint* flags)
+{
+    uint i = get_global_id(0);
+    if (i >= n) return;
+
+    uint parent = parents[n - 1 + i];
+    while (parent != LBVH_INVALID)
+    {
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        if (atomic_inc(&flags[parent]) == 0) return;
+
+        // Subtrees with fewer leaves than a treelet are left as they are
+        if (nodeSize[parent] >= 2 * LBVH_TREELET_SIZE - 1)
+        {
+            RestructureTreelet(parent, n, children, parents, nodeBounds, nodeCost, nodeSize);
+        }
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+        parent = parents[parent];
+    }
+}
+
+// Position of a node in depth-first order, first children directly follow their parent
+uint DepthFirstIndex(uint node, const __global uint2* children, const __global uint* parents, const __global uint* nodeSize)
+{
+    uint index = 0;
+    uint parent = parents[node];
+    while (parent != LBVH_INVALID)
+    {
+        uint2 c = children[parent];
+        index += (node == c.x) ? 1 : 1 + nodeSize[c.x];
+        node = parent;
+        parent = parents[node];
+    }
+    return index;
+}
+
+__kernel void EmitLinearNodes(uint n, const __global uint2* children, const __global uint* parents,
+    const __global float4* nodeBounds, const __global uint* nodeSize, __global LinearBVHNode* linearNodes)
+{
+    uint node = get_global_id(0);
+    if (node >= 2 * n - 1) return;
+
+    uint index = DepthFirstIndex(node, children, parents, nodeSize);
+    __global LinearBVHNode* linearNode = &linearNodes[index];
+    linearNode->bounds.pos[0] = nodeBounds[node * 2].xyz;
+    linearNode->bounds.pos[1] = nodeBounds[node * 2 + 1].xyz;
+
+    if (node >= n - 1)
+    {
+        linearNode->offset = node - (n - 1);
+        linearNode->nPrimitives = 1;
+        linearNode->axis = 0;
+    }
+    else
+    {
+        uint2 c = children[node];
+        linearNode->offset = index + 1 + nodeSize[c.x];
+        linearNode->nPrimitives = 0;
+
+        // Traversal visits the second child first for negative ray directions along _axis_,
+        // pick the axis along which the second child lies furthest in front of the first one
+        float4 d = (nodeBounds[c.y * 2] + nodeBounds[c.y * 2 + 1]) - (nodeBounds[c.x * 2] + nodeBounds[c.x * 2 + 1]);
+        linearNode->axis = (d.x >= d.y && d.x >= d.z) ? 0 : (d.y >= d.z ? 1 : 2);
+    }
+}
+
+__kernel void GatherTriangles(const __global TriangleGeometry* sourceGeometry, const __global TriangleAttributes* sourceAttributes,
+    const __global uint* sortedIndices, uint n, __global TriangleGeometry* geometry, __global TriangleAttributes* attributes)
+{
+    uint i = get_global_id(0);
+    if (i >= n) return;
+
+    uint index = sortedIndices[i];
+    geometry[i] = sourceGeometry[index];
+    attributes[i] = sourceAttributes[index];
+}
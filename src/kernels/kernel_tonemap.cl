@@ -0,0 +1,35 @@
+// Encodes the linear accumulation buffer for output. Each pixel is packed into one uint, red in the
+// lowest bits: 8 bits per channel, or with OUTPUT_RGB10A2 10 bits per color channel and a 2 bit alpha.
+
+float3 ToGamma(float3 value)
+{
+#ifdef GAMMA_CORRECTION
+    return pow(value, 1.0f / 2.2f);
+#else
+    return value;
+#endif
+}
+
+__kernel void Tonemap
+(
+    const __global float4* accumulation,
+    __global uint* output,
+    uint pixelCount
+)
+{
+    uint pixel = get_global_id(0);
+    if (pixel >= pixelCount)
+    {
+        return;
+    }
+
+    float3 color = clamp(ToGamma(max(accumulation[pixel].xyz, 0.0f)), 0.0f, 1.0f);
+#ifdef OUTPUT_RGB10A2
+    uint3 q = convert_uint3_rte(color * 1023.0f);
+    output[pixel] = q.x | (q.y << 10) | (q.z << 20) | (3u << 30);
+#else
+    uint3 q = convert_uint3_rte(color * 255.0f);
+    output[pixel] = q.x | (q.y << 8) | (q.z << 16) | (255u << 24);
+#endif
+
+}
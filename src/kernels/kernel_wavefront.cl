@@ -0,0 +1,240 @@
+#include "src/kernels/kernel_bvh.cl"
+
+// Wavefront path tracing: the megakernel loop of Render split into one kernel per stage, so that
+// every launch runs one kind of work with little divergence. Paths are processed in waves of
+// pathCount pixels starting at pixelOffset, their state lives in structure of arrays buffers
+// indexed by path. Each bounce extends the rays of the live paths, shades the hits and traces
+// the shadow rays the shading emitted. Queues of live path indices are compacted with atomic
+// counters: counters[0] and counters[1] count the two ray queues used in turns by the bounces,
+// counters[2] the shadow rays. With ADAPTIVE_SAMPLING the waves run over the active pixel list.
+//
+// Per path state:
+//   rayOrigins.w:     density of the BRDF sample that spawned the ray, 0 for camera rays
+//   rayDirections.w:  widest lobe bounced off so far, selects the environment level of light samples
+//   throughputs.w:    widest lobe before the vertex that spawned the ray, selects the level of its miss
+//   hits:             t, u, v and the primitive, ~0 if the ray left the scene
+//   shadowContributions.w: path the shadow ray belongs to
+
+#define WAVEFRONT_ARGUMENTS \
+    __global float4* rayOrigins, \
+    __global float4* rayDirections, \
+    __global float4* throughputs, \
+    __global float4* radiances, \
+    __global float4* hits, \
+    __global uint* queues, \
+    __global uint* counters, \
+    __global float4* shadowOrigins, \
+    __global float4* shadowDirections, \
+    __global float4* shadowContributions, \
+    uint pixelOffset, \
+    uint pathCount, \
+    uint depth
+
+#define SHADOW_COUNTER 2
+#define NO_HIT 0xFFFFFFFF
+
+// The two ray queues are interleaved, the bounce reads queue depth % 2 and writes the other one
+#define QUEUE_ENTRY(index, queue) queues[2 * (index) + (queue)]
+
+__kernel void GenerateRays
+(
+    RENDER_KERNEL_ARGUMENTS,
+    WAVEFRONT_ARGUMENTS
+)
+{
+    uint path = get_global_id(0);
+    if (path >= pathCount)
+    {
+        return;
+    }
+
+    if (path == 0)
+    {
+        counters[0] = pathCount;
+        counters[1] = 0;
+        counters[SHADOW_COUNTER] = 0;
+    }
+
+    uint pixel = FramePixel(pixelOffset + path, activePixels);
+    Sampler sampler = StartSampler(pixel, PixelSampleCount(pixel, frameCount, sampleCounts) - 1);
+    Ray ray = CreateRay(pixel, width, height, cameraPos, cameraFront, cameraUp, &sampler);
+
+    rayOrigins[path] = (float4)(ray.origin, 0.0f);
+    rayDirections[path] = (float4)(ray.dir, 0.0f);
+    throughputs[path] = (float4)(1.0f, 1.0f, 1.0f, 0.0f);
+    radiances[path] = 0.0f;
+    QUEUE_ENTRY(path, 0) = path;
+
+}
+
+__kernel void ExtendRays
+(
+    RENDER_KERNEL_ARGUMENTS,
+    WAVEFRONT_ARGUMENTS
+)
+{
+    uint in = depth % 2;
+    uint index = get_global_id(0);
+
+    // Nothing reads the output queue and the shadow rays of the previous bounce anymore
+    if (index == 0)
+    {
+        counters[1 - in] = 0;
+        counters[SHADOW_COUNTER] = 0;
+    }
+
+    if (index >= counters[in])
+    {
+        return;
+    }
+
+    Scene scene = { triangles, attributes, vertices, nodes, materials };
+    uint path = QUEUE_ENTRY(index, in);
+    Ray ray = InitRay(rayOrigins[path].xyz, rayDirections[path].xyz);
+    IntersectData isect = Traverse(&ray, &scene, false);
+    hits[path] = isect.hit ? (float4)(isect.t, isect.u, isect.v, as_float(isect.primitive)) : (float4)(0.0f, 0.0f, 0.0f, as_float(NO_HIT));
+
+}
+
+__kernel void ShadeHits
+(
+    RENDER_KERNEL_ARGUMENTS,
+    WAVEFRONT_ARGUMENTS
+)
+{
+    uint in = depth % 2;
+    uint index = get_global_id(0);
+    if (index >= counters[in])
+    {
+        return;
+    }
+
+    uint path = QUEUE_ENTRY(index, in);
+    float4 origin = rayOrigins[path];
+    float4 direction = rayDirections[path];
+    float4 throughput = throughputs[path];
+    float4 hit = hits[path];
+    float3 beta = throughput.xyz;
+    float brdfPdf = origin.w;
+    float pathRoughness = direction.w;
+    float rayRoughness = throughput.w;
+    uint pixel = FramePixel(pixelOffset + path, activePixels);
+    uint sampleCount = PixelSampleCount(pixel, frameCount, sampleCounts);
+    Sampler sampler = StartSampler(pixel, sampleCount - 1);
+    StartBounce(&sampler, depth);
+
+    if (as_uint(hit.w) == NO_HIT)
+    {
+#ifdef AOV_BUFFERS
+        if (depth == 0)
+        {
+            AccumulateFeatures(albedos, normalDepths, pixel, 1.0f, -direction.xyz, MAX_RENDER_DIST, sampleCount);
+        }
+#endif
+        radiances[path].xyz += beta * EnvironmentMissRadiance(environment, environmentLevels, environmentAliases, direction.xyz, brdfPdf, rayRoughness);
+        return;
+    }
+
+    // Rebuild the intersection the extend stage found
+    Scene scene = { triangles, attributes, vertices, nodes, materials };
+    IntersectData isect;
+    isect.hit = true;
+    isect.ray = InitRay(origin.xyz, direction.xyz);
+    isect.t = hit.x;
+    isect.u = hit.y;
+    isect.v = hit.z;
+    isect.primitive = as_uint(hit.w);
+    FinalizeIntersection(&isect, &scene);
+
+    const __global Material* material = &materials[isect.object->mtlIndex];
+#ifdef AOV_BUFFERS
+    // Camera rays are shaded once per frame, their hits are the features of the pixel
+    if (depth == 0)
+    {
+        AccumulateFeatures(albedos, normalDepths, pixel, MaterialAlbedo(isect.texcoord, material), isect.normal, isect.t, sampleCount);
+    }
+#endif
+    float3 radiance = beta * material->emission * 50.0f;
+
+    float3 wo = -direction.xyz;
+
+    // Next event estimation towards the environment, traced by the connect stage
+    float3 wl;
+    float3 light = SampleEnvironmentLight(&isect, wo, material, environment, environmentLevels, environmentAliases, pathRoughness, depth + 1 == MAX_DEPTH, &wl, &sampler);
+    if (any(light > 0.0f))
+    {
+        uint shadow = atomic_inc(&counters[SHADOW_COUNTER]);
+        shadowOrigins[shadow] = (float4)(isect.pos + wl * 0.01f, 0.0f);
+        shadowDirections[shadow] = (float4)(wl, 0.0f);
+        shadowContributions[shadow] = (float4)(beta * light, as_float(path));
+    }
+
+    radiances[path].xyz += radiance;
+
+    if (depth + 1 >= MAX_DEPTH)
+    {
+        return;
+    }
+
+    float3 wi;
+    float pdf = 0.0f;
+    float3 f = SampleBrdf(wo, &wi, &pdf, isect.texcoord, isect.normal, material, &sampler);
+    if (pdf <= 0.0f)
+    {
+        return;
+    }
+
+    beta *= f * dot(wi, isect.normal) / pdf;
+    if (!SurvivesRoulette(&beta, depth + 1, &sampler))
+    {
+        return;
+    }
+
+    rayOrigins[path] = (float4)(isect.pos + wi * 0.01f, pdf);
+    // The lobe of this vertex only widens the lookups of the vertices after it
+    rayDirections[path] = (float4)(wi, max(pathRoughness, MaterialRoughness(material)));
+    throughputs[path] = (float4)(beta, pathRoughness);
+    QUEUE_ENTRY(atomic_inc(&counters[1 - in]), 1 - in) = path;
+
+}
+
+__kernel void ConnectShadowRays
+(
+    RENDER_KERNEL_ARGUMENTS,
+    WAVEFRONT_ARGUMENTS
+)
+{
+    uint shadow = get_global_id(0);
+    if (shadow >= counters[SHADOW_COUNTER])
+    {
+        return;
+    }
+
+    Scene scene = { triangles, attributes, vertices, nodes, materials };
+    Ray ray = InitRay(shadowOrigins[shadow].xyz, shadowDirections[shadow].xyz);
+    if (!Occluded(&ray, &scene))
+    {
+        // A path emits at most one shadow ray per bounce, no other work-item adds to its radiance
+        float4 contribution = shadowContributions[shadow];
+        radiances[as_uint(contribution.w)].xyz += contribution.xyz;
+    }
+
+}
+
+__kernel void AccumulateRadiance
+(
+    RENDER_KERNEL_ARGUMENTS,
+    WAVEFRONT_ARGUMENTS
+)
+{
+    uint path = get_global_id(0);
+    if (path >= pathCount)
+    {
+        return;
+    }
+
+    // Counts the sample with ADAPTIVE_SAMPLING, after the shade stage averaged the features with the same count
+    uint pixel = FramePixel(pixelOffset + path, activePixels);
+    AccumulateSample(result, sampleCounts, pixel, max(radiances[path].xyz, 0.0f), PixelSampleCount(pixel, frameCount, sampleCounts));
+
+}
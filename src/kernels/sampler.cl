@@ -0,0 +1,113 @@
+// Low discrepancy sampler: Owen-scrambled Sobol points after Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020). Every draw of one or two numbers along a path is a dimension of its own,
+// padded from the first two Sobol dimensions at the sample index of the pixel. The index is shuffled
+// and the coordinates are scrambled with hashes of the pixel and the dimension, so each dimension
+// stays stratified over the samples of a pixel while pixels and dimensions are decorrelated.
+// The first two Sobol dimensions need no direction number tables, points are computed on the fly.
+
+typedef struct
+{
+    // Sample of the pixel, the index into the sequence
+    uint index;
+    // Hash of the pixel
+    uint scramble;
+    // Next draw
+    uint dimension;
+} Sampler;
+
+// Draws of the camera ray: pixel jitter, then the lens position with DOF
+#define SAMPLER_CAMERA_DIMENSIONS 3
+// Draws of a bounce: environment light sample (2), BRDF lobe and direction (2), Russian roulette (1)
+#define SAMPLER_BOUNCE_DIMENSIONS 5
+
+uint MixBits(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint HashCombine(uint seed, uint value)
+{
+    return MixBits(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+uint ReverseBits(uint x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash that only lets lower bits affect higher ones, which on reversed bits is an Owen scramble
+uint LaineKarrasPermutation(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint NestedUniformScramble(uint x, uint seed)
+{
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+// Second Sobol dimension, its direction numbers are the rows of Pascal's triangle mod 2.
+// The first one is the index with its bits reversed.
+uint SobolSecondDimension(uint index)
+{
+    uint result = 0;
+    for (uint v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+    {
+        if (index & 1)
+        {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+float ToUnitFloat(uint x)
+{
+    // 24 bits fit into the mantissa, the result stays below 1
+    return (float)(x >> 8) * 5.9604645e-8f;
+}
+
+Sampler StartSampler(uint pixel, uint sampleIndex)
+{
+    Sampler sampler;
+    sampler.index = sampleIndex;
+    sampler.scramble = MixBits(pixel);
+    sampler.dimension = 0;
+    return sampler;
+}
+
+// Every bounce starts at a fixed dimension, so a branch that draws less does not shift the following bounces
+void StartBounce(Sampler* sampler, int depth)
+{
+    sampler->dimension = SAMPLER_CAMERA_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+float GetRandomFloat(Sampler* sampler)
+{
+    uint seed = HashCombine(sampler->scramble, sampler->dimension++);
+    uint index = NestedUniformScramble(sampler->index, seed);
+    return ToUnitFloat(NestedUniformScramble(ReverseBits(index), MixBits(seed + 1)));
+}
+
+float2 GetRandomFloat2(Sampler* sampler)
+{
+    uint seed = HashCombine(sampler->scramble, sampler->dimension++);
+    uint index = NestedUniformScramble(sampler->index, seed);
+    uint x = NestedUniformScramble(ReverseBits(index), MixBits(seed + 1));
+    uint y = NestedUniformScramble(SobolSecondDimension(index), MixBits(seed + 2));
+    return (float2)(ToUnitFloat(x), ToUnitFloat(y));
+}
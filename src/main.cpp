@@ -1,4 +1,5 @@
 #include <fstream>
+#include <vector>
 
 #include "noma/bmt/bmt.hpp"
 
@@ -20,7 +21,7 @@ int main(int argc, char* argv[])
 
     try
     {
-        render->Init(config_file, bm_config.benchmark_width(), bm_config.benchmark_height());
+        render->Init(config_file, bm_config);
     }
     catch (std::exception& ex)
     {
@@ -42,23 +43,65 @@ int main(int argc, char* argv[])
        //<< "kernel_warmups" << "\t"
        << "kernel_runs" << "\t"
        << "width" << "\t"
-       << "height" << std::endl;
+       << "height" << "\t"
+       << "bvh_builder" << "\t"
+       << "bvh_build_time" << "\t"
+       << "bvh_load_time" << "\t"
+       << "compress_vertices" << "\t"
+       << "pipeline" << "\t"
+       << "persistent_threads" << "\t"
+       << "path_regeneration" << "\t"
+       << "max_depth" << "\t"
+       << "rr_min_depth" << "\t"
+       << "adaptive_threshold" << "\t"
+       << "denoise_iterations" << "\t"
+       << "store_frames" << "\t"
+       << "image_format" << "\t"
+       << "paths_per_second" << "\t"
+       << "end_to_end_fps" << std::endl;
 
     // suffix with all same values for every benchmark
     std::stringstream constant_values;
     constant_values //<< kernel_warmups << "\t"
                     << bm_config.benchmark_kernel_runs() << "\t"
                     << bm_config.benchmark_width() << "\t"
-                    << bm_config.benchmark_height();
+                    << bm_config.benchmark_height() << "\t"
+                    << bm_config.scene_bvh_builder() << "\t"
+                    << render->GetScene()->GetBuildTime() << "\t"
+                    << render->GetScene()->GetLoadTime() << "\t"
+                    << bm_config.scene_compress_vertices() << "\t"
+                    << bm_config.render_pipeline() << "\t"
+                    << bm_config.render_persistent_threads() << "\t"
+                    << bm_config.render_path_regeneration() << "\t"
+                    << bm_config.render_max_depth() << "\t"
+                    << bm_config.render_rr_min_depth() << "\t"
+                    << bm_config.render_adaptive_threshold() << "\t"
+                    << bm_config.render_denoise_iterations() << "\t"
+                    << bm_config.render_store_frames() << "\t"
+                    << bm_config.render_image_format();
 
     noma::bmt::statistics kernel_stats(bm_config.benchmark_kernel_runs(), 0);
+    // Kernel time per stage of the wavefront pipeline
+    std::shared_ptr<Wavefront> wavefront = render->GetWavefront();
+    std::vector<noma::bmt::statistics> stage_stats;
+    if (wavefront)
+    {
+        stage_stats.assign(static_cast<size_t>(WavefrontStage_t::COUNT), noma::bmt::statistics(bm_config.benchmark_kernel_runs(), 0));
+    }
 
+    // Wall clock time of the frames including readback and output, which overlap with the kernels
+    double start_time = render->GetCurtime();
     for (size_t i = 0; i < bm_config.benchmark_kernel_runs(); ++i)
     {
         try
         {
             cl_ulong t = render->RenderFrame();
             kernel_stats.add(noma::bmt::duration(static_cast<noma::bmt::rep>(t)));
+            for (size_t stage = 0; stage < stage_stats.size(); ++stage)
+            {
+                cl_ulong stage_time = wavefront->GetStageTime(static_cast<WavefrontStage_t>(stage));
+                stage_stats[stage].add(noma::bmt::duration(static_cast<noma::bmt::rep>(stage_time)));
+            }
         }
         catch (const std::exception& ex)
         {
@@ -68,15 +111,40 @@ int main(int argc, char* argv[])
 
     }
 
+    render->Flush();
+    double end_to_end_fps = bm_config.benchmark_kernel_runs() / (render->GetCurtime() - start_time);
+
+    // One path per traced pixel, whatever the pipeline
+    double paths_per_second = double(render->GetTracedPaths()) /
+                              std::chrono::duration_cast<noma::bmt::seconds>(kernel_stats.sum()).count();
+
     // print summary to std::cout
     std::cout << "Time for kernel_bvh: " << std::chrono::duration_cast<noma::bmt::seconds>(kernel_stats.sum()).count() << " s, "
               << "average frame time: " << std::chrono::duration_cast<noma::bmt::milliseconds>(kernel_stats.average()).count() << " ms, "
-              << "frames per second: " << bm_config.benchmark_kernel_runs() / std::chrono::duration_cast<noma::bmt::seconds>(kernel_stats.sum()).count() << std::endl;
+              << "frames per second: " << bm_config.benchmark_kernel_runs() / std::chrono::duration_cast<noma::bmt::seconds>(kernel_stats.sum()).count() << ", "
+              << "paths per second: " << paths_per_second / 1e6 << " M, "
+              << "end-to-end frames per second: " << end_to_end_fps << std::endl;
+
+    for (size_t stage = 0; stage < stage_stats.size(); ++stage)
+    {
+        std::cout << "  stage " << Wavefront::GetStageName(static_cast<WavefrontStage_t>(stage)) << ": "
+                  << std::chrono::duration_cast<noma::bmt::milliseconds>(stage_stats[stage].average()).count() << " ms per frame" << std::endl;
+    }
 
     // write details into file
     of << "kernel_bvh" << '\t'
        << kernel_stats.string() << '\t'
-       << constant_values.str() << std::endl;
+       << constant_values.str() << '\t'
+       << paths_per_second << '\t'
+       << end_to_end_fps << std::endl;
+    for (size_t stage = 0; stage < stage_stats.size(); ++stage)
+    {
+        of << "stage_" << Wavefront::GetStageName(static_cast<WavefrontStage_t>(stage)) << '\t'
+           << stage_stats[stage].string() << '\t'
+           << constant_values.str() << '\t'
+           << paths_per_second << '\t'
+           << end_to_end_fps << std::endl;
+    }
 
     render->Shutdown();
 
@@ -279,4 +279,93 @@ inline T clamp(T value, T min, T max)
     return (value < min) ? min : ((value > max) ? max : value);
 }
 
+// IEEE 754 half precision bits of _value_, rounded to nearest even
+inline unsigned short FloatToHalf(float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000;
+    unsigned int magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude >= 0x7F800000)
+    {
+        // Infinity stays infinity, NaN stays a quiet NaN
+        return static_cast<unsigned short>(sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0));
+    }
+    if (magnitude >= 0x477FF000)
+    {
+        return static_cast<unsigned short>(sign | 0x7C00);
+    }
+    if (magnitude < 0x38800000)
+    {
+        // Subnormal half
+        if (magnitude < 0x33000000)
+        {
+            return static_cast<unsigned short>(sign);
+        }
+        unsigned int shift = 126 - (magnitude >> 23);
+        unsigned int mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        unsigned int half = mantissa >> shift;
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int midpoint = 1u << (shift - 1);
+        half += rest > midpoint || (rest == midpoint && (half & 1));
+        return static_cast<unsigned short>(sign | half);
+    }
+
+    unsigned int half = (magnitude - 0x38000000) >> 13;
+    unsigned int rest = magnitude & 0x1FFF;
+    half += rest > 0x1000 || (rest == 0x1000 && (half & 1));
+    return static_cast<unsigned short>(sign | half);
+}
+
+// Float value of the IEEE 754 half precision bits _half_
+inline float HalfToFloat(unsigned short half)
+{
+    unsigned int sign = (half & 0x8000u) << 16;
+    unsigned int exponent = (half >> 10) & 0x1F;
+    unsigned int mantissa = half & 0x3FF;
+    unsigned int bits;
+    if (exponent == 0)
+    {
+        // Zero and subnormals are exact in float
+        float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    else if (exponent == 31)
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Octahedral mapping of the unit vector _n_, two snorm16 values with x in the low bits
+inline unsigned int EncodeOctahedral(const float3& n)
+{
+    float norm = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (!(norm > 0.0f))
+    {
+        return 0;
+    }
+    float x = n.x / norm;
+    float y = n.y / norm;
+    if (n.z < 0.0f)
+    {
+        // Fold the lower hemisphere over the diagonals
+        float foldedX = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+
+    int sx = static_cast<int>(std::round(clamp(x, -1.0f, 1.0f) * 32767.0f));
+    int sy = static_cast<int>(std::round(clamp(y, -1.0f, 1.0f) * 32767.0f));
+    return (static_cast<unsigned int>(sx) & 0xFFFF) | (static_cast<unsigned int>(sy) << 16);
+}
+
 #endif // MATHLIB_HPP
@@ -1,12 +1,74 @@
 #include "ocl_helper.hpp"
 #include "utils/cl_exception.hpp"
 #include "renderers/render.hpp"
+#include "io/mapped_file.hpp"
+#include "io/scene_cache.hpp"
 #include "noma/bmt/bmt.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <fstream>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+// Include nesting followed by the source hash, deeper levels can only be include cycles
+static const int MAX_INCLUDE_DEPTH = 16;
+
+// Hashes _kernel_file_ and the files it includes, the kernels include them by paths relative to the working directory
+static uint64_t HashKernelSource(const std::string& kernel_file, uint64_t seed, int depth = 0)
+{
+    uint64_t hash = SceneCache::Hash(kernel_file.data(), kernel_file.size(), seed);
+    MappedFile file;
+    if (!file.Open(kernel_file))
+    {
+        return hash;
+    }
+    hash = SceneCache::Hash(file.GetData(), file.GetSize(), hash);
+    if (depth == MAX_INCLUDE_DEPTH)
+    {
+        return hash;
+    }
+
+    static const char directive[] = "#include \"";
+    const size_t directive_size = sizeof(directive) - 1;
+    const char* p = file.GetData();
+    const char* end = p + file.GetSize();
+    while (p < end)
+    {
+        const char* line_end = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (!line_end)
+        {
+            line_end = end;
+        }
+        if (size_t(line_end - p) > directive_size && memcmp(p, directive, directive_size) == 0)
+        {
+            const char* name = p + directive_size;
+            const char* name_end = static_cast<const char*>(memchr(name, '"', line_end - name));
+            if (name_end)
+            {
+                hash = HashKernelSource(std::string(name, name_end), hash, depth + 1);
+            }
+        }
+        p = line_end + 1;
+    }
+    return hash;
+}
+
+static void MakeDirectory(const std::string& directory)
+{
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+}
 
 OCLHelper::OCLHelper(const std::string config_file)
 {
@@ -16,32 +78,166 @@ OCLHelper::OCLHelper(const std::string config_file)
 
 }
 
-void OCLHelper::CreateProgramFromFile(const std::string kernel_file, const std::string kernel_name)
+void OCLHelper::SetProgramCache(const std::string& cache_directory, const std::string& config_options)
+{
+    m_ProgramCacheDirectory = cache_directory;
+    m_ConfigCompileOptions = config_options;
+}
+
+cl::Program OCLHelper::BuildProgram(const std::string& kernel_file, const std::string& compile_options)
+{
+    std::string cache_file;
+    uint64_t key = 0;
+    if (!m_ProgramCacheDirectory.empty())
+    {
+        std::string device = m_ocl_helper->device().getInfo<CL_DEVICE_NAME>() + " " + m_ocl_helper->device().getInfo<CL_DRIVER_VERSION>();
+        key = SceneCache::Hash(compile_options.data(), compile_options.size());
+        key = SceneCache::Hash(m_ConfigCompileOptions.data(), m_ConfigCompileOptions.size(), key);
+        key = SceneCache::Hash(device.data(), device.size(), key);
+        key = HashKernelSource(kernel_file, key);
+
+        std::string name = kernel_file.substr(kernel_file.find_last_of("/\\") + 1);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%016llx.clbin", static_cast<unsigned long long>(key));
+        cache_file = m_ProgramCacheDirectory + "/" + name.substr(0, name.find('.')) + suffix;
+    }
+
+    // The source build gets the options of the OpenCL config in front of _compile_options_, binaries are built the same way
+    std::string build_options = m_ConfigCompileOptions.empty() ? compile_options : m_ConfigCompileOptions + " " + compile_options;
+    cl::Program program;
+    auto start = std::chrono::steady_clock::now();
+    if (!cache_file.empty() && LoadProgramBinary(cache_file, key, build_options, program))
+    {
+        std::cout << "Loaded program binary " << cache_file << " ("
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s elapsed)" << std::endl;
+    }
+    else
+    {
+        program = m_ocl_helper->create_program_from_file(kernel_file, "", compile_options);
+        std::cout << "Compiled " << kernel_file << " ("
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s elapsed)" << std::endl;
+        if (!cache_file.empty())
+        {
+            StoreProgramBinary(program, cache_file, key);
+        }
+    }
+    return program;
+}
+
+void OCLHelper::CreateProgramFromFile(const std::string kernel_file, const std::vector<std::string>& kernel_names, const std::string compile_options)
+{
+    cl_int err = 0;
+
+    m_Program = BuildProgram(kernel_file, compile_options);
+    m_Kernels.clear();
+    for (const std::string& kernel_name : kernel_names)
+    {
+        m_Kernels.push_back(cl::Kernel(m_Program, kernel_name.c_str(), &err));
+        noma::ocl::error_handler(err, "Error creating kernel: '" + kernel_name + "'.");
+    }
+
+}
+
+bool OCLHelper::LoadProgramBinary(const std::string& filename, uint64_t key, const std::string& build_options, cl::Program& program)
 {
+    SceneCache cache;
+    uint64_t size = 0;
+    const unsigned char* binary = cache.Load(filename, key) ? cache.GetSection<unsigned char>(SceneCacheSection_t::PROGRAM_BINARY, size) : nullptr;
+    if (!binary)
+    {
+        return false;
+    }
+
+    std::vector<cl::Device> devices = { m_ocl_helper->device() };
+    cl::Program::Binaries binaries = { std::make_pair(static_cast<const void*>(binary), static_cast<size_t>(size)) };
+    std::vector<cl_int> status;
     cl_int err = 0;
+    program = cl::Program(m_ocl_helper->context(), devices, binaries, &status, &err);
+    // Drivers may reject binaries of an older build of themselves, compiling the sources again recovers
+    if (err != CL_SUCCESS || program.build(devices, build_options.c_str()) != CL_SUCCESS)
+    {
+        std::cerr << "Program binary " << filename << " was rejected, compiling the sources" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void OCLHelper::StoreProgramBinary(const cl::Program& program, const std::string& filename, uint64_t key) const
+{
+    std::vector<size_t> sizes;
+    cl_int err = program.getInfo(CL_PROGRAM_BINARY_SIZES, &sizes);
+    if (err != CL_SUCCESS || sizes.size() != 1 || sizes[0] == 0)
+    {
+        std::cerr << "Program binary is not available, it will not be cached" << std::endl;
+        return;
+    }
 
-    m_Program = m_ocl_helper->create_program_from_file(kernel_file, "", "");
-    m_Kernel = cl::Kernel(m_Program, kernel_name.c_str(), &err);
-    noma::ocl::error_handler(err, "Error creating kernel: '" + kernel_name + "'.");
+    std::vector<unsigned char> binary(sizes[0]);
+    unsigned char* data = binary.data();
+    err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(data), &data, nullptr);
+    if (err != CL_SUCCESS)
+    {
+        std::cerr << "Failed to read program binary: " << GetClErrorString(err) << std::endl;
+        return;
+    }
 
+    MakeDirectory(m_ProgramCacheDirectory);
+    std::vector<SceneCache::Section> sections = { { SceneCacheSection_t::PROGRAM_BINARY, 1, binary.size(), binary.data() } };
+    if (!SceneCache::Write(filename, key, sections))
+    {
+        std::cerr << "Failed to write program binary " << filename << std::endl;
+    }
 }
 
 void OCLHelper::SetArgument(RenderKernelArgument_t argIndex, void* data, size_t size)
 {
-    cl_int err = m_Kernel.setArg(static_cast<unsigned int>(argIndex), size, data);
-    noma::ocl::error_handler(err, "Failed to set kernel argument");
+    SetArgument(static_cast<unsigned int>(argIndex), data, size);
+}
+
+void OCLHelper::SetArgument(unsigned int argIndex, void* data, size_t size)
+{
+    for (cl::Kernel& kernel : m_Kernels)
+    {
+        cl_int err = kernel.setArg(argIndex, size, data);
+        noma::ocl::error_handler(err, "Failed to set kernel argument");
+    }
 }
 
-cl_ulong OCLHelper::RunKernelTimed(size_t work_items)
+cl_ulong OCLHelper::RunKernelTimed(size_t work_items, size_t local_items)
 {
     noma::ocl::nd_range ndr { { }, // offset
                               { work_items }, // global size
                               { } // local size
     };
+    if (local_items > 0)
+        ndr.local = { local_items };
     //if (m_ocl_config.opencl_work_group_size() > 0)
     //    ndr.local = { m_ocl_config.opencl_work_group_size() };
-    return m_ocl_helper->run_kernel_timed(m_Kernel, ndr);
+    return m_ocl_helper->run_kernel_timed(m_Kernels[0], ndr);
+
+}
+
+void OCLHelper::EnqueueKernel(size_t kernel_index, size_t work_items, cl::Event* event)
+{
+    cl_int err = m_ocl_helper->queue().enqueueNDRangeKernel(m_Kernels[kernel_index], cl::NullRange, cl::NDRange(work_items), cl::NullRange, nullptr, event);
+    noma::ocl::error_handler(err, "Failed to enqueue kernel");
+}
+
+void OCLHelper::Finish()
+{
+    cl_int err = m_ocl_helper->queue().finish();
+    noma::ocl::error_handler(err, "Failed to finish the command queue");
+}
 
+cl_ulong OCLHelper::GetEventTime(const cl::Event& event)
+{
+    cl_ulong start = 0, end = 0;
+    cl_int err = event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
+    noma::ocl::error_handler(err, "Failed to query the command start");
+    err = event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
+    noma::ocl::error_handler(err, "Failed to query the command end");
+    return end - start;
 }
 
 void OCLHelper::ReadBuffer(const cl::Buffer& buffer, void* data, size_t size) const
@@ -49,3 +245,29 @@ void OCLHelper::ReadBuffer(const cl::Buffer& buffer, void* data, size_t size) co
     cl_int err = m_ocl_helper->queue().enqueueReadBuffer(buffer, false, 0, size, data);
     noma::ocl::error_handler(err, "Failed to read buffer");
 }
+
+bool OCLHelper::IsCPUDevice() const
+{
+    cl_device_type type = 0;
+    cl_int err = m_ocl_helper->device().getInfo(CL_DEVICE_TYPE, &type);
+    noma::ocl::error_handler(err, "Failed to query device type");
+    return (type & CL_DEVICE_TYPE_CPU) != 0;
+}
+
+unsigned int OCLHelper::GetComputeUnits() const
+{
+    cl_uint units = 0;
+    cl_int err = m_ocl_helper->device().getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &units);
+    noma::ocl::error_handler(err, "Failed to query compute units");
+    return units;
+}
+
+size_t OCLHelper::GetPreferredWorkGroupSize() const
+{
+    size_t multiple = 0, maximum = 0;
+    cl_int err = m_Kernels[0].getWorkGroupInfo(m_ocl_helper->device(), CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, &multiple);
+    noma::ocl::error_handler(err, "Failed to query preferred work-group size");
+    err = m_Kernels[0].getWorkGroupInfo(m_ocl_helper->device(), CL_KERNEL_WORK_GROUP_SIZE, &maximum);
+    noma::ocl::error_handler(err, "Failed to query work-group size");
+    return std::max<size_t>(std::min(multiple, maximum), 1);
+}
@@ -4,12 +4,17 @@
 #include "scene/scene.hpp"
 #include "noma/ocl/helper.hpp"
 #include <CL/cl.hpp>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 
 enum class RenderKernelArgument_t : unsigned int
 {
     BUFFER_OUT,
     BUFFER_SCENE,
+    BUFFER_ATTRIBUTE,
+    BUFFER_VERTEX,
     BUFFER_NODE,
     BUFFER_MATERIAL,
     WIDTH,
@@ -18,7 +23,15 @@ enum class RenderKernelArgument_t : unsigned int
     CAM_FRONT,
     CAM_UP,
     FRAME_COUNT,
-    TEXTURE0,
+    BUFFER_ENVIRONMENT,
+    BUFFER_ENVIRONMENT_LEVELS,
+    BUFFER_ENVIRONMENT_ALIASES,
+    BUFFER_ALBEDO,
+    BUFFER_NORMAL_DEPTH,
+    BUFFER_SAMPLE_COUNT,
+    BUFFER_ACTIVE_PIXELS,
+    // Arguments of a pipeline's own kernels follow the shared ones
+    COUNT,
 };
 
 
@@ -30,19 +43,50 @@ public:
     const cl::Context& GetContext() const { return m_ocl_helper->context(); }
     std::shared_ptr<noma::ocl::helper> GetOCLHelper() const { return m_ocl_helper; }
 
-    void CreateProgramFromFile(const std::string kernel_file, const std::string kernel_name);
+    // Keeps the binaries of built programs in _cache_directory_ and loads them from there instead of compiling
+    // the sources again, an empty directory disables the cache. A binary is reused for the same sources,
+    // including the files they include, the same options and the same device and driver. _config_options_ are
+    // the compile options the OpenCL config adds to every source build, cached binaries are built with them too.
+    void SetProgramCache(const std::string& cache_directory, const std::string& config_options);
 
+    // Builds _kernel_file_ through the binary cache, for programs that create their own kernels
+    cl::Program BuildProgram(const std::string& kernel_file, const std::string& compile_options);
+
+    // Creates a kernel for each name, the render kernel arguments are shared by all of them
+    void CreateProgramFromFile(const std::string kernel_file, const std::vector<std::string>& kernel_names, const std::string compile_options = "");
+
+    // Sets the argument on every kernel of the program
     void SetArgument(RenderKernelArgument_t argIndex, void* data, size_t size);
+    void SetArgument(unsigned int argIndex, void* data, size_t size);
 
-    cl_ulong RunKernelTimed(size_t work_items);
+    // Runs the first kernel and waits for it, a _local_items_ of 0 leaves the work-group size to the runtime
+    cl_ulong RunKernelTimed(size_t work_items, size_t local_items = 0);
+    // Enqueues kernel _kernel_index_ without waiting, _event_ may be nullptr
+    void EnqueueKernel(size_t kernel_index, size_t work_items, cl::Event* event = nullptr);
+    // Waits for all enqueued kernels and reads
+    void Finish();
+    // Nanoseconds between start and end of a finished command, the queue profiles all commands
+    static cl_ulong GetEventTime(const cl::Event& event);
 
     void ReadBuffer(const cl::Buffer& buffer, void* ptr, size_t size) const;
 
+    // CPU devices share the host memory, CL_MEM_USE_HOST_PTR avoids copies there
+    bool IsCPUDevice() const;
+    unsigned int GetComputeUnits() const;
+    // Work-group size for the first kernel: its preferred size multiple, the SIMD width on most devices
+    size_t GetPreferredWorkGroupSize() const;
+
+private:
+    bool LoadProgramBinary(const std::string& filename, uint64_t key, const std::string& build_options, cl::Program& program);
+    void StoreProgramBinary(const cl::Program& program, const std::string& filename, uint64_t key) const;
+
 private:
     std::shared_ptr<noma::ocl::helper> m_ocl_helper;
     std::shared_ptr<noma::ocl::config> m_ocl_config;
-    cl::Kernel  m_Kernel;
+    std::vector<cl::Kernel> m_Kernels;
     cl::Program m_Program;
+    std::string m_ProgramCacheDirectory;
+    std::string m_ConfigCompileOptions;
 
 };
 
@@ -0,0 +1,69 @@
+#include "adaptive_sampler.hpp"
+#include "renderers/render.hpp"
+#include "utils/cl_exception.hpp"
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+AdaptiveSampler::AdaptiveSampler(unsigned int pixelCount, float threshold, unsigned int minSamples)
+    : m_PixelCount(pixelCount)
+    , m_Threshold(threshold)
+    , m_ActiveCount(pixelCount)
+{
+    std::shared_ptr<OCLHelper> helper = render->GetOCLHelper();
+    m_Program = helper->BuildProgram("src/kernels/kernel_adaptive.cl", "-D MIN_SAMPLES=" + std::to_string(std::max(minSamples, 1u)));
+
+    cl_int errCode;
+    m_Kernel = cl::Kernel(m_Program, "CompactActivePixels", &errCode);
+    if (errCode)
+    {
+        throw CLException("Failed to create adaptive sampling kernel", errCode);
+    }
+
+    m_SampleCountBuffer = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, size_t(m_PixelCount) * sizeof(cl_uint));
+    m_ActivePixelBuffer = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, (size_t(m_PixelCount) + 1) * sizeof(cl_uint));
+    std::cout << "AdaptiveSamplingBuffers size: " << float((size_t(m_PixelCount) * 2 + 1) * sizeof(cl_uint)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+
+}
+
+void AdaptiveSampler::Reset(const cl::Buffer& accumulation)
+{
+    cl_int errCode = render->GetOCLHelper()->GetOCLHelper()->queue().enqueueFillBuffer(m_SampleCountBuffer, cl_uint(0), 0, size_t(m_PixelCount) * sizeof(cl_uint));
+    if (errCode)
+    {
+        throw CLException("Failed to reset the sample counts", errCode);
+    }
+
+    // Pixels without samples are always active
+    Update(accumulation);
+}
+
+void AdaptiveSampler::Update(const cl::Buffer& accumulation)
+{
+    cl::CommandQueue& queue = render->GetOCLHelper()->GetOCLHelper()->queue();
+    cl_int errCode = queue.enqueueFillBuffer(m_ActivePixelBuffer, cl_uint(0), 0, sizeof(cl_uint));
+    if (errCode)
+    {
+        throw CLException("Failed to reset the active pixel count", errCode);
+    }
+
+    m_Kernel.setArg(0, accumulation);
+    m_Kernel.setArg(1, m_SampleCountBuffer);
+    m_Kernel.setArg(2, m_ActivePixelBuffer);
+    m_Kernel.setArg(3, cl_uint(m_PixelCount));
+    m_Kernel.setArg(4, m_Threshold);
+    errCode = queue.enqueueNDRangeKernel(m_Kernel, cl::NullRange, cl::NDRange(m_PixelCount));
+    if (errCode)
+    {
+        throw CLException("Failed to run adaptive sampling kernel", errCode);
+    }
+
+    // The launch size of the next frame depends on it, this is the only wait besides the frame itself
+    cl_uint activeCount = 0;
+    errCode = queue.enqueueReadBuffer(m_ActivePixelBuffer, CL_TRUE, 0, sizeof(cl_uint), &activeCount);
+    if (errCode)
+    {
+        throw CLException("Failed to read the active pixel count", errCode);
+    }
+    m_ActiveCount = activeCount;
+}
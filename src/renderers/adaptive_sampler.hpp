@@ -0,0 +1,42 @@
+#ifndef ADAPTIVE_SAMPLER_HPP
+#define ADAPTIVE_SAMPLER_HPP
+
+#include <CL/cl.hpp>
+
+// Adaptive sampling: the render kernels count the samples of every pixel and
+// only trace the pixels in the active list. After each frame a compaction
+// kernel rebuilds the list from the pixels whose estimated relative error is
+// still above the threshold, the next frame launches work-items for those.
+class AdaptiveSampler
+{
+public:
+    // Pixels stay active until they have _minSamples_ samples and their relative error drops below _threshold_
+    AdaptiveSampler(unsigned int pixelCount, float threshold, unsigned int minSamples);
+
+    // Compile option of the render kernels to trace the active pixels
+    static const char* GetKernelOptions() { return " -D ADAPTIVE_SAMPLING"; }
+
+    const cl::Buffer& GetSampleCountBuffer() const { return m_SampleCountBuffer; }
+    const cl::Buffer& GetActivePixelBuffer() const { return m_ActivePixelBuffer; }
+
+    // Pixels the next frame traces
+    unsigned int GetActiveCount() const { return m_ActiveCount; }
+
+    // Clears the sample counts, every pixel becomes active
+    void Reset(const cl::Buffer& accumulation);
+    // Rebuilds the active list from _accumulation_ and waits for its count
+    void Update(const cl::Buffer& accumulation);
+
+private:
+    unsigned int m_PixelCount;
+    float m_Threshold;
+    unsigned int m_ActiveCount;
+    cl::Program m_Program;
+    cl::Kernel m_Kernel;
+    cl::Buffer m_SampleCountBuffer;
+    // The count of active pixels followed by the pixels
+    cl::Buffer m_ActivePixelBuffer;
+
+};
+
+#endif // ADAPTIVE_SAMPLER_HPP
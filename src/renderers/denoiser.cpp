@@ -0,0 +1,87 @@
+#include "denoiser.hpp"
+#include "renderers/render.hpp"
+#include "utils/cl_exception.hpp"
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+static cl::Kernel CreateKernel(const cl::Program& program, const char* name)
+{
+    cl_int errCode;
+    cl::Kernel kernel(program, name, &errCode);
+    if (errCode)
+    {
+        throw CLException(std::string("Failed to create kernel ") + name, errCode);
+    }
+    return kernel;
+}
+
+template <typename T>
+static void SetArgument(cl::Kernel& kernel, cl_uint index, const T& value, const char* name)
+{
+    cl_int errCode = kernel.setArg(index, value);
+    if (errCode)
+    {
+        throw CLException(std::string("Failed to set argument of kernel ") + name, errCode);
+    }
+}
+
+Denoiser::Denoiser(unsigned int width, unsigned int height, unsigned int iterations, bool adaptiveSampling)
+    : m_Width(width)
+    , m_Height(height)
+    , m_Iterations(iterations)
+{
+    std::shared_ptr<OCLHelper> helper = render->GetOCLHelper();
+    m_Program = helper->BuildProgram("src/kernels/kernel_denoise.cl", adaptiveSampling ? "-D ADAPTIVE_SAMPLING" : "");
+    m_PrepareKernel = CreateKernel(m_Program, "DenoisePrepare");
+    m_FilterKernel = CreateKernel(m_Program, "DenoiseFilter");
+    m_FinishKernel = CreateKernel(m_Program, "DenoiseFinish");
+
+    size_t bufferSize = size_t(m_Width) * m_Height * sizeof(cl_float4);
+    m_AlbedoBuffer = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, bufferSize);
+    m_NormalDepthBuffer = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, bufferSize);
+    m_FilterBuffers[0] = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, bufferSize);
+    m_FilterBuffers[1] = helper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, bufferSize);
+    std::cout << "DenoiseBuffers size: " << float(bufferSize * 4) / (1024.0f * 1024.0f) << " MiB (" << m_Iterations << " iterations)" << std::endl;
+
+}
+
+void Denoiser::Enqueue(const cl::Kernel& kernel, const char* name)
+{
+    cl_int errCode = render->GetOCLHelper()->GetOCLHelper()->queue().enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(size_t(m_Width) * m_Height));
+    if (errCode)
+    {
+        throw CLException(std::string("Failed to run kernel ") + name, errCode);
+    }
+}
+
+void Denoiser::Run(const cl::Buffer& accumulation, unsigned int sampleCount, const cl::Buffer& sampleCounts)
+{
+    cl_uint pixelCount = m_Width * m_Height;
+
+    SetArgument(m_PrepareKernel, 0, accumulation, "DenoisePrepare");
+    SetArgument(m_PrepareKernel, 1, m_AlbedoBuffer, "DenoisePrepare");
+    SetArgument(m_PrepareKernel, 2, sampleCounts, "DenoisePrepare");
+    SetArgument(m_PrepareKernel, 3, m_FilterBuffers[0], "DenoisePrepare");
+    SetArgument(m_PrepareKernel, 4, pixelCount, "DenoisePrepare");
+    SetArgument(m_PrepareKernel, 5, cl_uint(std::max(sampleCount, 1u)), "DenoisePrepare");
+    Enqueue(m_PrepareKernel, "DenoisePrepare");
+
+    // Kernel arguments are captured at enqueue time, the passes need no synchronization in between
+    for (unsigned int i = 0; i < m_Iterations; ++i)
+    {
+        SetArgument(m_FilterKernel, 0, m_FilterBuffers[i % 2], "DenoiseFilter");
+        SetArgument(m_FilterKernel, 1, m_NormalDepthBuffer, "DenoiseFilter");
+        SetArgument(m_FilterKernel, 2, m_FilterBuffers[(i + 1) % 2], "DenoiseFilter");
+        SetArgument(m_FilterKernel, 3, cl_uint(m_Width), "DenoiseFilter");
+        SetArgument(m_FilterKernel, 4, cl_uint(m_Height), "DenoiseFilter");
+        SetArgument(m_FilterKernel, 5, cl_int(1 << i), "DenoiseFilter");
+        Enqueue(m_FilterKernel, "DenoiseFilter");
+    }
+
+    SetArgument(m_FinishKernel, 0, m_FilterBuffers[m_Iterations % 2], "DenoiseFinish");
+    SetArgument(m_FinishKernel, 1, m_AlbedoBuffer, "DenoiseFinish");
+    SetArgument(m_FinishKernel, 2, m_FilterBuffers[(m_Iterations + 1) % 2], "DenoiseFinish");
+    SetArgument(m_FinishKernel, 3, pixelCount, "DenoiseFinish");
+    Enqueue(m_FinishKernel, "DenoiseFinish");
+}
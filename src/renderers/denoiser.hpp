@@ -0,0 +1,49 @@
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include <CL/cl.hpp>
+
+// Edge-aware a-trous filter over the accumulated frame, guided by the first
+// hit albedo, normal and depth the render kernels average into the feature
+// buffers, and by the variance of the accumulated radiance. The accumulation
+// itself is left untouched, the filtered frame goes to its own buffer.
+class Denoiser
+{
+public:
+    // Every one of the _iterations_ doubles the filter footprint. With _adaptiveSampling_ the
+    // sample count of each pixel is taken from the adaptive sampler's buffer.
+    Denoiser(unsigned int width, unsigned int height, unsigned int iterations, bool adaptiveSampling);
+
+    // Compile option of the render kernels to write the feature buffers
+    static const char* GetKernelOptions() { return " -D AOV_BUFFERS"; }
+
+    const cl::Buffer& GetAlbedoBuffer() const { return m_AlbedoBuffer; }
+    const cl::Buffer& GetNormalDepthBuffer() const { return m_NormalDepthBuffer; }
+
+    // Enqueues the filter passes over _accumulation_, an average of _sampleCount_ frames or of
+    // the per pixel _sampleCounts_ with adaptive sampling
+    void Run(const cl::Buffer& accumulation, unsigned int sampleCount, const cl::Buffer& sampleCounts);
+
+    // Linear float4 radiance like the accumulation
+    const cl::Buffer& GetOutputBuffer() const { return m_FilterBuffers[(m_Iterations + 1) % 2]; }
+
+private:
+    void Enqueue(const cl::Kernel& kernel, const char* name);
+
+private:
+    unsigned int m_Width;
+    unsigned int m_Height;
+    unsigned int m_Iterations;
+    cl::Program m_Program;
+    cl::Kernel m_PrepareKernel;
+    cl::Kernel m_FilterKernel;
+    cl::Kernel m_FinishKernel;
+    // Running averages of the first hit features
+    cl::Buffer m_AlbedoBuffer;
+    cl::Buffer m_NormalDepthBuffer;
+    // Filter passes read one and write the other, the last pass writes the output into the free one
+    cl::Buffer m_FilterBuffers[2];
+
+};
+
+#endif // DENOISER_HPP
@@ -1,26 +1,162 @@
 #include "render.hpp"
 #include "mathlib/mathlib.hpp"
-#include "io/hdr_loader.hpp"
-#include "io/store_bmp.hpp"
+#include "io/benchmark_config.hpp"
 #include "utils/cl_exception.hpp"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+// Optional kernel features the config may enable, each is compiled in with -D <name>
+static const char* KERNEL_FEATURES[] = { "DOF", "BLINN", "GAMMA_CORRECTION" };
+
+// Defines for the space separated _features_, every one has to be a known kernel feature
+static std::string GetFeatureOptions(const std::string& features)
+{
+    std::istringstream stream(features);
+    std::string options;
+    std::string feature;
+    while (stream >> feature)
+    {
+        if (std::find(std::begin(KERNEL_FEATURES), std::end(KERNEL_FEATURES), feature) == std::end(KERNEL_FEATURES))
+        {
+            throw std::runtime_error("Unknown kernel feature: " + feature);
+        }
+        options += " -D " + feature;
+    }
+    return options;
+}
+
+// Frames that can be read back or written while the next ones render
+static const size_t FRAME_SLOTS = 3;
 
 static Render g_Render;
 Render* render = &g_Render;
 
-void Render::Init(std::string config_file, size_t width, size_t height)
+void Render::Init(std::string config_file, const benchmark_config& config)
 {
     m_OCLHelper = std::make_shared<OCLHelper>(config_file);
-    m_OCLHelper->CreateProgramFromFile("src/kernels/kernel_bvh.cl", "KernelEntry");
+    m_OCLHelper->SetProgramCache(config.render_kernel_cache(), config.opencl_compile_options());
 
-    m_Viewport = std::make_shared<Viewport>(width, height);
+    m_Viewport = std::make_shared<Viewport>(config.benchmark_width(), config.benchmark_height());
     m_Camera = std::make_shared<Camera>();
-    m_Scene = std::make_shared<BVHScene>("meshes/dragon.obj", 4);
+
+    const std::string& sceneFile = config.scene_file();
+    const std::string binarySceneExtension = ".rtscene";
+    if (sceneFile.size() > binarySceneExtension.size() &&
+        sceneFile.compare(sceneFile.size() - binarySceneExtension.size(), binarySceneExtension.size(), binarySceneExtension) == 0)
+    {
+        // Prebuilt, the builder options do not apply
+        m_Scene = std::make_shared<BVHScene>(sceneFile.c_str());
+    }
+    else if (config.scene_bvh_builder() == "sah")
+    {
+        m_Scene = std::make_shared<BVHScene>(sceneFile.c_str(), 4, -1.0f,
+            static_cast<unsigned int>(config.scene_bvh_width()), config.scene_bvh_cache(), config.scene_compress_vertices());
+    }
+    else if (config.scene_bvh_builder() == "sbvh")
+    {
+        m_Scene = std::make_shared<BVHScene>(sceneFile.c_str(), 4, std::max(config.scene_sbvh_budget(), 0.0f),
+            static_cast<unsigned int>(config.scene_bvh_width()), config.scene_bvh_cache(), config.scene_compress_vertices());
+    }
+    else if (config.scene_bvh_builder() == "lbvh")
+    {
+        m_Scene = std::make_shared<LBVHScene>(sceneFile.c_str(), static_cast<unsigned int>(config.scene_lbvh_treelet_passes()),
+            config.scene_compress_vertices());
+    }
+    else
+    {
+        throw std::runtime_error("Unknown BVH builder: " + config.scene_bvh_builder());
+    }
+
+    if (!config.scene_export().empty())
+    {
+        BVHScene* bvhScene = dynamic_cast<BVHScene*>(m_Scene.get());
+        if (!bvhScene)
+        {
+            throw std::runtime_error("Only scenes with a host-built BVH can be exported");
+        }
+        bvhScene->Export(config.scene_export());
+    }
+
+    m_Environment = std::make_shared<Environment>(config.scene_environment(), config.scene_environment_cache(), config.scene_environment_budget());
+
+    if (config.render_max_depth() == 0)
+    {
+        throw std::runtime_error("Paths need at least one vertex, render.max-depth is 0");
+    }
+
+    if (config.render_adaptive_threshold() > 0.0f)
+    {
+        m_AdaptiveSampler = std::make_shared<AdaptiveSampler>(GetGlobalWorkSize(), config.render_adaptive_threshold(),
+            static_cast<unsigned int>(config.render_adaptive_min_samples()));
+    }
+
+    // Only stored frames are filtered, without them the feature buffers would be accumulated for nothing
+    if (config.render_denoise_iterations() > 0 && config.render_store_frames())
+    {
+        m_Denoiser = std::make_shared<Denoiser>(m_Viewport->width, m_Viewport->height, static_cast<unsigned int>(config.render_denoise_iterations()),
+            m_AdaptiveSampler != nullptr);
+    }
+
+    // The node layout of the scene selects the traversal code, the environment its level count. The path
+    // depths and the features are compiled in, so every combination gets a specialized kernel.
+    std::string options = m_Scene->GetKernelOptions() + " " + m_Environment->GetKernelOptions() +
+        " -D MAX_DEPTH=" + std::to_string(config.render_max_depth()) + " -D RR_MIN_DEPTH=" + std::to_string(config.render_rr_min_depth()) +
+        GetFeatureOptions(config.render_kernel_features()) + (m_Denoiser ? Denoiser::GetKernelOptions() : "") +
+        (m_AdaptiveSampler ? AdaptiveSampler::GetKernelOptions() : "");
+    if (config.render_pipeline() == "megakernel")
+    {
+        // Both alternatives to one work-item per pixel take pixels from a work counter
+        bool persistent = config.render_persistent_threads() || config.render_path_regeneration();
+        std::string kernel = config.render_path_regeneration() ? "KernelEntryRegenerate" : persistent ? "KernelEntryPersistent" : "KernelEntry";
+        m_OCLHelper->CreateProgramFromFile("src/kernels/kernel_bvh.cl", { kernel }, options);
+        if (persistent)
+        {
+            m_PersistentGroupSize = m_OCLHelper->GetPreferredWorkGroupSize();
+            m_PersistentWorkItems = m_OCLHelper->GetComputeUnits() * std::max<size_t>(config.render_persistent_groups(), 1) * m_PersistentGroupSize;
+            std::cout << "Persistent threads: " << m_PersistentWorkItems << " work-items in groups of " << m_PersistentGroupSize << std::endl;
+        }
+    }
+    else if (config.render_pipeline() == "wavefront")
+    {
+        m_Wavefront = std::make_shared<Wavefront>(static_cast<unsigned int>(std::min<size_t>(config.render_wavefront_paths(), GetGlobalWorkSize())),
+            static_cast<unsigned int>(config.render_max_depth()));
+        m_OCLHelper->CreateProgramFromFile("src/kernels/kernel_wavefront.cl", Wavefront::GetKernelNames(), options);
+    }
+    else
+    {
+        throw std::runtime_error("Unknown render pipeline: " + config.render_pipeline());
+    }
+
+    if (config.render_store_frames())
+    {
+        ImageFormat_t imageFormat = ImageWriter::ParseFormat(config.render_image_format());
+        PixelFormat_t format;
+        if (config.render_output_format() == "rgba8")
+        {
+            format = PixelFormat_t::RGBA8;
+        }
+        else if (config.render_output_format() == "rgb10a2")
+        {
+            format = PixelFormat_t::RGB10A2;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown output format: " + config.render_output_format());
+        }
+        // Linear formats take the accumulation buffer as it is
+        if (!ImageWriter::IsLinear(imageFormat))
+        {
+            m_Tonemapper = std::make_shared<Tonemapper>(format, GetFeatureOptions(config.render_kernel_features()), GetGlobalWorkSize());
+        }
+        m_FrameWriter = std::make_shared<FrameWriter>(m_Viewport->width, m_Viewport->height, imageFormat, format, FRAME_SLOTS);
+    }
 
     SetupBuffers();
 }
 
-Image image;
 void Render::SetupBuffers()
 {
     m_OCLHelper->SetArgument(RenderKernelArgument_t::WIDTH, &m_Viewport->width, sizeof(unsigned int));
@@ -29,29 +165,63 @@ void Render::SetupBuffers()
     m_OutputBuffer = m_OCLHelper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, GetGlobalWorkSize() * sizeof(float) * 4);
     std::cout << "OutputBuffer size: " << float(GetGlobalWorkSize() * sizeof(float) * 4) / (1024.0f * 1024.0f) << " MiB" << std::endl;
     m_OCLHelper->SetArgument(RenderKernelArgument_t::BUFFER_OUT, &m_OutputBuffer, sizeof(cl::Buffer));
+
+    // Null buffers without the denoiser, the kernels only write the features with AOV_BUFFERS
+    cl::Buffer albedos = m_Denoiser ? m_Denoiser->GetAlbedoBuffer() : cl::Buffer();
+    cl::Buffer normalDepths = m_Denoiser ? m_Denoiser->GetNormalDepthBuffer() : cl::Buffer();
+    m_OCLHelper->SetArgument(RenderKernelArgument_t::BUFFER_ALBEDO, &albedos, sizeof(cl::Buffer));
+    m_OCLHelper->SetArgument(RenderKernelArgument_t::BUFFER_NORMAL_DEPTH, &normalDepths, sizeof(cl::Buffer));
+
+    // Likewise for adaptive sampling, which starts with every pixel in the active list
+    cl::Buffer sampleCounts = m_AdaptiveSampler ? m_AdaptiveSampler->GetSampleCountBuffer() : cl::Buffer();
+    cl::Buffer activePixels = m_AdaptiveSampler ? m_AdaptiveSampler->GetActivePixelBuffer() : cl::Buffer();
+    m_OCLHelper->SetArgument(RenderKernelArgument_t::BUFFER_SAMPLE_COUNT, &sampleCounts, sizeof(cl::Buffer));
+    m_OCLHelper->SetArgument(RenderKernelArgument_t::BUFFER_ACTIVE_PIXELS, &activePixels, sizeof(cl::Buffer));
+    if (m_AdaptiveSampler)
+    {
+        m_AdaptiveSampler->Reset(m_OutputBuffer);
+    }
+
+    if (m_PersistentWorkItems > 0)
+    {
+        m_WorkCounterBuffer = m_OCLHelper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, sizeof(cl_uint));
+        // The only argument of KernelEntryPersistent after the shared ones
+        m_OCLHelper->SetArgument(static_cast<unsigned int>(RenderKernelArgument_t::COUNT), &m_WorkCounterBuffer, sizeof(cl::Buffer));
+    }
     
     m_Scene->SetupBuffers();
 
-    // Texture Buffers
-    cl::ImageFormat imageFormat;
-    imageFormat.image_channel_order = CL_RGBA;
-    imageFormat.image_channel_data_type = CL_FLOAT;
-
-    HDRLoader::Load("textures/Topanga_Forest_B_3k.hdr", image);
-    //HDRLoader::Load("textures/studio.hdr", image);
+    m_Environment->SetupBuffers();
 
-    cl_int errCode;
-    m_Texture0 = cl::Image2D(m_OCLHelper->GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, imageFormat, image.width, image.height, 0, image.colors, &errCode);
-    std::cout << "Texture0 size: " << float(image.width * image.height * sizeof(float) * 4) / (1024.0f * 1024.0f) << " MiB" << std::endl;
-    noma::ocl::error_handler(errCode, "Failed to create image");
+    if (m_FrameWriter)
+    {
+        // Finished frames are copied on the device and read back through their own queue,
+        // the next frame can render while the copy is read
+        cl_int errCode;
+        m_ReadbackQueue = cl::CommandQueue(m_OCLHelper->GetContext(), m_OCLHelper->GetOCLHelper()->device(), 0, &errCode);
+        if (errCode)
+        {
+            throw CLException("Failed to create readback queue", errCode);
+        }
+        for (size_t i = 0; i < m_FrameWriter->GetSlotCount(); ++i)
+        {
+            m_StagingBuffers.push_back(m_OCLHelper->GetOCLHelper()->create_buffer(CL_MEM_READ_WRITE, m_FrameWriter->GetFrameSize()));
+        }
+        std::cout << "StagingBuffers size: " << float(m_StagingBuffers.size() * m_FrameWriter->GetFrameSize()) / (1024.0f * 1024.0f)
+                  << " MiB (" << m_StagingBuffers.size() << " frames)" << std::endl;
+    }
 
-    m_OCLHelper->SetArgument(RenderKernelArgument_t::TEXTURE0, &m_Texture0, sizeof(cl::Image2D));
+    if (m_Wavefront)
+    {
+        m_Wavefront->SetupBuffers();
+    }
 
 }
 
 double Render::GetCurtime() const
 {
-    return (double)clock() / (double)CLOCKS_PER_SEC;
+    // Wall clock time, clock() would add up the CPU time of all worker threads
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
 unsigned int Render::GetGlobalWorkSize() const
@@ -71,19 +241,95 @@ cl_ulong Render::RenderFrame()
 
     m_Camera->Update();
 
-    cl_ulong t = m_OCLHelper->RunKernelTimed(GetGlobalWorkSize());
+    // Adaptive sampling traces the pixels the last frame left in the active list
+    unsigned int pixelCount = m_AdaptiveSampler ? m_AdaptiveSampler->GetActiveCount() : GetGlobalWorkSize();
+    cl_ulong t = 0;
+    if (m_Wavefront)
+    {
+        t = m_Wavefront->RenderFrame(pixelCount);
+    }
+    else if (pixelCount == 0)
+    {
+        // Every pixel converged, nothing is left to trace
+    }
+    else if (m_PersistentWorkItems > 0)
+    {
+        cl_int errCode = m_OCLHelper->GetOCLHelper()->queue().enqueueFillBuffer(m_WorkCounterBuffer, cl_uint(0), 0, sizeof(cl_uint));
+        if (errCode)
+        {
+            throw CLException("Failed to reset the work counter", errCode);
+        }
+        t = m_OCLHelper->RunKernelTimed(m_PersistentWorkItems, m_PersistentGroupSize);
+    }
+    else
+    {
+        t = m_OCLHelper->RunKernelTimed(pixelCount);
+    }
+    m_TracedPaths += pixelCount;
+
+    if (m_AdaptiveSampler)
+    {
+        m_AdaptiveSampler->Update(m_OutputBuffer);
+    }
 
-#ifdef STORE_BMP
-    m_OCLHelper->ReadBuffer(m_OutputBuffer, m_Viewport->pixels, sizeof(float) * 4 * GetGlobalWorkSize());
-    std::string filename = "out_" + std::to_string(m_Camera->GetFrameCount()) + ".bmp";
-    StoreBMP::Store(filename.c_str(), m_Viewport);
-#endif
+    if (m_FrameWriter)
+    {
+        StoreFrame();
+    }
 
     return t;
 }
 
+void Render::StoreFrame()
+{
+    size_t slot = m_FrameWriter->AcquireSlot();
+    size_t size = m_FrameWriter->GetFrameSize();
+    cl::CommandQueue& queue = m_OCLHelper->GetOCLHelper()->queue();
+
+    // The next frame accumulates into the output buffer, linear frames are copied before it starts
+    const cl::Buffer* frame = &m_OutputBuffer;
+    if (m_Denoiser)
+    {
+        // Every frame so far added one sample to each pixel, unless adaptive sampling counts them per pixel
+        m_Denoiser->Run(m_OutputBuffer, m_Camera->GetFrameCount(),
+            m_AdaptiveSampler ? m_AdaptiveSampler->GetSampleCountBuffer() : cl::Buffer());
+        frame = &m_Denoiser->GetOutputBuffer();
+    }
+    if (m_Tonemapper)
+    {
+        m_Tonemapper->Run(*frame);
+        frame = &m_Tonemapper->GetOutputBuffer();
+    }
+    std::vector<cl::Event> copied(1);
+    cl_int errCode = queue.enqueueCopyBuffer(*frame, m_StagingBuffers[slot], 0, 0, size, nullptr, &copied[0]);
+    if (errCode)
+    {
+        throw CLException("Failed to copy frame", errCode);
+    }
+    queue.flush();
+
+    cl::Event read;
+    errCode = m_ReadbackQueue.enqueueReadBuffer(m_StagingBuffers[slot], CL_FALSE, 0, size, m_FrameWriter->GetPixels(slot), &copied, &read);
+    if (errCode)
+    {
+        throw CLException("Failed to read frame", errCode);
+    }
+    m_ReadbackQueue.flush();
+
+    m_FrameWriter->Submit(slot, read, "out_" + std::to_string(m_Camera->GetFrameCount()) + "." + ImageWriter::GetExtension(m_FrameWriter->GetFormat()));
+}
+
+void Render::Flush()
+{
+    if (m_FrameWriter)
+    {
+        m_FrameWriter->Flush();
+    }
+}
+
 void Render::Shutdown()
 {
+    m_FrameWriter.reset();
 
 }
 
@@ -91,3 +337,18 @@ std::shared_ptr<OCLHelper> Render::GetOCLHelper() const
 {
     return m_OCLHelper;
 }
+
+std::shared_ptr<Scene> Render::GetScene() const
+{
+    return m_Scene;
+}
+
+uint64_t Render::GetTracedPaths() const
+{
+    return m_TracedPaths;
+}
+
+std::shared_ptr<Wavefront> Render::GetWavefront() const
+{
+    return m_Wavefront;
+}
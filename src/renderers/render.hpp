@@ -4,27 +4,47 @@
 #include "scene/camera.hpp"
 #include "scene/scene.hpp"
 #include "ocl_helper/ocl_helper.hpp"
+#include "scene/environment.hpp"
+#include "io/frame_writer.hpp"
+#include "renderers/adaptive_sampler.hpp"
+#include "renderers/denoiser.hpp"
+#include "renderers/tonemap.hpp"
+#include "renderers/wavefront.hpp"
 #include "utils/viewport.hpp"
 #include "noma/ocl/helper.hpp"
+#include <cstdint>
 #include <memory>
 #include <ctime>
+#include <vector>
 
 #define BVH_INTERSECTION
 
+class benchmark_config;
+
 class Render
 {
 public:
-    void         Init(std::string config_file, size_t width, size_t height);
+    void         Init(std::string config_file, const benchmark_config& config);
     cl_ulong     RenderFrame();
+    // Waits until the frames still read back or written in the background are stored
+    void         Flush();
     void         Shutdown();
 
     double       GetCurtime()        const;
     unsigned int GetGlobalWorkSize() const;
 
     std::shared_ptr<OCLHelper>  GetOCLHelper()  const;
+    std::shared_ptr<Scene>      GetScene()      const;
+    // nullptr with the megakernel pipeline
+    std::shared_ptr<Wavefront>  GetWavefront()  const;
+    // Paths traced by all frames so far, less than a path per pixel and frame with adaptive sampling
+    uint64_t                    GetTracedPaths() const;
 
 private:
     void SetupBuffers();
+    // Tonemaps the finished or denoised frame unless the image format is linear and hands it to the
+    // frame writer without waiting for the readback
+    void StoreFrame();
 
 private:
     // OCLHelper
@@ -33,9 +53,27 @@ private:
     std::shared_ptr<Camera>     m_Camera;
     std::shared_ptr<Scene>      m_Scene;
     std::shared_ptr<Viewport>   m_Viewport;
+    std::shared_ptr<Environment> m_Environment;
+    std::shared_ptr<Wavefront>  m_Wavefront;
+    // nullptr unless render.adaptive-threshold is set
+    std::shared_ptr<AdaptiveSampler> m_AdaptiveSampler;
+    // nullptr unless render.denoise-iterations is set
+    std::shared_ptr<Denoiser>   m_Denoiser;
+    // nullptr unless frames are stored in a format of packed pixels
+    std::shared_ptr<Tonemapper> m_Tonemapper;
+    std::shared_ptr<FrameWriter> m_FrameWriter;
+    cl::CommandQueue m_ReadbackQueue;
+    // Device copies of the frames in the writer's slots
+    std::vector<cl::Buffer> m_StagingBuffers;
     // Buffers
+    // Linear radiance as float4, averaged over the frames
     cl::Buffer m_OutputBuffer;
-    cl::Image2D m_Texture0;
+    // Next pixel for persistent threads and path regeneration
+    cl::Buffer m_WorkCounterBuffer;
+    // Launch size with persistent threads, 0 launches a work-item per pixel
+    size_t m_PersistentWorkItems = 0;
+    size_t m_PersistentGroupSize = 0;
+    uint64_t m_TracedPaths = 0;
 
 };
 
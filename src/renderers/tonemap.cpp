@@ -0,0 +1,37 @@
+#include "tonemap.hpp"
+#include "renderers/render.hpp"
+#include "utils/cl_exception.hpp"
+#include <cstdint>
+#include <iostream>
+
+Tonemapper::Tonemapper(PixelFormat_t format, const std::string& featureOptions, unsigned int pixelCount)
+    : m_Format(format)
+    , m_PixelCount(pixelCount)
+{
+    std::shared_ptr<OCLHelper> helper = render->GetOCLHelper();
+    std::string options = featureOptions + (format == PixelFormat_t::RGB10A2 ? " -D OUTPUT_RGB10A2" : "");
+    m_Program = helper->BuildProgram("src/kernels/kernel_tonemap.cl", options);
+
+    cl_int errCode;
+    m_Kernel = cl::Kernel(m_Program, "Tonemap", &errCode);
+    if (errCode)
+    {
+        throw CLException("Failed to create tonemap kernel", errCode);
+    }
+
+    m_OutputBuffer = helper->GetOCLHelper()->create_buffer(CL_MEM_WRITE_ONLY, size_t(m_PixelCount) * sizeof(uint32_t));
+    std::cout << "TonemapBuffer size: " << float(size_t(m_PixelCount) * sizeof(uint32_t)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+
+}
+
+void Tonemapper::Run(const cl::Buffer& accumulation)
+{
+    m_Kernel.setArg(0, accumulation);
+    m_Kernel.setArg(1, m_OutputBuffer);
+    m_Kernel.setArg(2, m_PixelCount);
+    cl_int errCode = render->GetOCLHelper()->GetOCLHelper()->queue().enqueueNDRangeKernel(m_Kernel, cl::NullRange, cl::NDRange(m_PixelCount));
+    if (errCode)
+    {
+        throw CLException("Failed to run tonemap kernel", errCode);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef TONEMAP_HPP
+#define TONEMAP_HPP
+
+#include "utils/pixel_format.hpp"
+#include <CL/cl.hpp>
+#include <string>
+
+// Encodes the linear accumulation buffer of the render kernels into packed
+// pixels, so only 4 bytes per pixel are read back for output
+class Tonemapper
+{
+public:
+    // _featureOptions_ carry the kernel features, GAMMA_CORRECTION applies here
+    Tonemapper(PixelFormat_t format, const std::string& featureOptions, unsigned int pixelCount);
+
+    // Enqueues the conversion of _accumulation_ into the output buffer
+    void Run(const cl::Buffer& accumulation);
+
+    const cl::Buffer& GetOutputBuffer() const { return m_OutputBuffer; }
+    PixelFormat_t GetFormat() const { return m_Format; }
+
+private:
+    PixelFormat_t m_Format;
+    unsigned int m_PixelCount;
+    cl::Program m_Program;
+    cl::Kernel m_Kernel;
+    cl::Buffer m_OutputBuffer;
+
+};
+
+#endif // TONEMAP_HPP
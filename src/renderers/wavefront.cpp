@@ -0,0 +1,136 @@
+#include "wavefront.hpp"
+#include "renderers/render.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+// Arguments of the wavefront kernels after the shared render kernel arguments
+enum class WavefrontArgument_t : unsigned int
+{
+    BUFFER_RAY_ORIGIN = static_cast<unsigned int>(RenderKernelArgument_t::COUNT),
+    BUFFER_RAY_DIRECTION,
+    BUFFER_THROUGHPUT,
+    BUFFER_RADIANCE,
+    BUFFER_HIT,
+    BUFFER_QUEUE,
+    BUFFER_COUNTER,
+    BUFFER_SHADOW_ORIGIN,
+    BUFFER_SHADOW_DIRECTION,
+    BUFFER_SHADOW_CONTRIBUTION,
+    PIXEL_OFFSET,
+    PATH_COUNT,
+    DEPTH,
+};
+
+// Two ray queues and the shadow ray count
+static const size_t COUNTER_COUNT = 3;
+
+static void SetArgument(WavefrontArgument_t argIndex, void* data, size_t size)
+{
+    render->GetOCLHelper()->SetArgument(static_cast<unsigned int>(argIndex), data, size);
+}
+
+Wavefront::Wavefront(unsigned int maxPaths, unsigned int maxDepth)
+    : m_MaxPaths(maxPaths)
+    , m_MaxDepth(maxDepth)
+    , m_StageTimes(static_cast<size_t>(WavefrontStage_t::COUNT), 0)
+{
+    if (m_MaxPaths == 0)
+    {
+        throw std::runtime_error("Wavefront pipeline needs at least one path per wave");
+    }
+
+}
+
+std::vector<std::string> Wavefront::GetKernelNames()
+{
+    return { "GenerateRays", "ExtendRays", "ShadeHits", "ConnectShadowRays", "AccumulateRadiance" };
+}
+
+const char* Wavefront::GetStageName(WavefrontStage_t stage)
+{
+    static const char* names[] = { "generate", "extend", "shade", "connect", "accumulate" };
+    return names[static_cast<unsigned int>(stage)];
+}
+
+void Wavefront::SetupBuffers()
+{
+    std::shared_ptr<noma::ocl::helper> helper = render->GetOCLHelper()->GetOCLHelper();
+    size_t pathStateSize = m_MaxPaths * sizeof(cl_float4);
+
+    m_RayOriginBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_RayDirectionBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_ThroughputBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_RadianceBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_HitBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_QueueBuffer = helper->create_buffer(CL_MEM_READ_WRITE, m_MaxPaths * sizeof(cl_uint) * 2);
+    m_CounterBuffer = helper->create_buffer(CL_MEM_READ_WRITE, COUNTER_COUNT * sizeof(cl_uint));
+    m_ShadowOriginBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_ShadowDirectionBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    m_ShadowContributionBuffer = helper->create_buffer(CL_MEM_READ_WRITE, pathStateSize);
+    std::cout << "WavefrontBuffers size: " << float(pathStateSize * 8 + m_MaxPaths * sizeof(cl_uint) * 2) / (1024.0f * 1024.0f)
+              << " MiB (" << m_MaxPaths << " paths per wave)" << std::endl;
+
+    SetArgument(WavefrontArgument_t::BUFFER_RAY_ORIGIN, &m_RayOriginBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_RAY_DIRECTION, &m_RayDirectionBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_THROUGHPUT, &m_ThroughputBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_RADIANCE, &m_RadianceBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_HIT, &m_HitBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_QUEUE, &m_QueueBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_COUNTER, &m_CounterBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_SHADOW_ORIGIN, &m_ShadowOriginBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_SHADOW_DIRECTION, &m_ShadowDirectionBuffer, sizeof(cl::Buffer));
+    SetArgument(WavefrontArgument_t::BUFFER_SHADOW_CONTRIBUTION, &m_ShadowContributionBuffer, sizeof(cl::Buffer));
+
+}
+
+void Wavefront::SetLaunchArguments(unsigned int pixelOffset, unsigned int pathCount, unsigned int depth)
+{
+    SetArgument(WavefrontArgument_t::PIXEL_OFFSET, &pixelOffset, sizeof(unsigned int));
+    SetArgument(WavefrontArgument_t::PATH_COUNT, &pathCount, sizeof(unsigned int));
+    SetArgument(WavefrontArgument_t::DEPTH, &depth, sizeof(unsigned int));
+}
+
+cl_ulong Wavefront::RenderFrame(unsigned int pixelCount)
+{
+    std::shared_ptr<OCLHelper> helper = render->GetOCLHelper();
+    std::vector<std::pair<WavefrontStage_t, cl::Event>> launches;
+
+    auto enqueue = [&](WavefrontStage_t stage, unsigned int workItems)
+    {
+        launches.emplace_back(stage, cl::Event());
+        helper->EnqueueKernel(static_cast<size_t>(stage), workItems, &launches.back().second);
+    };
+
+    for (unsigned int pixelOffset = 0; pixelOffset < pixelCount; pixelOffset += m_MaxPaths)
+    {
+        unsigned int pathCount = std::min(m_MaxPaths, pixelCount - pixelOffset);
+
+        // The queue counters live on the device, so every bounce launches a work-item per path
+        // and the ones past the end of the queue return right away. Kernel arguments are captured
+        // at enqueue time, the launches need no synchronization in between.
+        SetLaunchArguments(pixelOffset, pathCount, 0);
+        enqueue(WavefrontStage_t::GENERATE, pathCount);
+        for (unsigned int depth = 0; depth < m_MaxDepth; ++depth)
+        {
+            SetLaunchArguments(pixelOffset, pathCount, depth);
+            enqueue(WavefrontStage_t::EXTEND, pathCount);
+            enqueue(WavefrontStage_t::SHADE, pathCount);
+            enqueue(WavefrontStage_t::CONNECT, pathCount);
+        }
+        enqueue(WavefrontStage_t::ACCUMULATE, pathCount);
+    }
+
+    helper->Finish();
+
+    std::fill(m_StageTimes.begin(), m_StageTimes.end(), 0);
+    cl_ulong total = 0;
+    for (const auto& launch : launches)
+    {
+        cl_ulong t = OCLHelper::GetEventTime(launch.second);
+        m_StageTimes[static_cast<unsigned int>(launch.first)] += t;
+        total += t;
+    }
+
+    return total;
+}
@@ -0,0 +1,62 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+
+// Kernels of kernel_wavefront.cl in the order of the program's kernel list
+enum class WavefrontStage_t : unsigned int
+{
+    GENERATE,
+    EXTEND,
+    SHADE,
+    CONNECT,
+    ACCUMULATE,
+    COUNT,
+};
+
+// Wavefront path tracing as an alternative to the KernelEntry megakernel.
+// Every bounce runs the extend, shade and connect stages over all live paths
+// of a wave, the path state is kept in device buffers between the launches.
+// Frames with more pixels than _maxPaths_ are rendered in several waves.
+class Wavefront
+{
+public:
+    Wavefront(unsigned int maxPaths, unsigned int maxDepth);
+
+    static std::vector<std::string> GetKernelNames();
+    static const char* GetStageName(WavefrontStage_t stage);
+
+    // Binds the path state to the wavefront kernels, the program has to be created
+    void SetupBuffers();
+
+    // Returns the summed kernel time of all stages in ns
+    cl_ulong RenderFrame(unsigned int pixelCount);
+
+    // Kernel time of _stage_ in the last frame in ns
+    cl_ulong GetStageTime(WavefrontStage_t stage) const { return m_StageTimes[static_cast<unsigned int>(stage)]; }
+
+private:
+    void SetLaunchArguments(unsigned int pixelOffset, unsigned int pathCount, unsigned int depth);
+
+private:
+    unsigned int m_MaxPaths;
+    unsigned int m_MaxDepth;
+    std::vector<cl_ulong> m_StageTimes;
+    // Per path state
+    cl::Buffer m_RayOriginBuffer;
+    cl::Buffer m_RayDirectionBuffer;
+    cl::Buffer m_ThroughputBuffer;
+    cl::Buffer m_RadianceBuffer;
+    cl::Buffer m_HitBuffer;
+    cl::Buffer m_QueueBuffer;
+    cl::Buffer m_CounterBuffer;
+    // Per shadow ray state
+    cl::Buffer m_ShadowOriginBuffer;
+    cl::Buffer m_ShadowDirectionBuffer;
+    cl::Buffer m_ShadowContributionBuffer;
+
+};
+
+#endif // WAVEFRONT_HPP
@@ -0,0 +1,476 @@
+#include "bvh_builder.hpp"
+#include "utils/task_scheduler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+#include <limits>
+
+// Ranges of at least this many primitives are binned and partitioned in parallel
+static const unsigned int PARALLEL_RANGE_THRESHOLD = 64 * 1024;
+// Ranges of at least this many primitives build their first child as a separate task
+static const unsigned int TASK_RANGE_THRESHOLD = 4 * 1024;
+// Primitives per chunk for the parallel loops
+static const unsigned int CHUNK_SIZE = 16 * 1024;
+
+// Interior node of the task levels, or a reference to a subtree that has
+// already been written in linear layout by one of the threads
+struct BVHBuildNode
+{
+    Bounds3 bounds;
+    BVHBuildNode *children[2];
+    unsigned int splitAxis;
+    unsigned int subtreeThread, subtreeFirst, subtreeCount;
+
+};
+
+struct BVHBuilder::SubtreeCopy
+{
+    unsigned int thread, first, count, offset;
+};
+
+struct BucketInfo
+{
+    int count = 0;
+    Bounds3 bounds;
+};
+
+struct BucketSet
+{
+    BucketInfo buckets[BVHBuilder::nBuckets];
+};
+
+// Maps centroids to SAH buckets along one axis, shared by binning and partitioning
+// so both agree on the bucket of every primitive
+class BucketMapping
+{
+public:
+    BucketMapping(const Bounds3& centroidBounds, unsigned int dim)
+        : m_Min(centroidBounds.min[dim]),
+        m_Scale(BVHBuilder::nBuckets / (centroidBounds.max[dim] - centroidBounds.min[dim])),
+        m_Dim(dim)
+    {}
+
+    unsigned int operator()(const float3& centroid) const
+    {
+        int b = static_cast<int>((centroid[m_Dim] - m_Min) * m_Scale);
+        return static_cast<unsigned int>(clamp(b, 0, static_cast<int>(BVHBuilder::nBuckets) - 1));
+    }
+
+private:
+    float m_Min;
+    float m_Scale;
+    unsigned int m_Dim;
+
+};
+
+static unsigned int ChunkCount(unsigned int start, unsigned int end)
+{
+    return (end - start + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+BVHBuilder::BVHBuilder(unsigned int maxPrimitivesInNode)
+    : m_MaxPrimitivesInNode(maxPrimitivesInNode), m_TotalNodes(0)
+{
+}
+
+void BVHBuilder::Build(const std::vector<Bounds3>& primitiveBounds,
+    std::vector<LinearBVHNode>& nodes,
+    std::vector<unsigned int>& primitiveIndices)
+{
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    unsigned int nPrimitives = static_cast<unsigned int>(primitiveBounds.size());
+    assert(nPrimitives > 0);
+
+    m_PrimitiveInfo.resize(nPrimitives);
+    scheduler.ParallelFor(0, nPrimitives, CHUNK_SIZE, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            m_PrimitiveInfo[i] = BVHPrimitiveInfo(static_cast<unsigned int>(i), primitiveBounds[i]);
+        }
+    });
+    if (nPrimitives >= PARALLEL_RANGE_THRESHOLD)
+    {
+        m_PartitionScratch.resize(nPrimitives);
+    }
+
+    m_TotalNodes = 0;
+    m_Arenas.clear();
+    m_ThreadNodes.assign(scheduler.GetThreadCount(), std::vector<LinearBVHNode>());
+    for (unsigned int i = 0; i < scheduler.GetThreadCount(); ++i)
+    {
+        m_Arenas.emplace_back(new MemoryArena);
+    }
+
+    BVHBuildNode* root = RecursiveBuild(0, nPrimitives);
+
+    // Lay out the task levels depth-first, then move the subtrees in behind their parents
+    nodes.resize(m_TotalNodes);
+    unsigned int offset = 0;
+    std::vector<SubtreeCopy> copies;
+    FlattenBVHTree(root, nodes, &offset, copies);
+    assert(offset == nodes.size());
+
+    scheduler.ParallelFor(0, copies.size(), 1, [&](size_t first, size_t last)
+    {
+        for (size_t c = first; c < last; ++c)
+        {
+            const SubtreeCopy& copy = copies[c];
+            const LinearBVHNode* src = &m_ThreadNodes[copy.thread][copy.first];
+            LinearBVHNode* dst = &nodes[copy.offset];
+            memcpy(dst, src, copy.count * sizeof(LinearBVHNode));
+            for (unsigned int i = 0; i < copy.count; ++i)
+            {
+                if (dst[i].nPrimitives == 0)
+                {
+                    dst[i].offset += copy.offset;
+                }
+            }
+        }
+    });
+
+    // Release the build nodes
+    m_Arenas.clear();
+    std::vector<std::vector<LinearBVHNode>>().swap(m_ThreadNodes);
+
+    // Leaves reference contiguous ranges of the partitioned primitive info
+    primitiveIndices.resize(nPrimitives);
+    scheduler.ParallelFor(0, nPrimitives, CHUNK_SIZE, [&](size_t first, size_t last)
+    {
+        for (size_t i = first; i < last; ++i)
+        {
+            primitiveIndices[i] = m_PrimitiveInfo[i].primitiveNumber;
+        }
+    });
+
+    std::vector<BVHPrimitiveInfo>().swap(m_PrimitiveInfo);
+    std::vector<BVHPrimitiveInfo>().swap(m_PartitionScratch);
+
+}
+
+void BVHBuilder::ComputeBounds(unsigned int start, unsigned int end, Bounds3& bounds, Bounds3& centroidBounds) const
+{
+    if (end - start < PARALLEL_RANGE_THRESHOLD)
+    {
+        for (unsigned int i = start; i < end; ++i)
+        {
+            bounds = Union(bounds, m_PrimitiveInfo[i].bounds);
+            centroidBounds = Union(centroidBounds, m_PrimitiveInfo[i].centroid);
+        }
+        return;
+    }
+
+    unsigned int nChunks = ChunkCount(start, end);
+    std::vector<Bounds3> chunkBounds(nChunks);
+    std::vector<Bounds3> chunkCentroidBounds(nChunks);
+
+    TaskScheduler::Get().ParallelFor(0, nChunks, 1, [&](size_t firstChunk, size_t lastChunk)
+    {
+        for (size_t c = firstChunk; c < lastChunk; ++c)
+        {
+            unsigned int chunkStart = start + static_cast<unsigned int>(c) * CHUNK_SIZE;
+            unsigned int chunkEnd = std::min(chunkStart + CHUNK_SIZE, end);
+            for (unsigned int i = chunkStart; i < chunkEnd; ++i)
+            {
+                chunkBounds[c] = Union(chunkBounds[c], m_PrimitiveInfo[i].bounds);
+                chunkCentroidBounds[c] = Union(chunkCentroidBounds[c], m_PrimitiveInfo[i].centroid);
+            }
+        }
+    });
+
+    for (unsigned int c = 0; c < nChunks; ++c)
+    {
+        bounds = Union(bounds, chunkBounds[c]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+    }
+
+}
+
+static void BinPrimitives(const BVHPrimitiveInfo* primitiveInfo, unsigned int count, const BucketMapping& mapping, BucketSet& set)
+{
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        unsigned int b = mapping(primitiveInfo[i].centroid);
+        set.buckets[b].count++;
+        set.buckets[b].bounds = Union(set.buckets[b].bounds, primitiveInfo[i].bounds);
+    }
+}
+
+unsigned int BVHBuilder::Partition(unsigned int start, unsigned int end, unsigned int dim, unsigned int splitBucket, const Bounds3& centroidBounds)
+{
+    BucketMapping mapping(centroidBounds, dim);
+
+    if (end - start < PARALLEL_RANGE_THRESHOLD)
+    {
+        BVHPrimitiveInfo *pmid = std::partition(&m_PrimitiveInfo[start], &m_PrimitiveInfo[end - 1] + 1,
+            [&](const BVHPrimitiveInfo &pi)
+            {
+                return mapping(pi.centroid) <= splitBucket;
+            });
+        return static_cast<unsigned int>(pmid - &m_PrimitiveInfo[0]);
+    }
+
+    // Count the left side of every chunk, then scatter both sides through the scratch buffer
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    unsigned int nChunks = ChunkCount(start, end);
+    std::vector<unsigned int> leftCount(nChunks, 0);
+
+    scheduler.ParallelFor(0, nChunks, 1, [&](size_t firstChunk, size_t lastChunk)
+    {
+        for (size_t c = firstChunk; c < lastChunk; ++c)
+        {
+            unsigned int chunkStart = start + static_cast<unsigned int>(c) * CHUNK_SIZE;
+            unsigned int chunkEnd = std::min(chunkStart + CHUNK_SIZE, end);
+            for (unsigned int i = chunkStart; i < chunkEnd; ++i)
+            {
+                leftCount[c] += mapping(m_PrimitiveInfo[i].centroid) <= splitBucket;
+            }
+        }
+    });
+
+    std::vector<unsigned int> leftOffset(nChunks);
+    std::vector<unsigned int> rightOffset(nChunks);
+    unsigned int totalLeft = 0;
+    for (unsigned int c = 0; c < nChunks; ++c)
+    {
+        leftOffset[c] = start + totalLeft;
+        totalLeft += leftCount[c];
+    }
+    unsigned int totalRight = 0;
+    for (unsigned int c = 0; c < nChunks; ++c)
+    {
+        unsigned int chunkStart = start + c * CHUNK_SIZE;
+        unsigned int chunkEnd = std::min(chunkStart + CHUNK_SIZE, end);
+        rightOffset[c] = start + totalLeft + totalRight;
+        totalRight += (chunkEnd - chunkStart) - leftCount[c];
+    }
+
+    scheduler.ParallelFor(0, nChunks, 1, [&](size_t firstChunk, size_t lastChunk)
+    {
+        for (size_t c = firstChunk; c < lastChunk; ++c)
+        {
+            unsigned int chunkStart = start + static_cast<unsigned int>(c) * CHUNK_SIZE;
+            unsigned int chunkEnd = std::min(chunkStart + CHUNK_SIZE, end);
+            unsigned int left = leftOffset[c];
+            unsigned int right = rightOffset[c];
+            for (unsigned int i = chunkStart; i < chunkEnd; ++i)
+            {
+                if (mapping(m_PrimitiveInfo[i].centroid) <= splitBucket)
+                {
+                    m_PartitionScratch[left++] = m_PrimitiveInfo[i];
+                }
+                else
+                {
+                    m_PartitionScratch[right++] = m_PrimitiveInfo[i];
+                }
+            }
+        }
+    });
+
+    scheduler.ParallelFor(start, end, CHUNK_SIZE, [&](size_t first, size_t last)
+    {
+        std::copy(m_PartitionScratch.begin() + first, m_PartitionScratch.begin() + last, m_PrimitiveInfo.begin() + first);
+    });
+
+    return start + totalLeft;
+}
+
+bool BVHBuilder::FindSplit(unsigned int start, unsigned int end, Bounds3& bounds, unsigned int& dim, unsigned int& mid)
+{
+    // Compute bounds of all primitives and of their centroids in one pass
+    Bounds3 centroidBounds;
+    ComputeBounds(start, end, bounds, centroidBounds);
+
+    unsigned int nPrimitives = end - start;
+    if (nPrimitives == 1)
+    {
+        return false;
+    }
+
+    // Choose split dimension
+    dim = centroidBounds.MaximumExtent();
+    if (centroidBounds.max[dim] == centroidBounds.min[dim])
+    {
+        return false;
+    }
+
+    // Partition primitives into two sets and build children
+    mid = (start + end) / 2;
+    if (nPrimitives <= 2)
+    {
+        // Partition primitives into equally-sized subsets
+        std::nth_element(&m_PrimitiveInfo[start], &m_PrimitiveInfo[mid], &m_PrimitiveInfo[end - 1] + 1,
+            [dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b)
+            {
+                return a.centroid[dim] < b.centroid[dim];
+            });
+    }
+    else
+    {
+        // Partition primitives using approximate SAH
+        BucketMapping mapping(centroidBounds, dim);
+        BucketSet set;
+        if (nPrimitives < PARALLEL_RANGE_THRESHOLD)
+        {
+            BinPrimitives(&m_PrimitiveInfo[start], nPrimitives, mapping, set);
+        }
+        else
+        {
+            unsigned int nChunks = ChunkCount(start, end);
+            std::vector<BucketSet> chunkSets(nChunks);
+            TaskScheduler::Get().ParallelFor(0, nChunks, 1, [&](size_t firstChunk, size_t lastChunk)
+            {
+                for (size_t c = firstChunk; c < lastChunk; ++c)
+                {
+                    unsigned int chunkStart = start + static_cast<unsigned int>(c) * CHUNK_SIZE;
+                    unsigned int chunkEnd = std::min(chunkStart + CHUNK_SIZE, end);
+                    BinPrimitives(&m_PrimitiveInfo[chunkStart], chunkEnd - chunkStart, mapping, chunkSets[c]);
+                }
+            });
+            for (unsigned int c = 0; c < nChunks; ++c)
+            {
+                for (unsigned int b = 0; b < nBuckets; ++b)
+                {
+                    set.buckets[b].count += chunkSets[c].buckets[b].count;
+                    set.buckets[b].bounds = Union(set.buckets[b].bounds, chunkSets[c].buckets[b].bounds);
+                }
+            }
+        }
+
+        // Suffix sweep: area and count of everything right of each split
+        float rightArea[nBuckets - 1];
+        int rightCount[nBuckets - 1];
+        Bounds3 b1;
+        int count1 = 0;
+        for (unsigned int i = nBuckets - 1; i > 0; --i)
+        {
+            b1 = Union(b1, set.buckets[i].bounds);
+            count1 += set.buckets[i].count;
+            rightArea[i - 1] = b1.SurfaceArea();
+            rightCount[i - 1] = count1;
+        }
+
+        // Prefix sweep: compute costs for splitting after each bucket and
+        // find bucket to split at that minimizes SAH metric
+        float invArea = 1.0f / bounds.SurfaceArea();
+        float minCost = std::numeric_limits<float>::max();
+        unsigned int minCostSplitBucket = 0;
+        Bounds3 b0;
+        int count0 = 0;
+        for (unsigned int i = 0; i < nBuckets - 1; ++i)
+        {
+            b0 = Union(b0, set.buckets[i].bounds);
+            count0 += set.buckets[i].count;
+            float cost = 1.0f + (count0 * b0.SurfaceArea() + rightCount[i] * rightArea[i]) * invArea;
+            if (cost < minCost)
+            {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+
+        // Either create leaf or split primitives at selected SAH bucket
+        float leafCost = float(nPrimitives);
+        if (nPrimitives > m_MaxPrimitivesInNode || minCost < leafCost)
+        {
+            mid = Partition(start, end, dim, minCostSplitBucket, centroidBounds);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BVHBuildNode* BVHBuilder::RecursiveBuild(unsigned int start, unsigned int end)
+{
+    assert(start < end);
+
+    unsigned int thread = TaskScheduler::GetThreadIndex();
+    BVHBuildNode *node = m_Arenas[thread]->Alloc<BVHBuildNode>();
+
+    // Small ranges are written out directly by this thread
+    Bounds3 bounds;
+    unsigned int dim, mid;
+    if (end - start < TASK_RANGE_THRESHOLD || !FindSplit(start, end, bounds, dim, mid))
+    {
+        std::vector<LinearBVHNode>& threadNodes = m_ThreadNodes[thread];
+        unsigned int subtreeFirst = static_cast<unsigned int>(threadNodes.size());
+        EmitSubtree(start, end, threadNodes, subtreeFirst);
+
+        node->bounds = threadNodes[subtreeFirst].bounds;
+        node->children[0] = node->children[1] = nullptr;
+        node->subtreeThread = thread;
+        node->subtreeFirst = subtreeFirst;
+        node->subtreeCount = static_cast<unsigned int>(threadNodes.size()) - subtreeFirst;
+        m_TotalNodes += node->subtreeCount;
+        return node;
+    }
+
+    m_TotalNodes++;
+
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    TaskGroup group;
+    scheduler.Spawn(group, [this, node, start, mid]() { node->children[0] = RecursiveBuild(start, mid); });
+    node->children[1] = RecursiveBuild(mid, end);
+    scheduler.Wait(group);
+
+    node->bounds = bounds;
+    node->splitAxis = dim;
+    node->subtreeCount = 0;
+
+    return node;
+}
+
+unsigned int BVHBuilder::EmitSubtree(unsigned int start, unsigned int end, std::vector<LinearBVHNode>& nodes, unsigned int subtreeStart)
+{
+    unsigned int index = static_cast<unsigned int>(nodes.size());
+    nodes.emplace_back();
+
+    Bounds3 bounds;
+    unsigned int dim, mid;
+    bool split = FindSplit(start, end, bounds, dim, mid);
+    nodes[index].bounds = bounds;
+
+    if (!split)
+    {
+        assert(end - start < 65536);
+        nodes[index].offset = start;
+        nodes[index].nPrimitives = end - start;
+    }
+    else
+    {
+        // First child follows directly, second child offset is relative to the subtree until it is copied
+        EmitSubtree(start, mid, nodes, subtreeStart);
+        unsigned int secondChild = EmitSubtree(mid, end, nodes, subtreeStart);
+        nodes[index].offset = secondChild - subtreeStart;
+        nodes[index].axis = dim;
+        nodes[index].nPrimitives = 0;
+    }
+
+    return index;
+}
+
+unsigned int BVHBuilder::FlattenBVHTree(BVHBuildNode* node, std::vector<LinearBVHNode>& nodes, unsigned int* offset, std::vector<SubtreeCopy>& copies) const
+{
+    unsigned int myOffset = *offset;
+    if (node->subtreeCount > 0)
+    {
+        copies.push_back({ node->subtreeThread, node->subtreeFirst, node->subtreeCount, myOffset });
+        *offset += node->subtreeCount;
+    }
+    else
+    {
+        // Create interior flattened BVH node
+        LinearBVHNode *linearNode = &nodes[(*offset)++];
+        linearNode->bounds = node->bounds;
+        linearNode->axis = node->splitAxis;
+        linearNode->nPrimitives = 0;
+        FlattenBVHTree(node->children[0], nodes, offset, copies);
+        linearNode->offset = FlattenBVHTree(node->children[1], nodes, offset, copies);
+    }
+
+    return myOffset;
+}
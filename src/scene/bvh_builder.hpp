@@ -0,0 +1,68 @@
+#ifndef BVH_BUILDER_HPP
+#define BVH_BUILDER_HPP
+
+#include "mathlib/mathlib.hpp"
+#include "utils/shared_structs.hpp"
+#include "utils/memory_arena.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct BVHBuildNode;
+
+struct BVHPrimitiveInfo
+{
+    BVHPrimitiveInfo() {}
+    BVHPrimitiveInfo(unsigned int primitiveNumber, const Bounds3 &bounds)
+        : primitiveNumber(primitiveNumber), bounds(bounds),
+        centroid(bounds.min * 0.5f + bounds.max * 0.5f)
+    {}
+
+    unsigned int primitiveNumber;
+    Bounds3 bounds;
+    float3 centroid;
+
+};
+
+// Binned SAH builder, subtrees are built as tasks on the TaskScheduler and
+// the top levels bin and partition their primitive ranges in parallel.
+// Only the task levels use (arena allocated) pointer nodes, smaller subtrees
+// are written depth-first in LinearBVHNode layout right away.
+class BVHBuilder
+{
+public:
+    BVHBuilder(unsigned int maxPrimitivesInNode);
+
+    // Fills _nodes_ in depth-first order (first child follows its parent) and
+    // _primitiveIndices_ with the order in which leaves reference primitives
+    void Build(const std::vector<Bounds3>& primitiveBounds,
+        std::vector<LinearBVHNode>& nodes,
+        std::vector<unsigned int>& primitiveIndices);
+
+    static const unsigned int nBuckets = 12;
+
+private:
+    struct SubtreeCopy;
+
+    BVHBuildNode* RecursiveBuild(unsigned int start, unsigned int end);
+    unsigned int EmitSubtree(unsigned int start, unsigned int end, std::vector<LinearBVHNode>& nodes, unsigned int subtreeStart);
+
+    // Computes the bounds of the range and the split position, returns false if the range should become a leaf
+    bool FindSplit(unsigned int start, unsigned int end, Bounds3& bounds, unsigned int& dim, unsigned int& mid);
+    void ComputeBounds(unsigned int start, unsigned int end, Bounds3& bounds, Bounds3& centroidBounds) const;
+    unsigned int Partition(unsigned int start, unsigned int end, unsigned int dim, unsigned int splitBucket, const Bounds3& centroidBounds);
+
+    unsigned int FlattenBVHTree(BVHBuildNode* node, std::vector<LinearBVHNode>& nodes, unsigned int* offset, std::vector<SubtreeCopy>& copies) const;
+
+private:
+    unsigned int m_MaxPrimitivesInNode;
+    std::vector<BVHPrimitiveInfo> m_PrimitiveInfo;
+    std::vector<BVHPrimitiveInfo> m_PartitionScratch;
+    std::atomic<unsigned int> m_TotalNodes;
+    // Per thread storage, indexed by TaskScheduler::GetThreadIndex()
+    std::vector<std::unique_ptr<MemoryArena>> m_Arenas;
+    std::vector<std::vector<LinearBVHNode>> m_ThreadNodes;
+
+};
+
+#endif // BVH_BUILDER_HPP
@@ -0,0 +1,383 @@
+#include "environment.hpp"
+#include "mathlib/mathlib.hpp"
+#include "io/hdr_loader.hpp"
+#include "renderers/render.hpp"
+#include "utils/cl_exception.hpp"
+#include "utils/task_scheduler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+// Half precision RGB
+static const size_t TEXEL_SIZE = sizeof(unsigned short) * 3;
+// Rows per task of the downsampling and conversion loops
+static const size_t ROW_GRAIN = 16;
+// Largest finite half, brighter texels would turn into infinity
+static const float MAX_HALF = 65504.0f;
+// Larger levels would make the alias table bigger without finding the bright regions any better
+static const unsigned int MAX_SAMPLING_WIDTH = 1024;
+// Coarser levels would blur small bright lights like the sun over much of the sky, a 4x4 texel box
+// of the finest level keeps the prefiltered lookup close to the map
+static const unsigned int MAX_LOOKUP_LOD = 2;
+
+Environment::Environment(const std::string& filename, bool useCache, float budget)
+    : m_Filename(filename), m_Budget(std::max(budget, 0.0f)),
+    m_LevelData(nullptr), m_LevelCount(0), m_TexelData(nullptr), m_TexelCount(0), m_AliasData(nullptr), m_AliasCount(0), m_SamplingLevel(0), m_MaxLookupLevel(0)
+{
+    double startTime = render->GetCurtime();
+    std::string cacheFilename = m_Filename.substr(0, m_Filename.find_last_of('.')) + ".hdrcache";
+    uint64_t cacheKey = SceneCache::Hash(&m_Budget, sizeof(m_Budget), SceneCache::HashFileStamp(m_Filename));
+
+    if (useCache && LoadCache(cacheFilename, cacheKey))
+    {
+        std::cout << "Environment map mapped from " << cacheFilename << std::endl;
+    }
+    else
+    {
+        Build();
+
+        if (useCache)
+        {
+            std::vector<SceneCache::Section> sections = {
+                { SceneCacheSection_t::ENVIRONMENT_LEVELS, sizeof(EnvironmentLevel), m_LevelCount, m_LevelData },
+                { SceneCacheSection_t::ENVIRONMENT_TEXELS, static_cast<uint32_t>(TEXEL_SIZE), m_TexelCount, m_TexelData },
+                { SceneCacheSection_t::ENVIRONMENT_ALIASES, sizeof(EnvironmentAlias), m_AliasCount, m_AliasData },
+            };
+            if (SceneCache::Write(cacheFilename, cacheKey, sections))
+            {
+                std::cout << "Environment map cache written to " << cacheFilename << std::endl;
+            }
+            else
+            {
+                std::cerr << "Failed to write environment map cache " << cacheFilename << std::endl;
+            }
+        }
+    }
+
+    ReportPrefilterError();
+    std::cout << "Environment map loaded (" << m_LevelData[0].width << "x" << m_LevelData[0].height << ", " << m_LevelCount << " mip levels, "
+              << render->GetCurtime() - startTime << "s elapsed)" << std::endl;
+
+}
+
+void Environment::Build()
+{
+    Image image;
+    if (!HDRLoader::Load(m_Filename.c_str(), image))
+    {
+        throw std::runtime_error("Failed to load environment map " + m_Filename);
+    }
+
+    // Full chain down to a single texel
+    std::vector<EnvironmentLevel> levels;
+    EnvironmentLevel level = { 0, static_cast<unsigned int>(image.width), static_cast<unsigned int>(image.height), 0 };
+    size_t texelCount = 0;
+    while (true)
+    {
+        levels.push_back(level);
+        texelCount += size_t(level.width) * level.height;
+        if (level.width == 1 && level.height == 1)
+        {
+            break;
+        }
+        level.width = std::max(level.width / 2, 1u);
+        level.height = std::max(level.height / 2, 1u);
+    }
+
+    // The finest levels are the largest, dropping them first keeps as much of the chain as possible
+    size_t firstLevel = 0;
+    if (m_Budget > 0.0f)
+    {
+        size_t budgetTexels = static_cast<size_t>(m_Budget * 1024.0f * 1024.0f) / TEXEL_SIZE;
+        while (firstLevel + 1 < levels.size() && texelCount > budgetTexels)
+        {
+            texelCount -= size_t(levels[firstLevel].width) * levels[firstLevel].height;
+            ++firstLevel;
+        }
+    }
+
+    m_Levels.assign(levels.begin() + firstLevel, levels.end());
+    unsigned int offset = 0;
+    for (EnvironmentLevel& kept : m_Levels)
+    {
+        kept.offset = offset;
+        offset += kept.width * kept.height;
+    }
+    m_Texels.resize(texelCount * 3);
+    m_LevelData = m_Levels.data();
+    m_LevelCount = static_cast<unsigned int>(m_Levels.size());
+    m_TexelData = m_Texels.data();
+    m_TexelCount = texelCount;
+    FindLevels();
+    unsigned int samplingLevel = m_SamplingLevel;
+
+    // Box filtered in float RGBA, every level is converted once it is final
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    const float* current = image.colors;
+    std::vector<float> currentStorage, nextStorage;
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        const EnvironmentLevel& source = levels[i];
+        if (i >= firstLevel)
+        {
+            unsigned short* texels = &m_Texels[size_t(m_Levels[i - firstLevel].offset) * 3];
+            scheduler.ParallelFor(0, source.height, ROW_GRAIN, [&](size_t first, size_t last)
+            {
+                for (size_t j = first * source.width; j < last * source.width; ++j)
+                {
+                    for (unsigned int c = 0; c < 3; ++c)
+                    {
+                        texels[j * 3 + c] = FloatToHalf(std::min(current[j * 4 + c], MAX_HALF));
+                    }
+                }
+            });
+
+            if (i - firstLevel == samplingLevel)
+            {
+                BuildAliasTable(current, samplingLevel);
+            }
+        }
+
+        if (i + 1 == levels.size())
+        {
+            break;
+        }
+
+        const EnvironmentLevel& target = levels[i + 1];
+        nextStorage.resize(size_t(target.width) * target.height * 4);
+        float* next = nextStorage.data();
+        scheduler.ParallelFor(0, target.height, ROW_GRAIN, [&](size_t first, size_t last)
+        {
+            for (size_t y = first; y < last; ++y)
+            {
+                size_t y0 = std::min<size_t>(y * 2, source.height - 1);
+                size_t y1 = std::min<size_t>(y * 2 + 1, source.height - 1);
+                for (size_t x = 0; x < target.width; ++x)
+                {
+                    size_t x0 = std::min<size_t>(x * 2, source.width - 1);
+                    size_t x1 = std::min<size_t>(x * 2 + 1, source.width - 1);
+                    for (unsigned int c = 0; c < 4; ++c)
+                    {
+                        next[(y * target.width + x) * 4 + c] = 0.25f *
+                            (current[(y0 * source.width + x0) * 4 + c] + current[(y0 * source.width + x1) * 4 + c] +
+                             current[(y1 * source.width + x0) * 4 + c] + current[(y1 * source.width + x1) * 4 + c]);
+                    }
+                }
+            }
+        });
+        currentStorage.swap(nextStorage);
+        current = currentStorage.data();
+    }
+
+}
+
+void Environment::BuildAliasTable(const float* colors, unsigned int levelIndex)
+{
+    const EnvironmentLevel& level = m_Levels[levelIndex];
+    size_t count = size_t(level.width) * level.height;
+
+    // Luminance times the solid angle of the texel, rows of the equirectangular map shrink towards the poles
+    std::vector<double> weights(count);
+    double sum = 0.0;
+    for (unsigned int y = 0; y < level.height; ++y)
+    {
+        double sinTheta = std::sin(MATH_PI * (y + 0.5) / level.height);
+        for (unsigned int x = 0; x < level.width; ++x)
+        {
+            const float* color = &colors[(size_t(y) * level.width + x) * 4];
+            double luminance = 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+            double& weight = weights[size_t(y) * level.width + x];
+            weight = std::isfinite(luminance) ? std::max(luminance, 0.0) * sinTheta : 0.0;
+            sum += weight;
+        }
+    }
+    // A black map is sampled uniformly over the texels
+    if (sum <= 0.0)
+    {
+        std::fill(weights.begin(), weights.end(), 1.0);
+        sum = double(count);
+    }
+
+    // Vose's method, every underfull texel is topped up by exactly one overfull one
+    m_Aliases.resize(count);
+    std::vector<double> scaled(count);
+    std::vector<unsigned int> small, large;
+    for (size_t i = 0; i < count; ++i)
+    {
+        m_Aliases[i].pdf = static_cast<float>(weights[i] / sum);
+        scaled[i] = weights[i] * count / sum;
+        (scaled[i] < 1.0 ? small : large).push_back(static_cast<unsigned int>(i));
+    }
+    while (!small.empty() && !large.empty())
+    {
+        unsigned int less = small.back();
+        unsigned int more = large.back();
+        small.pop_back();
+        m_Aliases[less].threshold = static_cast<float>(scaled[less]);
+        m_Aliases[less].alias = more;
+        scaled[more] -= 1.0 - scaled[less];
+        if (scaled[more] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+    // Leftovers are full up to rounding
+    for (unsigned int i : small)
+    {
+        m_Aliases[i].threshold = 1.0f;
+        m_Aliases[i].alias = i;
+    }
+    for (unsigned int i : large)
+    {
+        m_Aliases[i].threshold = 1.0f;
+        m_Aliases[i].alias = i;
+    }
+
+    m_AliasData = m_Aliases.data();
+    m_AliasCount = count;
+}
+
+void Environment::FindLevels()
+{
+    m_SamplingLevel = 0;
+    while (m_SamplingLevel + 1 < m_LevelCount && m_LevelData[m_SamplingLevel].width > MAX_SAMPLING_WIDTH)
+    {
+        ++m_SamplingLevel;
+    }
+    // Coarser levels than the sampled one would spread radiance over directions light samples cannot pick
+    m_MaxLookupLevel = std::min(MAX_LOOKUP_LOD, m_SamplingLevel);
+}
+
+void Environment::CloseCache()
+{
+    m_Cache.Close();
+    m_LevelData = nullptr;
+    m_TexelData = nullptr;
+    m_AliasData = nullptr;
+}
+
+void Environment::ReportPrefilterError() const
+{
+    const EnvironmentLevel& finest = m_LevelData[0];
+    const EnvironmentLevel& coarsest = m_LevelData[m_MaxLookupLevel];
+    auto luminance = [this](const EnvironmentLevel& level, size_t x, size_t y)
+    {
+        const unsigned short* texel = &m_TexelData[(level.offset + y * level.width + x) * 3];
+        return 0.2126 * HalfToFloat(texel[0]) + 0.7152 * HalfToFloat(texel[1]) + 0.0722 * HalfToFloat(texel[2]);
+    };
+
+    // Solid angle weighted sums per row of the finest level, every texel against the coarse texel covering it
+    std::vector<double> errors(finest.height), sums(finest.height);
+    TaskScheduler::Get().ParallelFor(0, finest.height, ROW_GRAIN, [&](size_t first, size_t last)
+    {
+        for (size_t y = first; y < last; ++y)
+        {
+            double sinTheta = std::sin(MATH_PI * (y + 0.5) / finest.height);
+            size_t coarseY = std::min<size_t>(y * coarsest.height / finest.height, coarsest.height - 1);
+            double error = 0.0, sum = 0.0;
+            for (size_t x = 0; x < finest.width; ++x)
+            {
+                size_t coarseX = std::min<size_t>(x * coarsest.width / finest.width, coarsest.width - 1);
+                double value = luminance(finest, x, y);
+                error += std::abs(luminance(coarsest, coarseX, coarseY) - value);
+                sum += value;
+            }
+            errors[y] = error * sinTheta;
+            sums[y] = sum * sinTheta;
+        }
+    });
+
+    double error = 0.0, sum = 0.0;
+    for (size_t y = 0; y < finest.height; ++y)
+    {
+        error += errors[y];
+        sum += sums[y];
+    }
+    // The bias of a lookup lit by the whole map stays below this share of its result
+    std::cout << "Environment prefilter error at level " << m_MaxLookupLevel << ": "
+              << (sum > 0.0 ? 100.0 * error / sum : 0.0) << "% of the mean luminance" << std::endl;
+}
+
+bool Environment::LoadCache(const std::string& filename, uint64_t key)
+{
+    if (!m_Cache.Load(filename, key))
+    {
+        return false;
+    }
+
+    uint64_t levelCount, texelCount, aliasCount;
+    m_LevelData = m_Cache.GetSection<EnvironmentLevel>(SceneCacheSection_t::ENVIRONMENT_LEVELS, levelCount);
+    m_TexelData = static_cast<const unsigned short*>(m_Cache.GetSection(SceneCacheSection_t::ENVIRONMENT_TEXELS, static_cast<uint32_t>(TEXEL_SIZE), texelCount));
+    m_AliasData = m_Cache.GetSection<EnvironmentAlias>(SceneCacheSection_t::ENVIRONMENT_ALIASES, aliasCount);
+    m_LevelCount = static_cast<unsigned int>(levelCount);
+    bool valid = m_LevelData && m_TexelData && m_AliasData && levelCount > 0 &&
+        m_LevelData[levelCount - 1].offset + uint64_t(m_LevelData[levelCount - 1].width) * m_LevelData[levelCount - 1].height == texelCount;
+    if (valid)
+    {
+        FindLevels();
+        valid = uint64_t(m_LevelData[m_SamplingLevel].width) * m_LevelData[m_SamplingLevel].height == aliasCount;
+    }
+    if (!valid)
+    {
+        // Nothing of the rejected file may be used by the build that follows
+        CloseCache();
+        m_LevelCount = 0;
+        m_SamplingLevel = 0;
+        m_MaxLookupLevel = 0;
+        return false;
+    }
+
+    m_TexelCount = static_cast<size_t>(texelCount);
+    m_AliasCount = static_cast<size_t>(aliasCount);
+    return true;
+}
+
+std::string Environment::GetKernelOptions() const
+{
+    return "-D ENVIRONMENT_LEVELS=" + std::to_string(m_LevelCount) + " -D ENVIRONMENT_SAMPLING_LEVEL=" + std::to_string(m_SamplingLevel) +
+        " -D ENVIRONMENT_MAX_LOD=" + std::to_string(m_MaxLookupLevel);
+}
+
+void Environment::SetupBuffers()
+{
+    cl_int errCode;
+    // Same as for the scene, CPU devices read the mapped cache directly
+    bool useHostPtr = m_Cache.IsOpen() && render->GetOCLHelper()->IsCPUDevice();
+    cl_mem_flags flags = CL_MEM_READ_ONLY | (useHostPtr ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR);
+
+    m_TexelBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_TexelCount * TEXEL_SIZE, const_cast<unsigned short*>(m_TexelData), &errCode);
+    std::cout << "EnvironmentBuffer size: " << float(m_TexelCount * TEXEL_SIZE) / (1024.0f * 1024.0f) << " MiB (" << m_LevelCount << " mip levels)" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create environment buffer", errCode);
+    }
+
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_ENVIRONMENT, &m_TexelBuffer, sizeof(cl::Buffer));
+
+    m_LevelBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_LevelCount * sizeof(EnvironmentLevel), const_cast<EnvironmentLevel*>(m_LevelData), &errCode);
+    if (errCode)
+    {
+        throw CLException("Failed to create environment level buffer", errCode);
+    }
+
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_ENVIRONMENT_LEVELS, &m_LevelBuffer, sizeof(cl::Buffer));
+
+    m_AliasBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_AliasCount * sizeof(EnvironmentAlias), const_cast<EnvironmentAlias*>(m_AliasData), &errCode);
+    std::cout << "EnvironmentAliasBuffer size: " << float(m_AliasCount * sizeof(EnvironmentAlias)) / (1024.0f * 1024.0f) << " MiB (level "
+              << m_SamplingLevel << ")" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create environment alias buffer", errCode);
+    }
+
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_ENVIRONMENT_ALIASES, &m_AliasBuffer, sizeof(cl::Buffer));
+
+    // Data built in memory stays, a mapped cache is not needed once the buffers hold copies
+    if (!useHostPtr && m_Cache.IsOpen())
+    {
+        CloseCache();
+    }
+
+}
@@ -0,0 +1,64 @@
+#ifndef ENVIRONMENT_HPP
+#define ENVIRONMENT_HPP
+
+#include "utils/shared_structs.hpp"
+#include "io/scene_cache.hpp"
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+
+// Environment map as a mip chain of half precision RGB texels, 6 bytes per
+// texel instead of the 16 of an RGBA float image. The render kernel filters
+// it bilinearly and picks coarser levels for rough and diffuse bounces, down
+// to MAX_LOOKUP_LOD levels below the finest one or the sampled level.
+// An alias table over one level lets the kernel sample the map as a light,
+// proportional to luminance times texel solid angle.
+class Environment
+{
+public:
+    // _budget_ in MiB limits the mip chain, the finest levels are dropped until it fits, 0 keeps every level.
+    // _useCache_ maps the chain from a .hdrcache file next to the map if it matches the map's size and
+    // modification time, or writes it there after the build.
+    Environment(const std::string& filename, bool useCache = false, float budget = 0.0f);
+    void SetupBuffers();
+
+    // Defines the render kernel needs for the level count and the sampled level
+    std::string GetKernelOptions() const;
+
+private:
+    void Build();
+    // _colors_ are the RGBA floats of the kept level _levelIndex_
+    void BuildAliasTable(const float* colors, unsigned int levelIndex);
+    bool LoadCache(const std::string& filename, uint64_t key);
+    // Picks the sampling and lookup levels from the level data, they stay valid after the data is released
+    void FindLevels();
+    // Unmaps the cache and clears the data pointers into it
+    void CloseCache();
+    // Logs how far the coarsest lookup level deviates from level 0, which bounds the bias of the prefiltering
+    void ReportPrefilterError() const;
+
+private:
+    std::string m_Filename;
+    float m_Budget;
+    std::vector<EnvironmentLevel> m_Levels;
+    std::vector<unsigned short> m_Texels;
+    std::vector<EnvironmentAlias> m_Aliases;
+    SceneCache m_Cache;
+    // Point into the vectors above or into the mapped cache
+    const EnvironmentLevel* m_LevelData;
+    unsigned int m_LevelCount;
+    const unsigned short* m_TexelData;
+    size_t m_TexelCount;
+    const EnvironmentAlias* m_AliasData;
+    size_t m_AliasCount;
+    // Light samples are drawn from the finest level that is at most MAX_SAMPLING_WIDTH texels wide
+    unsigned int m_SamplingLevel;
+    // Coarsest level the kernel looks the map up at
+    unsigned int m_MaxLookupLevel;
+    cl::Buffer m_TexelBuffer;
+    cl::Buffer m_LevelBuffer;
+    cl::Buffer m_AliasBuffer;
+
+};
+
+#endif // ENVIRONMENT_HPP
@@ -0,0 +1,532 @@
+#include "sbvh_builder.hpp"
+#include "utils/task_scheduler.hpp"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+// Reference lists of at least this size build their first child as a separate task
+static const unsigned int TASK_REFERENCE_THRESHOLD = 4 * 1024;
+// Deeper nodes only use object splits, clipping slivers below this depth gains nothing
+static const unsigned int MAX_SPATIAL_SPLIT_DEPTH = 48;
+// Overlap of the object split children relative to the root area that enables spatial splits
+static const float SPATIAL_SPLIT_ALPHA = 1e-5f;
+
+struct SBVHBuildNode
+{
+    Bounds3 bounds;
+    SBVHBuildNode *children[2];
+    unsigned int splitAxis;
+    unsigned int thread, firstPrimitive, nPrimitives;
+
+};
+
+struct SBVHBuilder::ObjectSplit
+{
+    float cost = std::numeric_limits<float>::max();
+    unsigned int dim = 0;
+    unsigned int bin = 0;
+    float binMin = 0.0f;
+    float binScale = 0.0f;
+    Bounds3 leftBounds;
+    Bounds3 rightBounds;
+
+};
+
+struct SBVHBuilder::SpatialSplit
+{
+    float cost = std::numeric_limits<float>::max();
+    unsigned int dim = 0;
+    float position = 0.0f;
+
+};
+
+struct SBVHBin
+{
+    Bounds3 bounds;
+    unsigned int count = 0;
+    unsigned int exit = 0;
+
+};
+
+static Bounds3 Intersection(const Bounds3& b1, const Bounds3& b2)
+{
+    Bounds3 ret;
+    ret.min = Max(b1.min, b2.min);
+    ret.max = Min(b1.max, b2.max);
+    return ret;
+}
+
+static bool IsEmpty(const Bounds3& b)
+{
+    return b.min.x > b.max.x || b.min.y > b.max.y || b.min.z > b.max.z;
+}
+
+static float Area(const Bounds3& b)
+{
+    return IsEmpty(b) ? 0.0f : b.SurfaceArea();
+}
+
+static unsigned int ObjectBin(const SBVHReference& reference, unsigned int dim, float binMin, float binScale)
+{
+    float centroid = (reference.bounds.min[dim] + reference.bounds.max[dim]) * 0.5f;
+    int b = static_cast<int>((centroid - binMin) * binScale);
+    return static_cast<unsigned int>(clamp(b, 0, static_cast<int>(SBVHBuilder::nObjectBins) - 1));
+}
+
+SBVHBuilder::SBVHBuilder(unsigned int maxPrimitivesInNode, float splitBudget)
+    : m_MaxPrimitivesInNode(maxPrimitivesInNode), m_SplitBudget(std::max(splitBudget, 0.0f)), m_Positions(nullptr), m_Triangles(nullptr),
+    m_MinOverlap(0.0f), m_MaxReferences(0), m_References(0), m_TotalNodes(0), m_SpatialSplits(0)
+{
+}
+
+void SBVHBuilder::Build(const std::vector<float3>& positions,
+    const std::vector<TriangleAttributes>& triangles,
+    std::vector<LinearBVHNode>& nodes,
+    std::vector<unsigned int>& primitiveIndices)
+{
+    TaskScheduler& scheduler = TaskScheduler::Get();
+    unsigned int nPrimitives = static_cast<unsigned int>(triangles.size());
+    assert(nPrimitives > 0);
+
+    m_Positions = &positions;
+    m_Triangles = &triangles;
+    std::vector<SBVHReference> references(nPrimitives);
+    Bounds3 rootBounds;
+    for (unsigned int i = 0; i < nPrimitives; ++i)
+    {
+        const TriangleAttributes& triangle = triangles[i];
+        references[i].primitiveNumber = i;
+        references[i].bounds = Union(Bounds3(positions[triangle.vertices[0]], positions[triangle.vertices[1]]), positions[triangle.vertices[2]]);
+        rootBounds = Union(rootBounds, references[i].bounds);
+    }
+
+    m_MinOverlap = rootBounds.SurfaceArea() * SPATIAL_SPLIT_ALPHA;
+    m_MaxReferences = nPrimitives + static_cast<size_t>(nPrimitives * m_SplitBudget);
+    m_References = nPrimitives;
+    m_TotalNodes = 0;
+    m_SpatialSplits = 0;
+    m_Arenas.clear();
+    m_ThreadPrimitives.assign(scheduler.GetThreadCount(), std::vector<unsigned int>());
+    for (unsigned int i = 0; i < scheduler.GetThreadCount(); ++i)
+    {
+        m_Arenas.emplace_back(new MemoryArena);
+    }
+
+    SBVHBuildNode* root = RecursiveBuild(references, 0);
+
+    nodes.clear();
+    nodes.reserve(m_TotalNodes);
+    primitiveIndices.clear();
+    primitiveIndices.reserve(m_References);
+    FlattenBVHTree(root, nodes, primitiveIndices);
+    assert(nodes.size() == m_TotalNodes);
+
+    // Release the build nodes
+    m_Arenas.clear();
+    std::vector<std::vector<unsigned int>>().swap(m_ThreadPrimitives);
+    m_Positions = nullptr;
+    m_Triangles = nullptr;
+
+}
+
+SBVHBuildNode* SBVHBuilder::CreateLeaf(const std::vector<SBVHReference>& references, const Bounds3& bounds)
+{
+    unsigned int thread = TaskScheduler::GetThreadIndex();
+    std::vector<unsigned int>& threadPrimitives = m_ThreadPrimitives[thread];
+
+    SBVHBuildNode* node = m_Arenas[thread]->Alloc<SBVHBuildNode>();
+    node->bounds = bounds;
+    node->children[0] = node->children[1] = nullptr;
+    node->thread = thread;
+    node->firstPrimitive = static_cast<unsigned int>(threadPrimitives.size());
+    node->nPrimitives = static_cast<unsigned int>(references.size());
+    for (const SBVHReference& reference : references)
+    {
+        threadPrimitives.push_back(reference.primitiveNumber);
+    }
+    m_TotalNodes++;
+
+    return node;
+}
+
+SBVHBuildNode* SBVHBuilder::RecursiveBuild(std::vector<SBVHReference>& references, unsigned int depth)
+{
+    assert(!references.empty());
+
+    Bounds3 bounds;
+    for (const SBVHReference& reference : references)
+    {
+        bounds = Union(bounds, reference.bounds);
+    }
+
+    unsigned int nReferences = static_cast<unsigned int>(references.size());
+    if (nReferences == 1)
+    {
+        return CreateLeaf(references, bounds);
+    }
+
+    // Costs are SAH values multiplied by the node area, a traversal step costs as much as a triangle test
+    ObjectSplit objectSplit;
+    FindObjectSplit(references, bounds, objectSplit);
+
+    SpatialSplit spatialSplit;
+    if (depth < MAX_SPATIAL_SPLIT_DEPTH && m_References < m_MaxReferences &&
+        Area(Intersection(objectSplit.leftBounds, objectSplit.rightBounds)) > m_MinOverlap)
+    {
+        FindSpatialSplit(references, bounds, spatialSplit);
+    }
+
+    float leafCost = nReferences * bounds.SurfaceArea();
+    float minCost = std::min(objectSplit.cost, spatialSplit.cost);
+    if (nReferences <= m_MaxPrimitivesInNode && leafCost <= minCost)
+    {
+        return CreateLeaf(references, bounds);
+    }
+
+    std::vector<SBVHReference> left, right;
+    unsigned int dim = objectSplit.dim;
+    if (spatialSplit.cost < objectSplit.cost)
+    {
+        PerformSpatialSplit(references, spatialSplit, left, right);
+        dim = spatialSplit.dim;
+        m_SpatialSplits++;
+    }
+    else if (objectSplit.cost < std::numeric_limits<float>::max())
+    {
+        PerformObjectSplit(references, objectSplit, left, right);
+    }
+
+    if (left.empty() || right.empty())
+    {
+        // All centroids coincide, split the list in half
+        if (nReferences <= m_MaxPrimitivesInNode)
+        {
+            return CreateLeaf(references, bounds);
+        }
+        left.assign(references.begin(), references.begin() + nReferences / 2);
+        right.assign(references.begin() + nReferences / 2, references.end());
+        dim = bounds.MaximumExtent();
+    }
+    std::vector<SBVHReference>().swap(references);
+
+    unsigned int thread = TaskScheduler::GetThreadIndex();
+    SBVHBuildNode* node = m_Arenas[thread]->Alloc<SBVHBuildNode>();
+    node->bounds = bounds;
+    node->splitAxis = dim;
+    node->nPrimitives = 0;
+    m_TotalNodes++;
+
+    if (left.size() >= TASK_REFERENCE_THRESHOLD)
+    {
+        TaskScheduler& scheduler = TaskScheduler::Get();
+        TaskGroup group;
+        scheduler.Spawn(group, [this, node, &left, depth]() { node->children[0] = RecursiveBuild(left, depth + 1); });
+        node->children[1] = RecursiveBuild(right, depth + 1);
+        scheduler.Wait(group);
+    }
+    else
+    {
+        node->children[0] = RecursiveBuild(left, depth + 1);
+        node->children[1] = RecursiveBuild(right, depth + 1);
+    }
+
+    return node;
+}
+
+void SBVHBuilder::FindObjectSplit(std::vector<SBVHReference>& references, const Bounds3& bounds, ObjectSplit& split) const
+{
+    Bounds3 centroidBounds;
+    for (const SBVHReference& reference : references)
+    {
+        centroidBounds = Union(centroidBounds, (reference.bounds.min + reference.bounds.max) * 0.5f);
+    }
+
+    for (unsigned int dim = 0; dim < 3; ++dim)
+    {
+        float extent = centroidBounds.max[dim] - centroidBounds.min[dim];
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+
+        float binMin = centroidBounds.min[dim];
+        float binScale = nObjectBins / extent;
+        SBVHBin bins[nObjectBins];
+        for (const SBVHReference& reference : references)
+        {
+            SBVHBin& bin = bins[ObjectBin(reference, dim, binMin, binScale)];
+            bin.count++;
+            bin.bounds = Union(bin.bounds, reference.bounds);
+        }
+
+        // Suffix sweep for the right side, prefix sweep evaluates the splits
+        Bounds3 rightBounds[nObjectBins - 1];
+        unsigned int rightCount[nObjectBins - 1];
+        Bounds3 b1;
+        unsigned int count1 = 0;
+        for (unsigned int i = nObjectBins - 1; i > 0; --i)
+        {
+            b1 = Union(b1, bins[i].bounds);
+            count1 += bins[i].count;
+            rightBounds[i - 1] = b1;
+            rightCount[i - 1] = count1;
+        }
+
+        Bounds3 b0;
+        unsigned int count0 = 0;
+        for (unsigned int i = 0; i < nObjectBins - 1; ++i)
+        {
+            b0 = Union(b0, bins[i].bounds);
+            count0 += bins[i].count;
+            if (count0 == 0 || rightCount[i] == 0)
+            {
+                continue;
+            }
+
+            float cost = bounds.SurfaceArea() + count0 * b0.SurfaceArea() + rightCount[i] * rightBounds[i].SurfaceArea();
+            if (cost < split.cost)
+            {
+                split.cost = cost;
+                split.dim = dim;
+                split.bin = i;
+                split.binMin = binMin;
+                split.binScale = binScale;
+                split.leftBounds = b0;
+                split.rightBounds = rightBounds[i];
+            }
+        }
+    }
+
+}
+
+void SBVHBuilder::FindSpatialSplit(const std::vector<SBVHReference>& references, const Bounds3& bounds, SpatialSplit& split) const
+{
+    unsigned int nReferences = static_cast<unsigned int>(references.size());
+    size_t currentReferences = m_References;
+
+    for (unsigned int dim = 0; dim < 3; ++dim)
+    {
+        float extent = bounds.max[dim] - bounds.min[dim];
+        if (extent <= 0.0f)
+        {
+            continue;
+        }
+
+        // Clip every reference into the bins it overlaps, count where it starts and ends
+        float binWidth = extent / nSpatialBins;
+        float invBinWidth = 1.0f / binWidth;
+        SBVHBin bins[nSpatialBins];
+        for (const SBVHReference& reference : references)
+        {
+            int first = clamp(static_cast<int>((reference.bounds.min[dim] - bounds.min[dim]) * invBinWidth), 0, static_cast<int>(nSpatialBins) - 1);
+            int last = clamp(static_cast<int>((reference.bounds.max[dim] - bounds.min[dim]) * invBinWidth), first, static_cast<int>(nSpatialBins) - 1);
+
+            SBVHReference current = reference;
+            for (int i = first; i < last; ++i)
+            {
+                SBVHReference leftPart, rightPart;
+                SplitReference(current, dim, bounds.min[dim] + (i + 1) * binWidth, leftPart, rightPart);
+                bins[i].bounds = Union(bins[i].bounds, leftPart.bounds);
+                current = rightPart;
+            }
+            bins[last].bounds = Union(bins[last].bounds, current.bounds);
+            bins[first].count++;
+            bins[last].exit++;
+        }
+
+        Bounds3 rightBounds[nSpatialBins - 1];
+        unsigned int rightCount[nSpatialBins - 1];
+        Bounds3 b1;
+        unsigned int count1 = 0;
+        for (unsigned int i = nSpatialBins - 1; i > 0; --i)
+        {
+            b1 = Union(b1, bins[i].bounds);
+            count1 += bins[i].exit;
+            rightBounds[i - 1] = b1;
+            rightCount[i - 1] = count1;
+        }
+
+        Bounds3 b0;
+        unsigned int count0 = 0;
+        for (unsigned int i = 0; i < nSpatialBins - 1; ++i)
+        {
+            b0 = Union(b0, bins[i].bounds);
+            count0 += bins[i].count;
+
+            // Splits that duplicate everything make no progress, others must fit into the budget
+            unsigned int duplicates = count0 + rightCount[i] - nReferences;
+            if (count0 == 0 || rightCount[i] == 0 || count0 == nReferences || rightCount[i] == nReferences ||
+                currentReferences + duplicates > m_MaxReferences)
+            {
+                continue;
+            }
+
+            float cost = bounds.SurfaceArea() + count0 * Area(b0) + rightCount[i] * Area(rightBounds[i]);
+            if (cost < split.cost)
+            {
+                split.cost = cost;
+                split.dim = dim;
+                split.position = bounds.min[dim] + (i + 1) * binWidth;
+            }
+        }
+    }
+
+}
+
+void SBVHBuilder::PerformObjectSplit(std::vector<SBVHReference>& references, const ObjectSplit& split,
+    std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const
+{
+    for (const SBVHReference& reference : references)
+    {
+        if (ObjectBin(reference, split.dim, split.binMin, split.binScale) <= split.bin)
+        {
+            left.push_back(reference);
+        }
+        else
+        {
+            right.push_back(reference);
+        }
+    }
+}
+
+void SBVHBuilder::PerformSpatialSplit(std::vector<SBVHReference>& references, const SpatialSplit& split,
+    std::vector<SBVHReference>& left, std::vector<SBVHReference>& right)
+{
+    unsigned int dim = split.dim;
+    Bounds3 leftBounds, rightBounds;
+    std::vector<SBVHReference> straddling;
+    for (const SBVHReference& reference : references)
+    {
+        if (reference.bounds.max[dim] <= split.position)
+        {
+            left.push_back(reference);
+            leftBounds = Union(leftBounds, reference.bounds);
+        }
+        else if (reference.bounds.min[dim] >= split.position)
+        {
+            right.push_back(reference);
+            rightBounds = Union(rightBounds, reference.bounds);
+        }
+        else
+        {
+            straddling.push_back(reference);
+        }
+    }
+
+    // Reference unsplitting: keep a straddling reference on one side if that is cheaper than duplicating it
+    for (const SBVHReference& reference : straddling)
+    {
+        SBVHReference leftPart, rightPart;
+        SplitReference(reference, dim, split.position, leftPart, rightPart);
+
+        float leftCount = static_cast<float>(left.size());
+        float rightCount = static_cast<float>(right.size());
+        Bounds3 leftUnsplit = Union(leftBounds, reference.bounds);
+        Bounds3 rightUnsplit = Union(rightBounds, reference.bounds);
+        Bounds3 leftDuplicate = Union(leftBounds, leftPart.bounds);
+        Bounds3 rightDuplicate = Union(rightBounds, rightPart.bounds);
+
+        float unsplitLeftCost = Area(leftUnsplit) * (leftCount + 1) + Area(rightBounds) * rightCount;
+        float unsplitRightCost = Area(leftBounds) * leftCount + Area(rightUnsplit) * (rightCount + 1);
+        float duplicateCost = Area(leftDuplicate) * (leftCount + 1) + Area(rightDuplicate) * (rightCount + 1);
+
+        // Take a slot of the budget, concurrent builds of other subtrees may have used it up
+        bool duplicate = !IsEmpty(leftPart.bounds) && !IsEmpty(rightPart.bounds) &&
+            duplicateCost < std::min(unsplitLeftCost, unsplitRightCost);
+        if (duplicate)
+        {
+            size_t current = m_References;
+            duplicate = current < m_MaxReferences && m_References.compare_exchange_strong(current, current + 1);
+        }
+
+        if (duplicate)
+        {
+            left.push_back(leftPart);
+            right.push_back(rightPart);
+            leftBounds = leftDuplicate;
+            rightBounds = rightDuplicate;
+        }
+        else if (unsplitLeftCost <= unsplitRightCost)
+        {
+            left.push_back(reference);
+            leftBounds = leftUnsplit;
+        }
+        else
+        {
+            right.push_back(reference);
+            rightBounds = rightUnsplit;
+        }
+    }
+
+}
+
+void SBVHBuilder::SplitReference(const SBVHReference& reference, unsigned int dim, float position,
+    SBVHReference& left, SBVHReference& right) const
+{
+    const TriangleAttributes& triangle = (*m_Triangles)[reference.primitiveNumber];
+    const std::vector<float3>& positions = *m_Positions;
+    const float3 vertices[3] = { positions[triangle.vertices[0]], positions[triangle.vertices[1]], positions[triangle.vertices[2]] };
+
+    left.primitiveNumber = right.primitiveNumber = reference.primitiveNumber;
+    left.bounds = right.bounds = Bounds3();
+
+    // Vertices go to their side, edges crossing the plane add the intersection to both
+    for (unsigned int i = 0; i < 3; ++i)
+    {
+        const float3& v0 = vertices[i];
+        const float3& v1 = vertices[(i + 1) % 3];
+        float p0 = v0[dim];
+        float p1 = v1[dim];
+
+        if (p0 <= position)
+        {
+            left.bounds = Union(left.bounds, v0);
+        }
+        if (p0 >= position)
+        {
+            right.bounds = Union(right.bounds, v0);
+        }
+        if ((p0 < position && p1 > position) || (p0 > position && p1 < position))
+        {
+            float t = clamp((position - p0) / (p1 - p0), 0.0f, 1.0f);
+            float3 p = v0 + (v1 - v0) * t;
+            p[dim] = position;
+            left.bounds = Union(left.bounds, p);
+            right.bounds = Union(right.bounds, p);
+        }
+    }
+
+    // The reference may already be clipped by an earlier split
+    left.bounds.max[dim] = std::min(left.bounds.max[dim], position);
+    right.bounds.min[dim] = std::max(right.bounds.min[dim], position);
+    left.bounds = Intersection(left.bounds, reference.bounds);
+    right.bounds = Intersection(right.bounds, reference.bounds);
+
+}
+
+unsigned int SBVHBuilder::FlattenBVHTree(SBVHBuildNode* node, std::vector<LinearBVHNode>& nodes, std::vector<unsigned int>& primitiveIndices) const
+{
+    unsigned int myOffset = static_cast<unsigned int>(nodes.size());
+    nodes.emplace_back();
+    nodes[myOffset].bounds = node->bounds;
+
+    if (node->nPrimitives > 0)
+    {
+        assert(node->nPrimitives < 65536);
+        const std::vector<unsigned int>& threadPrimitives = m_ThreadPrimitives[node->thread];
+        nodes[myOffset].offset = static_cast<unsigned int>(primitiveIndices.size());
+        nodes[myOffset].nPrimitives = node->nPrimitives;
+        primitiveIndices.insert(primitiveIndices.end(), threadPrimitives.begin() + node->firstPrimitive,
+            threadPrimitives.begin() + node->firstPrimitive + node->nPrimitives);
+    }
+    else
+    {
+        nodes[myOffset].axis = node->splitAxis;
+        nodes[myOffset].nPrimitives = 0;
+        FlattenBVHTree(node->children[0], nodes, primitiveIndices);
+        unsigned int secondChild = FlattenBVHTree(node->children[1], nodes, primitiveIndices);
+        nodes[myOffset].offset = secondChild;
+    }
+
+    return myOffset;
+}
@@ -0,0 +1,78 @@
+#ifndef SBVH_BUILDER_HPP
+#define SBVH_BUILDER_HPP
+
+#include "mathlib/mathlib.hpp"
+#include "utils/shared_structs.hpp"
+#include "utils/memory_arena.hpp"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct SBVHBuildNode;
+
+// Part of a triangle assigned to a node, spatial splits clip the bounds and
+// duplicate the reference into both children
+struct SBVHReference
+{
+    unsigned int primitiveNumber;
+    Bounds3 bounds;
+
+};
+
+// Split BVH builder (Stich et al. 2009): every node evaluates binned object
+// splits and, where the children would overlap, spatial splits that clip the
+// straddling triangles. The number of references may grow by at most
+// _splitBudget_ times the number of triangles.
+class SBVHBuilder
+{
+public:
+    SBVHBuilder(unsigned int maxPrimitivesInNode, float splitBudget);
+
+    // Same output as BVHBuilder::Build, except that _primitiveIndices_ may
+    // reference a triangle more than once. _triangles_ index _positions_.
+    void Build(const std::vector<float3>& positions,
+        const std::vector<TriangleAttributes>& triangles,
+        std::vector<LinearBVHNode>& nodes,
+        std::vector<unsigned int>& primitiveIndices);
+
+    unsigned int GetSpatialSplitCount() const { return m_SpatialSplits; }
+
+    static const unsigned int nObjectBins = 16;
+    static const unsigned int nSpatialBins = 32;
+
+private:
+    struct ObjectSplit;
+    struct SpatialSplit;
+
+    SBVHBuildNode* RecursiveBuild(std::vector<SBVHReference>& references, unsigned int depth);
+    SBVHBuildNode* CreateLeaf(const std::vector<SBVHReference>& references, const Bounds3& bounds);
+
+    void FindObjectSplit(std::vector<SBVHReference>& references, const Bounds3& bounds, ObjectSplit& split) const;
+    void FindSpatialSplit(const std::vector<SBVHReference>& references, const Bounds3& bounds, SpatialSplit& split) const;
+    void PerformObjectSplit(std::vector<SBVHReference>& references, const ObjectSplit& split,
+        std::vector<SBVHReference>& left, std::vector<SBVHReference>& right) const;
+    void PerformSpatialSplit(std::vector<SBVHReference>& references, const SpatialSplit& split,
+        std::vector<SBVHReference>& left, std::vector<SBVHReference>& right);
+    void SplitReference(const SBVHReference& reference, unsigned int dim, float position,
+        SBVHReference& left, SBVHReference& right) const;
+
+    unsigned int FlattenBVHTree(SBVHBuildNode* node, std::vector<LinearBVHNode>& nodes, std::vector<unsigned int>& primitiveIndices) const;
+
+private:
+    unsigned int m_MaxPrimitivesInNode;
+    float m_SplitBudget;
+    const std::vector<float3>* m_Positions;
+    const std::vector<TriangleAttributes>* m_Triangles;
+    // Spatial splits are only tried if the children overlap by at least this area
+    float m_MinOverlap;
+    size_t m_MaxReferences;
+    std::atomic<size_t> m_References;
+    std::atomic<unsigned int> m_TotalNodes;
+    std::atomic<unsigned int> m_SpatialSplits;
+    // Per thread storage, indexed by TaskScheduler::GetThreadIndex()
+    std::vector<std::unique_ptr<MemoryArena>> m_Arenas;
+    std::vector<std::vector<unsigned int>> m_ThreadPrimitives;
+
+};
+
+#endif // SBVH_BUILDER_HPP
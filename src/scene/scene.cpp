@@ -1,100 +1,126 @@
 #include "scene.hpp"
+#include "bvh_builder.hpp"
+#include "sbvh_builder.hpp"
+#include "wide_bvh_builder.hpp"
+#include "io/obj_loader.hpp"
 #include "mathlib/mathlib.hpp"
 #include "renderers/render.hpp"
 #include "utils/cl_exception.hpp"
+#include "utils/memory_usage.hpp"
+#include "utils/task_scheduler.hpp"
 #include <algorithm>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 
-Scene::Scene(const char* filename)
+Scene::Scene(const char* filename, bool compressVertices)
+    : m_Filename(filename), m_CompressVertices(compressVertices)
 {
-    LoadTriangles(filename);
-
 }
 
-void Scene::LoadTriangles(const char* filename)
+void Scene::Load()
 {
-    char mtlname[80];
-    memset(mtlname, 0, 80);
-    strncpy(mtlname, filename, strlen(filename) - 4);
-    strcat(mtlname, ".mtl");
-
-    LoadMaterials(mtlname);
+    LoadTriangles(m_Filename.c_str());
 
-    std::vector<float3> positions;
-    std::vector<float3> normals;
-    std::vector<float2> texcoords;
+}
 
-    std::cout << "Loading object file " << filename << std::endl;
+std::string Scene::GetKernelOptions() const
+{
+    return m_CompressVertices ? "-D COMPRESSED_VERTICES" : "";
+}
 
-    double startTime = render->GetCurtime();
+std::string Scene::GetMaterialFilename() const
+{
+    return m_Filename.substr(0, m_Filename.size() - 4) + ".mtl";
+}
 
-    FILE* file = fopen(filename, "r");
-    if (!file)
-    {
-        throw std::runtime_error("Failed to open scene file!");
-    }
-    
-    unsigned int materialIndex = -1;
+Bounds3 Scene::GetTriangleBounds(unsigned int index) const
+{
+    const TriangleAttributes& triangle = m_Triangles[index];
+    return Union(Bounds3(m_Positions[triangle.vertices[0]], m_Positions[triangle.vertices[1]]), m_Positions[triangle.vertices[2]]);
+}
 
-    while (true)
+void Scene::BuildTriangleGeometry(std::vector<TriangleGeometry>& geometry) const
+{
+    geometry.resize(m_Triangles.size());
+    TaskScheduler::Get().ParallelFor(0, m_Triangles.size(), 4096, [&](size_t begin, size_t end)
     {
-        char lineHeader[128];
-        int res = fscanf(file, "%s", lineHeader);
-        if (res == EOF)
+        for (size_t i = begin; i < end; ++i)
         {
-            break;
+            const TriangleAttributes& triangle = m_Triangles[i];
+            geometry[i] = TriangleGeometry(m_Positions[triangle.vertices[0]], m_Positions[triangle.vertices[1]], m_Positions[triangle.vertices[2]]);
         }
-        if (strcmp(lineHeader, "v") == 0)
-        {
-            float3 vertex;
-            fscanf(file, "%f %f %f\n", &vertex.x, &vertex.y, &vertex.z);
-            positions.push_back(vertex);
-        }
-        else if (strcmp(lineHeader, "vt") == 0)
-        {
-            float2 uv;
-            fscanf(file, "%f %f\n", &uv.x, &uv.y);
-            texcoords.push_back(uv);
-        }
-        else if (strcmp(lineHeader, "vn") == 0)
-        {
-            float3 normal;
-            fscanf(file, "%f %f %f\n", &normal.x, &normal.y, &normal.z);
-            normals.push_back(normal);
-        }
-        else if (strcmp(lineHeader, "usemtl") == 0)
+    });
+
+}
+
+const void* Scene::GetVertexData() const
+{
+    return m_CompressVertices ? static_cast<const void*>(m_CompressedVertices.data()) : static_cast<const void*>(m_Vertices.data());
+}
+
+size_t Scene::GetVertexCount() const
+{
+    return m_CompressVertices ? m_CompressedVertices.size() : m_Vertices.size();
+}
+
+size_t Scene::GetVertexSize() const
+{
+    return m_CompressVertices ? sizeof(CompressedVertexAttributes) : sizeof(VertexAttributes);
+}
+
+void Scene::LoadTriangles(const char* filename)
+{
+    LoadMaterials(GetMaterialFilename().c_str());
+
+    std::cout << "Loading object file " << filename << std::endl;
+
+    double startTime = render->GetCurtime();
+    ObjMesh mesh;
+    size_t fileSize = ObjLoader::Load(filename, m_MaterialIndices, mesh);
+    double parseTime = render->GetCurtime() - startTime;
+
+    // Weld corners in file order, the vertex order does not depend on the parse
+    size_t nTriangles = mesh.materials.size();
+    std::unordered_map<ObjCorner, unsigned int, ObjCornerHash> vertexIndices;
+    vertexIndices.reserve(std::min(mesh.corners.size(), mesh.positions.size() * 2));
+    m_Triangles.resize(nTriangles);
+    for (size_t i = 0; i < nTriangles; ++i)
+    {
+        TriangleAttributes& triangle = m_Triangles[i];
+        for (unsigned int j = 0; j < 3; ++j)
         {
-            char str[80];
-            fscanf(file, "%s\n", str);
-            for (unsigned int i = 0; i < m_MaterialNames.size(); ++i)
+            const ObjCorner& corner = mesh.corners[i * 3 + j];
+            auto inserted = vertexIndices.emplace(corner, static_cast<unsigned int>(m_Vertices.size()));
+            if (inserted.second)
             {
-                if (strcmp(str, m_MaterialNames[i].c_str()) == 0)
-                {
-                    materialIndex = i;
-                    break;
-                }
+                m_Positions.push_back(mesh.positions[corner.position]);
+                m_Vertices.push_back(VertexAttributes(mesh.normals[corner.normal], mesh.texcoords[corner.texcoord]));
             }
-
+            triangle.vertices[j] = inserted.first->second;
         }
-        else if (strcmp(lineHeader, "f") == 0)
+        triangle.mtlIndex = mesh.materials[i];
+    }
+
+    // Octahedral normals and half precision texcoords, the full precision vertices are not kept
+    if (m_CompressVertices)
+    {
+        m_CompressedVertices.resize(m_Vertices.size());
+        TaskScheduler::Get().ParallelFor(0, m_Vertices.size(), 4096, [this](size_t begin, size_t end)
         {
-            unsigned int iv[3], it[3], in[3];
-            int count = fscanf(file, "%d/%d/%d %d/%d/%d %d/%d/%d\n", &iv[0], &it[0], &in[0], &iv[1], &it[1], &in[1], &iv[2], &it[2], &in[2]);
-            if (count != 9)
+            for (size_t i = begin; i < end; ++i)
             {
-                throw std::runtime_error("Failed to load face!");
+                m_CompressedVertices[i] = CompressedVertexAttributes(m_Vertices[i]);
             }
-            m_Triangles.push_back(Triangle(
-                Vertex(positions[iv[0] - 1], texcoords[it[0] - 1], normals[in[0] - 1]),
-                Vertex(positions[iv[1] - 1], texcoords[it[1] - 1], normals[in[1] - 1]),
-                Vertex(positions[iv[2] - 1], texcoords[it[2] - 1], normals[in[2] - 1]),
-                materialIndex
-                ));
-        }
+        });
+        std::vector<VertexAttributes>().swap(m_Vertices);
     }
     
-    std::cout << "Load successful (" << m_Triangles.size() << " triangles, " << render->GetCurtime() - startTime << "s elapsed)" << std::endl;
+    std::cout << "Load successful (" << m_Triangles.size() << " triangles, " << GetVertexCount() << " welded vertices, "
+              << float(mesh.corners.size()) / std::max<size_t>(GetVertexCount(), 1) << " triangles per vertex, "
+              << render->GetCurtime() - startTime << "s elapsed, parsed " << float(fileSize) / (1024.0f * 1024.0f) << " MiB at "
+              << fileSize / (parseTime * 1e6) << " MB/s)" << std::endl;
 
 }
 
@@ -118,7 +144,7 @@ void Scene::LoadMaterials(const char* filename)
         {
             char str[80];
             fscanf(file, "%s\n", str);
-            m_MaterialNames.push_back(str);
+            m_MaterialIndices.emplace(str, static_cast<unsigned int>(m_Materials.size()));
             m_Materials.push_back(Material());
         }
         else if (strcmp(buf, "type") == 0)
@@ -149,87 +175,347 @@ void Scene::LoadMaterials(const char* filename)
     std::cout << "Material count: " << m_Materials.size() << std::endl;
 }
 
-struct BVHPrimitiveInfo
+BVHScene::BVHScene(const char* filename, unsigned int maxPrimitivesInNode, float spatialSplitBudget, unsigned int width, bool useCache,
+    bool compressVertices)
+    : Scene(filename, compressVertices), m_MaxPrimitivesInNode(maxPrimitivesInNode), m_SpatialSplitBudget(spatialSplitBudget), m_Width(width), m_WideDepth(0),
+    m_GeometryData(nullptr), m_AttributeData(nullptr), m_TriangleCount(0), m_VertexData(nullptr), m_VertexCount(0), m_VertexSize(GetVertexSize()), m_NodeData(nullptr), m_NodeCount(0), m_NodeSize(0), m_MaterialData(nullptr), m_MaterialCount(0)
+{
+    std::string cacheFilename;
+    uint64_t cacheKey = 0;
+    if (m_Width != 2 && m_Width != 4 && m_Width != 8)
+    {
+        throw std::runtime_error("BVH width must be 2, 4 or 8");
+    }
+
+    if (useCache)
+    {
+        cacheKey = ComputeCacheKey();
+        char keyString[17];
+        snprintf(keyString, sizeof(keyString), "%016llx", static_cast<unsigned long long>(cacheKey));
+        cacheFilename = m_Filename.substr(0, m_Filename.size() - 4) + "-" + keyString + ".bvhcache";
+
+        if (LoadCache(cacheFilename, cacheKey))
+        {
+            return;
+        }
+    }
+
+    Load();
+    Build();
+    BuildTriangleGeometry(m_Geometry);
+    // Positions are only needed by the build, the geometry holds them from here on
+    std::vector<float3>().swap(m_Positions);
+
+    m_GeometryData = m_Geometry.data();
+    m_AttributeData = m_Triangles.data();
+    m_TriangleCount = m_Triangles.size();
+    m_VertexData = GetVertexData();
+    m_VertexCount = GetVertexCount();
+    if (m_Width > 2)
+    {
+        m_NodeData = m_WideNodes.data();
+        m_NodeCount = m_WideNodes.size();
+        m_NodeSize = sizeof(WideBVHNode);
+    }
+    else
+    {
+        m_NodeData = m_Nodes.data();
+        m_NodeCount = m_Nodes.size();
+        m_NodeSize = sizeof(LinearBVHNode);
+    }
+    m_MaterialData = m_Materials.data();
+    m_MaterialCount = m_Materials.size();
+
+    if (useCache)
+    {
+        if (WriteSceneFile(cacheFilename, cacheKey))
+        {
+            std::cout << "Scene cache written to " << cacheFilename << std::endl;
+        }
+        else
+        {
+            std::cerr << "Failed to write scene cache " << cacheFilename << std::endl;
+        }
+    }
+
+}
+
+BVHScene::BVHScene(const char* filename)
+    : Scene(filename), m_MaxPrimitivesInNode(0), m_SpatialSplitBudget(-1.0f), m_Width(2), m_WideDepth(0),
+    m_GeometryData(nullptr), m_AttributeData(nullptr), m_TriangleCount(0), m_VertexData(nullptr), m_VertexCount(0), m_VertexSize(0), m_NodeData(nullptr), m_NodeCount(0), m_NodeSize(0), m_MaterialData(nullptr), m_MaterialCount(0)
 {
-    BVHPrimitiveInfo() {}
-    BVHPrimitiveInfo(unsigned int primitiveNumber, const Bounds3 &bounds)
-        : primitiveNumber(primitiveNumber), bounds(bounds),
-        centroid(bounds.min * 0.5f + bounds.max * 0.5f)
-    {}
+    double startTime = render->GetCurtime();
+    if (!m_Cache.Load(m_Filename))
+    {
+        throw std::runtime_error("Failed to open scene file " + m_Filename);
+    }
 
-    unsigned int primitiveNumber;
-    Bounds3 bounds;
-    float3 centroid;
+    uint64_t infoCount;
+    const SceneInfo* info = m_Cache.GetSection<SceneInfo>(SceneCacheSection_t::SCENE_INFO, infoCount);
+    if (!info || infoCount != 1 || (info->bvhWidth != 2 && info->bvhWidth != 4 && info->bvhWidth != 8))
+    {
+        throw std::runtime_error("Invalid scene file " + m_Filename);
+    }
+    m_Width = info->bvhWidth;
+    m_CompressVertices = info->compressedVertices != 0;
+    m_VertexSize = GetVertexSize();
 
-};
+    if (!MapSections())
+    {
+        throw std::runtime_error("Incomplete scene file " + m_Filename);
+    }
 
-struct BVHBuildNode
+    m_LoadTime = render->GetCurtime() - startTime;
+    std::cout << "Scene mapped from " << m_Filename << " (" << m_NodeCount << " nodes of width " << m_Width << ", " << m_TriangleCount << " triangles, "
+              << float(m_Cache.GetSize()) / (1024.0f * 1024.0f) << " MiB, " << m_LoadTime << "s elapsed)" << std::endl;
+
+}
+
+void BVHScene::Build()
 {
-    void InitLeaf(int first, int n, const Bounds3 &b)
+    std::cout << "Building Bounding Volume Hierarchy for scene" << std::endl;
+
+    double startTime = render->GetCurtime();
+    std::vector<unsigned int> primitiveIndices;
+    if (m_SpatialSplitBudget >= 0.0f)
+    {
+        SBVHBuilder builder(m_MaxPrimitivesInNode, m_SpatialSplitBudget);
+        builder.Build(m_Positions, m_Triangles, m_Nodes, primitiveIndices);
+        std::cout << "SBVH performed " << builder.GetSpatialSplitCount() << " spatial splits, "
+                  << primitiveIndices.size() - m_Triangles.size() << " duplicated triangle references" << std::endl;
+    }
+    else
     {
-        firstPrimOffset = first;
-        nPrimitives = n;
-        bounds = b;
-        children[0] = children[1] = nullptr;
+        std::vector<Bounds3> primitiveBounds(m_Triangles.size());
+        for (unsigned int i = 0; i < m_Triangles.size(); ++i)
+        {
+            primitiveBounds[i] = GetTriangleBounds(i);
+        }
 
+        BVHBuilder builder(m_MaxPrimitivesInNode);
+        builder.Build(primitiveBounds, m_Nodes, primitiveIndices);
     }
 
-    void InitInterior(int axis, BVHBuildNode *c0, BVHBuildNode *c1)
+    ReorderTriangles(primitiveIndices);
+
+    if (m_Width > 2)
     {
-        children[0] = c0;
-        children[1] = c1;
-        bounds = Union(c0->bounds, c1->bounds);
-        splitAxis = axis;
-        nPrimitives = 0;
+        // Collapse into the wide layout, its leaves need yet another triangle order
+        WideBVHBuilder wideBuilder(m_Width);
+        wideBuilder.Build(m_Nodes, m_WideNodes, primitiveIndices);
+        ReorderTriangles(primitiveIndices);
+        std::vector<LinearBVHNode>().swap(m_Nodes);
+        m_WideDepth = WideBVHBuilder::ComputeDepth(m_WideNodes.data(), m_WideNodes.size());
+        std::cout << "Wide BVH depth: " << m_WideDepth << " levels" << std::endl;
+    }
+
+    m_BuildTime = render->GetCurtime() - startTime;
+    size_t nodeCount = m_Width > 2 ? m_WideNodes.size() : m_Nodes.size();
+    size_t nodeSize = m_Width > 2 ? sizeof(WideBVHNode) : sizeof(LinearBVHNode);
+    std::cout << "BVH created with " << nodeCount << " nodes of width " << m_Width << " for " << m_Triangles.size() << " triangles ("
+              << float(nodeCount * nodeSize) / (1024.0f * 1024.0f) << " MiB, " << m_BuildTime << "s elapsed, "
+              << m_Triangles.size() / (m_BuildTime * 1e6) << " Mtris/s, " << TaskScheduler::Get().GetThreadCount() << " threads, "
+              << "peak memory " << float(GetPeakMemoryUsage()) / (1024.0f * 1024.0f) << " MiB)" << std::endl;
 
+}
+
+void BVHScene::ReorderTriangles(const std::vector<unsigned int>& primitiveIndices)
+{
+    if (primitiveIndices.size() != m_Triangles.size())
+    {
+        // Spatial splits reference some triangles from several leaves, copy them into leaf order
+        std::vector<TriangleAttributes> triangles;
+        triangles.reserve(primitiveIndices.size());
+        for (unsigned int index : primitiveIndices)
+        {
+            triangles.push_back(m_Triangles[index]);
+        }
+        m_Triangles.swap(triangles);
     }
+    else
+    {
+        // Reorder triangles in place by following the cycles of the permutation,
+        // a second triangle array would double the peak memory of the build
+        std::vector<bool> placed(primitiveIndices.size(), false);
+        for (unsigned int i = 0; i < primitiveIndices.size(); ++i)
+        {
+            if (placed[i])
+            {
+                continue;
+            }
 
-    Bounds3 bounds;
-    BVHBuildNode *children[2];
-    int splitAxis, firstPrimOffset, nPrimitives;
+            TriangleAttributes first = m_Triangles[i];
+            unsigned int j = i;
+            while (true)
+            {
+                placed[j] = true;
+                unsigned int k = primitiveIndices[j];
+                if (k == i)
+                {
+                    m_Triangles[j] = first;
+                    break;
+                }
+                m_Triangles[j] = m_Triangles[k];
+                j = k;
+            }
+        }
+    }
 
-};
+}
 
-struct BucketInfo
+std::string BVHScene::GetKernelOptions() const
 {
-    int count = 0;
-    Bounds3 bounds;
-};
+    std::string options = Scene::GetKernelOptions();
+    if (m_Width > 2)
+    {
+        // Every level below the root leaves at most m_Width - 1 siblings on the stack
+        options += " -D WIDE_BVH -D WIDE_BVH_WIDTH=" + std::to_string(m_Width) +
+            " -D WIDE_BVH_STACK_SIZE=" + std::to_string((m_Width - 1) * m_WideDepth + 1);
+    }
+    return options;
+}
 
-BVHScene::BVHScene(const char* filename, unsigned int maxPrimitivesInNode)
-    : Scene(filename), m_MaxPrimitivesInNode(maxPrimitivesInNode)
+uint64_t BVHScene::ComputeCacheKey() const
 {
-    std::cout << "Building Bounding Volume Hierarchy for scene" << std::endl;
+    uint64_t key = SceneCache::HashFile(m_Filename);
+    key = SceneCache::HashFile(GetMaterialFilename(), key);
+
+    const uint32_t params[] = {
+        m_MaxPrimitivesInNode,
+        m_SpatialSplitBudget >= 0.0f ? SBVHBuilder::nObjectBins : BVHBuilder::nBuckets,
+        m_SpatialSplitBudget >= 0.0f ? SBVHBuilder::nSpatialBins : 0,
+        m_Width,
+        m_CompressVertices,
+        static_cast<uint32_t>(sizeof(TriangleGeometry)),
+        static_cast<uint32_t>(sizeof(TriangleAttributes)),
+        static_cast<uint32_t>(m_VertexSize),
+        static_cast<uint32_t>(sizeof(LinearBVHNode)),
+        static_cast<uint32_t>(sizeof(WideBVHNode)),
+        static_cast<uint32_t>(sizeof(Material)),
+    };
+    key = SceneCache::Hash(params, sizeof(params), key);
+    return SceneCache::Hash(&m_SpatialSplitBudget, sizeof(m_SpatialSplitBudget), key);
+}
 
+bool BVHScene::LoadCache(const std::string& filename, uint64_t key)
+{
     double startTime = render->GetCurtime();
-    std::vector<BVHPrimitiveInfo> primitiveInfo(m_Triangles.size());
-    for (unsigned int i = 0; i < m_Triangles.size(); ++i)
+    if (!m_Cache.Load(filename, key))
+    {
+        return false;
+    }
+    if (!MapSections())
     {
-        primitiveInfo[i] = { i, m_Triangles[i].GetBounds() };
+        std::cerr << "Ignoring incomplete scene cache " << filename << std::endl;
+        CloseCache();
+        return false;
     }
 
-    unsigned int totalNodes = 0;
-    std::vector<Triangle> orderedTriangles;
-    m_Root = RecursiveBuild(primitiveInfo, 0, m_Triangles.size(), &totalNodes, orderedTriangles);
-    m_Triangles.swap(orderedTriangles);
+    m_LoadTime = render->GetCurtime() - startTime;
+    std::cout << "BVH loaded from cache " << filename << " (" << m_NodeCount << " nodes, " << m_TriangleCount << " triangles, "
+              << float(m_Cache.GetSize()) / (1024.0f * 1024.0f) << " MiB, " << m_LoadTime << "s elapsed)" << std::endl;
+    return true;
+}
 
-    //primitiveInfo.resize(0);
-    std::cout << "BVH created with " << totalNodes << " nodes for " << m_Triangles.size() << " triangles ("<< float(totalNodes * sizeof(BVHBuildNode)) / (1024.0f * 1024.0f) << " MiB, " << render->GetCurtime() - startTime << "s elapsed)" << std::endl;
+bool BVHScene::MapSections()
+{
+    uint64_t triangleCount, attributeCount, vertexCount, nodeCount, materialCount;
+    m_GeometryData = m_Cache.GetSection<TriangleGeometry>(SceneCacheSection_t::TRIANGLE_GEOMETRY, triangleCount);
+    m_AttributeData = m_Cache.GetSection<TriangleAttributes>(SceneCacheSection_t::TRIANGLE_ATTRIBUTES, attributeCount);
+    m_VertexData = m_Cache.GetSection(m_CompressVertices ? SceneCacheSection_t::COMPRESSED_VERTEX_ATTRIBUTES : SceneCacheSection_t::VERTEX_ATTRIBUTES,
+        static_cast<uint32_t>(m_VertexSize), vertexCount);
+    if (m_Width > 2)
+    {
+        m_NodeData = m_Cache.GetSection<WideBVHNode>(SceneCacheSection_t::WIDE_NODES, nodeCount);
+        m_NodeSize = sizeof(WideBVHNode);
+        // The traversal stack is sized from the depth, a tree it cannot be computed for is not traversed
+        m_WideDepth = m_NodeData ? WideBVHBuilder::ComputeDepth(static_cast<const WideBVHNode*>(m_NodeData), static_cast<size_t>(nodeCount)) : 0;
+        if (m_WideDepth == 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        m_NodeData = m_Cache.GetSection<LinearBVHNode>(SceneCacheSection_t::NODES, nodeCount);
+        m_NodeSize = sizeof(LinearBVHNode);
+    }
+    m_MaterialData = m_Cache.GetSection<Material>(SceneCacheSection_t::MATERIALS, materialCount);
+    if (!m_GeometryData || !m_AttributeData || attributeCount != triangleCount || !m_VertexData || !m_NodeData || !m_MaterialData)
+    {
+        return false;
+    }
+    m_TriangleCount = static_cast<size_t>(triangleCount);
+    m_VertexCount = static_cast<size_t>(vertexCount);
+    m_NodeCount = static_cast<size_t>(nodeCount);
+    m_MaterialCount = static_cast<size_t>(materialCount);
+    return true;
+}
 
-    // Compute representation of depth-first traversal of BVH tree
-    m_Nodes.resize(totalNodes);
-    unsigned int offset = 0;
-    FlattenBVHTree(m_Root, &offset);
-    assert(totalNodes == offset);
+void BVHScene::CloseCache()
+{
+    m_Cache.Close();
+    m_GeometryData = nullptr;
+    m_AttributeData = nullptr;
+    m_TriangleCount = 0;
+    m_VertexData = nullptr;
+    m_VertexCount = 0;
+    m_NodeData = nullptr;
+    m_NodeCount = 0;
+    m_MaterialData = nullptr;
+    m_MaterialCount = 0;
+}
+
+bool BVHScene::WriteSceneFile(const std::string& filename, uint64_t key) const
+{
+    SceneInfo info = { m_Width, m_CompressVertices };
+    std::vector<SceneCache::Section> sections = {
+        { SceneCacheSection_t::SCENE_INFO, sizeof(SceneInfo), 1, &info },
+        { m_Width > 2 ? SceneCacheSection_t::WIDE_NODES : SceneCacheSection_t::NODES, static_cast<uint32_t>(m_NodeSize), m_NodeCount, m_NodeData },
+        { SceneCacheSection_t::TRIANGLE_GEOMETRY, sizeof(TriangleGeometry), m_TriangleCount, m_GeometryData },
+        { SceneCacheSection_t::TRIANGLE_ATTRIBUTES, sizeof(TriangleAttributes), m_TriangleCount, m_AttributeData },
+        { m_CompressVertices ? SceneCacheSection_t::COMPRESSED_VERTEX_ATTRIBUTES : SceneCacheSection_t::VERTEX_ATTRIBUTES,
+          static_cast<uint32_t>(m_VertexSize), m_VertexCount, m_VertexData },
+        { SceneCacheSection_t::MATERIALS, sizeof(Material), m_MaterialCount, m_MaterialData },
+    };
+
+    return SceneCache::Write(filename, key, sections);
+}
+
+bool BVHScene::Export(const std::string& filename) const
+{
+    if (!m_NodeData)
+    {
+        std::cerr << "Failed to export scene to " << filename << ", its mapped data was released by SetupBuffers" << std::endl;
+        return false;
+    }
 
+    // Scene files are not tied to their sources
+    bool success = WriteSceneFile(filename, 0);
+    if (success)
+    {
+        std::cout << "Scene exported to " << filename << std::endl;
+    }
+    else
+    {
+        std::cerr << "Failed to export scene to " << filename << std::endl;
+    }
+    return success;
 }
 
 void BVHScene::SetupBuffers()
 {
     cl_int errCode;
+    // CPU devices work on the mapped scene file directly, everything else gets a copy
+    bool useHostPtr = m_Cache.IsOpen() && render->GetOCLHelper()->IsCPUDevice();
+    cl_mem_flags flags = CL_MEM_READ_ONLY | (useHostPtr ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR);
+    if (useHostPtr)
+    {
+        std::cout << "Using the mapped scene file as device memory" << std::endl;
+    }
 
-    m_TriangleBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_Triangles.size() * sizeof(Triangle), m_Triangles.data(), &errCode);
-    std::cout << "TriangleBuffer size: " << float(m_Triangles.size() * sizeof(Triangle)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+    m_TriangleBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_TriangleCount * sizeof(TriangleGeometry), const_cast<TriangleGeometry*>(m_GeometryData), &errCode);
+    std::cout << "TriangleBuffer size: " << float(m_TriangleCount * sizeof(TriangleGeometry)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
     if (errCode)
     {
         throw CLException("Failed to create scene buffer", errCode);
@@ -237,8 +523,27 @@ void BVHScene::SetupBuffers()
 
     render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_SCENE, &m_TriangleBuffer, sizeof(cl::Buffer));
 
-    m_NodeBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_Nodes.size() * sizeof(LinearBVHNode), m_Nodes.data(), &errCode);
-    std::cout << "NodeBuffer size: " << float(m_Nodes.size() * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+    m_AttributeBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_TriangleCount * sizeof(TriangleAttributes), const_cast<TriangleAttributes*>(m_AttributeData), &errCode);
+    std::cout << "AttributeBuffer size: " << float(m_TriangleCount * sizeof(TriangleAttributes)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create triangle attribute buffer", errCode);
+    }
+
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_ATTRIBUTE, &m_AttributeBuffer, sizeof(cl::Buffer));
+
+    m_VertexBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_VertexCount * m_VertexSize, const_cast<void*>(m_VertexData), &errCode);
+    std::cout << "VertexBuffer size: " << float(m_VertexCount * m_VertexSize) / (1024.0f * 1024.0f) << " MiB (" << m_VertexCount << " vertices"
+              << (m_CompressVertices ? ", compressed" : "") << ")" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create vertex buffer", errCode);
+    }
+
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_VERTEX, &m_VertexBuffer, sizeof(cl::Buffer));
+
+    m_NodeBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_NodeCount * m_NodeSize, const_cast<void*>(m_NodeData), &errCode);
+    std::cout << "NodeBuffer size: " << float(m_NodeCount * m_NodeSize) / (1024.0f * 1024.0f) << " MiB" << std::endl;
     if (errCode)
     {
         throw CLException("Failed to create BVH node buffer", errCode);
@@ -246,8 +551,8 @@ void BVHScene::SetupBuffers()
 
     render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_NODE, &m_NodeBuffer, sizeof(cl::Buffer));
 
-    m_MaterialBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_Materials.size() * sizeof(Material), m_Materials.data(), &errCode);
-    std::cout << "MaterialBuffer size: " << m_Materials.size() * sizeof(Material) << " Bytes" << std::endl;
+    m_MaterialBuffer = cl::Buffer(render->GetOCLHelper()->GetContext(), flags, m_MaterialCount * sizeof(Material), const_cast<Material*>(m_MaterialData), &errCode);
+    std::cout << "MaterialBuffer size: " << m_MaterialCount * sizeof(Material) << " Bytes" << std::endl;
     if (errCode)
     {
         throw CLException("Failed to create material buffer", errCode);
@@ -255,184 +560,279 @@ void BVHScene::SetupBuffers()
 
     render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_MATERIAL, &m_MaterialBuffer, sizeof(cl::Buffer));
 
-    
+    // The buffers hold copies, the mapping is not needed anymore. A scene built in memory keeps its data.
+    if (!useHostPtr && m_Cache.IsOpen())
+    {
+        CloseCache();
+    }
+
 }
 
-BVHBuildNode* BVHScene::RecursiveBuild(
-    std::vector<BVHPrimitiveInfo> &primitiveInfo,
-    unsigned int start,
-    unsigned int end, unsigned int *totalNodes,
-    std::vector<Triangle> &orderedTriangles)
+// Work-group size of the LBVH kernels, a radix sort work-group handles 4 keys per work-item
+static const unsigned int LBVH_GROUP_SIZE = 256;
+static const unsigned int LBVH_SORT_BLOCK = LBVH_GROUP_SIZE * 4;
+static const unsigned int LBVH_MORTON_BITS = 30;
+
+LBVHScene::LBVHScene(const char* filename, unsigned int treeletPasses, bool compressVertices)
+    : Scene(filename, compressVertices), m_TreeletPasses(treeletPasses)
 {
-    assert(start <= end);
+    Load();
+    if (m_Triangles.size() < 2)
+    {
+        throw std::runtime_error("LBVH build needs at least two triangles");
+    }
 
-    // TODO: Add memory pool
-    BVHBuildNode *node = new BVHBuildNode;
-    (*totalNodes)++;
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (unsigned int i = start; i < end; ++i)
+cl::Kernel LBVHScene::CreateKernel(const char* name) const
+{
+    cl_int errCode;
+    cl::Kernel kernel(m_Program, name, &errCode);
+    if (errCode)
     {
-        bounds = Union(bounds, primitiveInfo[i].bounds);
+        throw CLException(std::string("Failed to create LBVH kernel ") + name, errCode);
     }
+    return kernel;
+}
 
-    unsigned int nPrimitives = end - start;
-    if (nPrimitives == 1)
+cl::Buffer LBVHScene::CreateBuildBuffer(size_t size, const char* name) const
+{
+    cl_int errCode;
+    cl::Buffer buffer(render->GetOCLHelper()->GetContext(), CL_MEM_READ_WRITE, size, nullptr, &errCode);
+    if (errCode)
     {
-        // Create leaf
-        int firstPrimOffset = orderedTriangles.size();
-        for (unsigned int i = start; i < end; ++i)
-        {
-            int primNum = primitiveInfo[i].primitiveNumber;
-            orderedTriangles.push_back(m_Triangles[primNum]);
-        }
-        node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-        return node;
+        throw CLException(std::string("Failed to create LBVH ") + name + " buffer", errCode);
     }
-    else
+    return buffer;
+}
+
+void LBVHScene::RunKernel(const cl::Kernel& kernel, size_t workItems) const
+{
+    size_t globalSize = (workItems + LBVH_GROUP_SIZE - 1) / LBVH_GROUP_SIZE * LBVH_GROUP_SIZE;
+    cl_int errCode = render->GetOCLHelper()->GetOCLHelper()->queue().enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(globalSize), cl::NDRange(LBVH_GROUP_SIZE));
+    if (errCode)
     {
-        // Compute bound of primitive centroids, choose split dimension
-        Bounds3 centroidBounds;
-        for (unsigned int i = start; i < end; ++i)
-        {
-            centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
-        }
-        unsigned int dim = centroidBounds.MaximumExtent();
+        throw CLException("Failed to run LBVH kernel", errCode);
+    }
+}
 
-        // Partition primitives into two sets and build children
-        unsigned int mid = (start + end) / 2;
-        if (centroidBounds.max[dim] == centroidBounds.min[dim])
-        {
-            // Create leaf
-            unsigned int firstPrimOffset = orderedTriangles.size();
-            for (unsigned int i = start; i < end; ++i)
-            {
-                unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                orderedTriangles.push_back(m_Triangles[primNum]);
-            }
-            node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-            return node;
-        }
-        else
-        {
-            if (nPrimitives <= 2)
-            {
-                // Partition primitives into equally-sized subsets
-                mid = (start + end) / 2;
-                std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
-                    [dim](const BVHPrimitiveInfo &a, const BVHPrimitiveInfo &b)
-                    {
-                        return a.centroid[dim] < b.centroid[dim];
-                    });
-            }
-            else
-            {
-                // Partition primitives using approximate SAH
-                const unsigned int nBuckets = 12;
-                BucketInfo buckets[nBuckets];
+void LBVHScene::SetupBuffers()
+{
+    const cl::Context& context = render->GetOCLHelper()->GetContext();
+    cl_uint n = static_cast<cl_uint>(m_Triangles.size());
+    cl_uint nNodes = 2 * n - 1;
+    cl_uint nGroups = (n + LBVH_SORT_BLOCK - 1) / LBVH_SORT_BLOCK;
+    cl_int errCode;
 
-                // Initialize _BucketInfo_ for SAH partition buckets
-                for (unsigned int i = start; i < end; ++i)
-                {
-                    int b = nBuckets * centroidBounds.Offset(primitiveInfo[i].centroid)[dim];
-                    if (b == nBuckets) b = nBuckets - 1;
-                    assert(b >= 0 && b < nBuckets);
-                    buckets[b].count++;
-                    buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
-                }
+    m_Program = render->GetOCLHelper()->BuildProgram("src/kernels/kernel_lbvh.cl", "-D LBVH_GROUP_SIZE=" + std::to_string(LBVH_GROUP_SIZE));
+    m_ComputeCentroidBounds = CreateKernel("ComputeCentroidBounds");
+    m_ReduceBounds = CreateKernel("ReduceBounds");
+    m_ComputeMortonCodes = CreateKernel("ComputeMortonCodes");
+    m_RadixCountZeros = CreateKernel("RadixCountZeros");
+    m_ScanGroupZeros = CreateKernel("ScanGroupZeros");
+    m_RadixScatter = CreateKernel("RadixScatter");
+    m_BuildHierarchy = CreateKernel("BuildHierarchy");
+    m_ComputeNodeBounds = CreateKernel("ComputeNodeBounds");
+    m_OptimizeTreelets = CreateKernel("OptimizeTreelets");
+    m_EmitLinearNodes = CreateKernel("EmitLinearNodes");
+    m_GatherTriangles = CreateKernel("GatherTriangles");
+
+    // Triangles in file order are kept on the device as the source of every rebuild
+    std::vector<TriangleGeometry> geometry;
+    BuildTriangleGeometry(geometry);
+    m_SourceTriangleBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(TriangleGeometry), geometry.data(), &errCode);
+    if (errCode)
+    {
+        throw CLException("Failed to create scene buffer", errCode);
+    }
+    m_SourceAttributeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n * sizeof(TriangleAttributes), m_Triangles.data(), &errCode);
+    if (errCode)
+    {
+        throw CLException("Failed to create triangle attribute buffer", errCode);
+    }
+    m_TriangleBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(TriangleGeometry), nullptr, &errCode);
+    std::cout << "TriangleBuffer size: " << float(2 * n * sizeof(TriangleGeometry)) / (1024.0f * 1024.0f) << " MiB (including source triangles)" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create scene buffer", errCode);
+    }
+    m_AttributeBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, n * sizeof(TriangleAttributes), nullptr, &errCode);
+    std::cout << "AttributeBuffer size: " << float(2 * n * sizeof(TriangleAttributes)) / (1024.0f * 1024.0f) << " MiB (including source triangles)" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create triangle attribute buffer", errCode);
+    }
+    m_VertexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, GetVertexCount() * GetVertexSize(), const_cast<void*>(GetVertexData()), &errCode);
+    std::cout << "VertexBuffer size: " << float(GetVertexCount() * GetVertexSize()) / (1024.0f * 1024.0f) << " MiB (" << GetVertexCount() << " vertices"
+              << (m_CompressVertices ? ", compressed" : "") << ")" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create vertex buffer", errCode);
+    }
 
-                // Compute costs for splitting after each bucket
-                float cost[nBuckets - 1];
-                for (unsigned int i = 0; i < nBuckets - 1; ++i)
-                {
-                    Bounds3 b0, b1;
-                    int count0 = 0, count1 = 0;
-                    for (unsigned int j = 0; j <= i; ++j)
-                    {
-                        b0 = Union(b0, buckets[j].bounds);
-                        count0 += buckets[j].count;
-                    }
-                    for (unsigned int j = i + 1; j < nBuckets; ++j)
-                    {
-                        b1 = Union(b1, buckets[j].bounds);
-                        count1 += buckets[j].count;
-                    }
-                    cost[i] = 1.0f + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
-                }
+    m_NodeBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, nNodes * sizeof(LinearBVHNode), nullptr, &errCode);
+    std::cout << "NodeBuffer size: " << float(nNodes * sizeof(LinearBVHNode)) / (1024.0f * 1024.0f) << " MiB" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create BVH node buffer", errCode);
+    }
 
-                // Find bucket to split at that minimizes SAH metric
-                float minCost = cost[0];
-                unsigned int minCostSplitBucket = 0;
-                for (unsigned int i = 1; i < nBuckets - 1; ++i)
-                {
-                    if (cost[i] < minCost)
-                    {
-                        minCost = cost[i];
-                        minCostSplitBucket = i;
-                    }
-                }
+    // Temporary build data
+    m_PartialBoundsBuffer = CreateBuildBuffer(2 * LBVH_GROUP_SIZE * sizeof(cl_float4), "partial bounds");
+    m_SceneBoundsBuffer = CreateBuildBuffer(2 * sizeof(cl_float4), "scene bounds");
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        m_KeyBuffers[i] = CreateBuildBuffer(n * sizeof(cl_uint), "key");
+        m_ValueBuffers[i] = CreateBuildBuffer(n * sizeof(cl_uint), "value");
+    }
+    m_GroupZerosBuffer = CreateBuildBuffer((nGroups + 1) * sizeof(cl_uint), "group zeros");
+    m_ChildrenBuffer = CreateBuildBuffer((n - 1) * 2 * sizeof(cl_uint), "children");
+    m_ParentBuffer = CreateBuildBuffer(nNodes * sizeof(cl_uint), "parent");
+    m_NodeBoundsBuffer = CreateBuildBuffer(nNodes * 2 * sizeof(cl_float4), "node bounds");
+    m_NodeCostBuffer = CreateBuildBuffer(nNodes * sizeof(cl_float), "node cost");
+    m_NodeSizeBuffer = CreateBuildBuffer(nNodes * sizeof(cl_uint), "node size");
+    m_FlagBuffer = CreateBuildBuffer((n - 1) * sizeof(cl_uint), "flag");
 
-                // Either create leaf or split primitives at selected SAH bucket
-                float leafCost = float(nPrimitives);
-                if (nPrimitives > m_MaxPrimitivesInNode || minCost < leafCost)
-                {
-                    BVHPrimitiveInfo *pmid = std::partition( &primitiveInfo[start], &primitiveInfo[end - 1] + 1,
-                        [=](const BVHPrimitiveInfo &pi)
-                        {
-                            int b = nBuckets * centroidBounds.Offset(pi.centroid)[dim];
-                            if (b == nBuckets) b = nBuckets - 1;
-                            assert(b >= 0 && b < nBuckets);
-                            return b <= minCostSplitBucket;
-                        });
-                    mid = pmid - &primitiveInfo[0];
-                }
-                else
-                {
-                    // Create leaf
-                    unsigned int firstPrimOffset = orderedTriangles.size();
-                    for (unsigned int i = start; i < end; ++i)
-                    {
-                        unsigned int primNum = primitiveInfo[i].primitiveNumber;
-                        orderedTriangles.push_back(m_Triangles[primNum]);
-                    }
-                    node->InitLeaf(firstPrimOffset, nPrimitives, bounds);
-
-                    return node;
-                }
-            }
+    Rebuild();
 
-            node->InitInterior(dim,
-                RecursiveBuild(primitiveInfo, start, mid,
-                totalNodes, orderedTriangles),
-                RecursiveBuild(primitiveInfo, mid, end,
-                totalNodes, orderedTriangles));
-        }
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_SCENE, &m_TriangleBuffer, sizeof(cl::Buffer));
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_ATTRIBUTE, &m_AttributeBuffer, sizeof(cl::Buffer));
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_VERTEX, &m_VertexBuffer, sizeof(cl::Buffer));
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_NODE, &m_NodeBuffer, sizeof(cl::Buffer));
+
+    m_MaterialBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, m_Materials.size() * sizeof(Material), m_Materials.data(), &errCode);
+    std::cout << "MaterialBuffer size: " << m_Materials.size() * sizeof(Material) << " Bytes" << std::endl;
+    if (errCode)
+    {
+        throw CLException("Failed to create material buffer", errCode);
     }
 
-    return node;
+    render->GetOCLHelper()->SetArgument(RenderKernelArgument_t::BUFFER_MATERIAL, &m_MaterialBuffer, sizeof(cl::Buffer));
+
 }
 
-unsigned int BVHScene::FlattenBVHTree(BVHBuildNode *node, unsigned int *offset)
+void LBVHScene::Rebuild()
 {
-    LinearBVHNode *linearNode = &m_Nodes[*offset];
-    linearNode->bounds = node->bounds;
-    unsigned int myOffset = (*offset)++;
-    if (node->nPrimitives > 0)
+    cl::CommandQueue& queue = render->GetOCLHelper()->GetOCLHelper()->queue();
+    cl_uint n = static_cast<cl_uint>(m_Triangles.size());
+    cl_uint nNodes = 2 * n - 1;
+    cl_uint nGroups = (n + LBVH_SORT_BLOCK - 1) / LBVH_SORT_BLOCK;
+    cl_uint nBoundsGroups = std::min(LBVH_GROUP_SIZE, (n + LBVH_GROUP_SIZE - 1) / LBVH_GROUP_SIZE);
+    cl_int errCode;
+
+    double startTime = render->GetCurtime();
+
+    // Bounds of the triangle centroids define the Morton code grid
+    m_ComputeCentroidBounds.setArg(0, m_SourceTriangleBuffer);
+    m_ComputeCentroidBounds.setArg(1, n);
+    m_ComputeCentroidBounds.setArg(2, m_PartialBoundsBuffer);
+    RunKernel(m_ComputeCentroidBounds, nBoundsGroups * LBVH_GROUP_SIZE);
+
+    m_ReduceBounds.setArg(0, m_PartialBoundsBuffer);
+    m_ReduceBounds.setArg(1, nBoundsGroups);
+    m_ReduceBounds.setArg(2, m_SceneBoundsBuffer);
+    RunKernel(m_ReduceBounds, LBVH_GROUP_SIZE);
+
+    m_ComputeMortonCodes.setArg(0, m_SourceTriangleBuffer);
+    m_ComputeMortonCodes.setArg(1, n);
+    m_ComputeMortonCodes.setArg(2, m_SceneBoundsBuffer);
+    m_ComputeMortonCodes.setArg(3, m_KeyBuffers[0]);
+    m_ComputeMortonCodes.setArg(4, m_ValueBuffers[0]);
+    RunKernel(m_ComputeMortonCodes, n);
+
+    // Sort triangle indices by Morton code, one bit per pass
+    for (cl_uint bit = 0; bit < LBVH_MORTON_BITS; ++bit)
     {
-        assert(!node->children[0] && !node->children[1]);
-        assert(node->nPrimitives < 65536);
-        linearNode->offset = node->firstPrimOffset;
-        linearNode->nPrimitives = node->nPrimitives;
+        unsigned int src = bit & 1;
+        unsigned int dst = src ^ 1;
+
+        m_RadixCountZeros.setArg(0, m_KeyBuffers[src]);
+        m_RadixCountZeros.setArg(1, n);
+        m_RadixCountZeros.setArg(2, bit);
+        m_RadixCountZeros.setArg(3, m_GroupZerosBuffer);
+        RunKernel(m_RadixCountZeros, nGroups * LBVH_GROUP_SIZE);
+
+        m_ScanGroupZeros.setArg(0, m_GroupZerosBuffer);
+        m_ScanGroupZeros.setArg(1, nGroups);
+        RunKernel(m_ScanGroupZeros, LBVH_GROUP_SIZE);
+
+        m_RadixScatter.setArg(0, m_KeyBuffers[src]);
+        m_RadixScatter.setArg(1, m_ValueBuffers[src]);
+        m_RadixScatter.setArg(2, m_KeyBuffers[dst]);
+        m_RadixScatter.setArg(3, m_ValueBuffers[dst]);
+        m_RadixScatter.setArg(4, n);
+        m_RadixScatter.setArg(5, bit);
+        m_RadixScatter.setArg(6, m_GroupZerosBuffer);
+        m_RadixScatter.setArg(7, nGroups);
+        RunKernel(m_RadixScatter, nGroups * LBVH_GROUP_SIZE);
     }
-    else
+    const cl::Buffer& sortedCodes = m_KeyBuffers[LBVH_MORTON_BITS & 1];
+    const cl::Buffer& sortedIndices = m_ValueBuffers[LBVH_MORTON_BITS & 1];
+
+    m_BuildHierarchy.setArg(0, sortedCodes);
+    m_BuildHierarchy.setArg(1, n);
+    m_BuildHierarchy.setArg(2, m_ChildrenBuffer);
+    m_BuildHierarchy.setArg(3, m_ParentBuffer);
+    RunKernel(m_BuildHierarchy, n - 1);
+
+    errCode = queue.enqueueFillBuffer(m_FlagBuffer, cl_uint(0), 0, (n - 1) * sizeof(cl_uint));
+    if (errCode)
+    {
+        throw CLException("Failed to clear LBVH flags", errCode);
+    }
+    m_ComputeNodeBounds.setArg(0, m_SourceTriangleBuffer);
+    m_ComputeNodeBounds.setArg(1, sortedIndices);
+    m_ComputeNodeBounds.setArg(2, n);
+    m_ComputeNodeBounds.setArg(3, m_ChildrenBuffer);
+    m_ComputeNodeBounds.setArg(4, m_ParentBuffer);
+    m_ComputeNodeBounds.setArg(5, m_NodeBoundsBuffer);
+    m_ComputeNodeBounds.setArg(6, m_NodeCostBuffer);
+    m_ComputeNodeBounds.setArg(7, m_NodeSizeBuffer);
+    m_ComputeNodeBounds.setArg(8, m_FlagBuffer);
+    RunKernel(m_ComputeNodeBounds, n);
+
+    for (unsigned int pass = 0; pass < m_TreeletPasses; ++pass)
+    {
+        errCode = queue.enqueueFillBuffer(m_FlagBuffer, cl_uint(0), 0, (n - 1) * sizeof(cl_uint));
+        if (errCode)
+        {
+            throw CLException("Failed to clear LBVH flags", errCode);
+        }
+        m_OptimizeTreelets.setArg(0, n);
+        m_OptimizeTreelets.setArg(1, m_ChildrenBuffer);
+        m_OptimizeTreelets.setArg(2, m_ParentBuffer);
+        m_OptimizeTreelets.setArg(3, m_NodeBoundsBuffer);
+        m_OptimizeTreelets.setArg(4, m_NodeCostBuffer);
+        m_OptimizeTreelets.setArg(5, m_NodeSizeBuffer);
+        m_OptimizeTreelets.setArg(6, m_FlagBuffer);
+        RunKernel(m_OptimizeTreelets, n);
+    }
+
+    m_EmitLinearNodes.setArg(0, n);
+    m_EmitLinearNodes.setArg(1, m_ChildrenBuffer);
+    m_EmitLinearNodes.setArg(2, m_ParentBuffer);
+    m_EmitLinearNodes.setArg(3, m_NodeBoundsBuffer);
+    m_EmitLinearNodes.setArg(4, m_NodeSizeBuffer);
+    m_EmitLinearNodes.setArg(5, m_NodeBuffer);
+    RunKernel(m_EmitLinearNodes, nNodes);
+
+    m_GatherTriangles.setArg(0, m_SourceTriangleBuffer);
+    m_GatherTriangles.setArg(1, m_SourceAttributeBuffer);
+    m_GatherTriangles.setArg(2, sortedIndices);
+    m_GatherTriangles.setArg(3, n);
+    m_GatherTriangles.setArg(4, m_TriangleBuffer);
+    m_GatherTriangles.setArg(5, m_AttributeBuffer);
+    RunKernel(m_GatherTriangles, n);
+
+    errCode = queue.finish();
+    if (errCode)
     {
-        // Create interior flattened BVH node
-        linearNode->axis = node->splitAxis;
-        linearNode->nPrimitives = 0;
-        FlattenBVHTree(node->children[0], offset);
-        linearNode->offset = FlattenBVHTree(node->children[1], offset);
+        throw CLException("Failed to build LBVH", errCode);
     }
 
-    return myOffset;
+    m_BuildTime = render->GetCurtime() - startTime;
+    std::cout << "LBVH created with " << nNodes << " nodes for " << n << " triangles ("
+              << m_TreeletPasses << " treelet passes, " << m_BuildTime << "s elapsed, "
+              << n / (m_BuildTime * 1e6) << " Mtris/s)" << std::endl;
+
 }
@@ -3,53 +3,166 @@
 
 #include "mathlib/mathlib.hpp"
 #include "utils/shared_structs.hpp"
+#include "io/scene_cache.hpp"
 #include <CL/cl.hpp>
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <unordered_map>
 
 class Scene
 {
 public:
-    Scene(const char* filename);
+    // _compressVertices_ stores the vertex attributes as CompressedVertexAttributes
+    Scene(const char* filename, bool compressVertices = false);
     virtual void SetupBuffers() = 0;
 
+    // Seconds spent building the acceleration structure, 0 if it was loaded
+    double GetBuildTime() const { return m_BuildTime; }
+    // Seconds spent loading a cached or prebuilt acceleration structure, 0 if it was built
+    double GetLoadTime() const { return m_LoadTime; }
+    // Defines the render kernel needs for the node layout of this scene
+    virtual std::string GetKernelOptions() const;
+
+protected:
+    // Parses the OBJ file and the MTL file next to it
+    void Load();
+    std::string GetMaterialFilename() const;
+    Bounds3 GetTriangleBounds(unsigned int index) const;
+    // Intersection data of _m_Triangles_ in their current order
+    void BuildTriangleGeometry(std::vector<TriangleGeometry>& geometry) const;
+    // Vertex attributes in the layout selected by _m_CompressVertices_
+    const void* GetVertexData() const;
+    size_t GetVertexCount() const;
+    size_t GetVertexSize() const;
+
 private:
     void LoadTriangles(const char* filename);
     void LoadMaterials(const char* filename);
-    std::vector<std::string> m_MaterialNames;
+    std::unordered_map<std::string, unsigned int> m_MaterialIndices;
 
 protected:
-    std::vector<Triangle> m_Triangles;
+    std::string m_Filename;
+    // Indexed mesh, OBJ vertices with the same position, texcoord and normal index are welded
+    std::vector<TriangleAttributes> m_Triangles;
+    std::vector<float3> m_Positions;
+    std::vector<VertexAttributes> m_Vertices;
+    bool m_CompressVertices;
+    std::vector<CompressedVertexAttributes> m_CompressedVertices;
     std::vector<Material> m_Materials;
+    // Intersection data of the triangles in leaf order
     cl::Buffer m_TriangleBuffer;
+    // Shading data in the same order, only read for the closest hit
+    cl::Buffer m_AttributeBuffer;
+    cl::Buffer m_VertexBuffer;
     cl::Buffer m_MaterialBuffer;
+    double m_BuildTime = 0.0;
+    double m_LoadTime = 0.0;
 
 };
 
-struct BVHBuildNode;
-struct BVHPrimitiveInfo;
-
 class BVHScene : public Scene
 {
 public:
-    BVHScene(const char* filename, unsigned int maxPrimitivesInNode);
+    // A non-negative _spatialSplitBudget_ builds an SBVH that may add that
+    // fraction of the triangle count as duplicated references
+    // A _width_ of 4 or 8 collapses the binary tree into WideBVHNodes.
+    // _useCache_ loads the built scene from a cache file next to the OBJ file,
+    // or writes it there after the build
+    BVHScene(const char* filename, unsigned int maxPrimitivesInNode, float spatialSplitBudget = -1.0f,
+        unsigned int width = 2, bool useCache = false, bool compressVertices = false);
+    // Maps a prebuilt .rtscene file, its node and vertex layout override the defaults
+    explicit BVHScene(const char* filename);
     virtual void SetupBuffers();
+    virtual std::string GetKernelOptions() const;
 
-private:
-    BVHBuildNode* RecursiveBuild(
-        std::vector<BVHPrimitiveInfo> &primitiveInfo,
-        unsigned int start,
-        unsigned int end, unsigned int *totalNodes,
-        std::vector<Triangle> &orderedTriangles);
+    // Writes the scene as .rtscene file, call it before SetupBuffers
+    bool Export(const std::string& filename) const;
 
-    unsigned int FlattenBVHTree(BVHBuildNode *node, unsigned int *offset);
+private:
+    void Build();
+    void ReorderTriangles(const std::vector<unsigned int>& primitiveIndices);
+    // Key over the source files and everything that changes the built data
+    uint64_t ComputeCacheKey() const;
+    bool LoadCache(const std::string& filename, uint64_t key);
+    // Points the buffer contents at the sections of the mapped file
+    bool MapSections();
+    // Unmaps the scene file and clears the data pointers into it
+    void CloseCache();
+    bool WriteSceneFile(const std::string& filename, uint64_t key) const;
 
 private:
     std::vector<LinearBVHNode> m_Nodes;
+    std::vector<WideBVHNode> m_WideNodes;
+    std::vector<TriangleGeometry> m_Geometry;
     unsigned int m_MaxPrimitivesInNode;
+    float m_SpatialSplitBudget;
+    unsigned int m_Width;
+    // Levels of the wide tree, sizes the traversal stack of the kernel
+    unsigned int m_WideDepth;
+    cl::Buffer m_NodeBuffer;
+
+    // Buffer contents, either the vectors above or the mapped scene file
+    SceneCache m_Cache;
+    const TriangleGeometry* m_GeometryData;
+    const TriangleAttributes* m_AttributeData;
+    size_t m_TriangleCount;
+    const void* m_VertexData;
+    size_t m_VertexCount;
+    size_t m_VertexSize;
+    const void* m_NodeData;
+    size_t m_NodeCount;
+    size_t m_NodeSize;
+    const Material* m_MaterialData;
+    size_t m_MaterialCount;
+
+};
+
+// Linear BVH built on the device from sorted Morton codes. Rebuilds never leave
+// the device and produce the same LinearBVHNode layout as the SAH build.
+class LBVHScene : public Scene
+{
+public:
+    LBVHScene(const char* filename, unsigned int treeletPasses, bool compressVertices = false);
+    virtual void SetupBuffers();
+
+    void Rebuild();
+
+private:
+    cl::Kernel CreateKernel(const char* name) const;
+    // Throws naming _name_ if the allocation fails
+    cl::Buffer CreateBuildBuffer(size_t size, const char* name) const;
+    void RunKernel(const cl::Kernel& kernel, size_t workItems) const;
+
+private:
+    unsigned int m_TreeletPasses;
+    cl::Program m_Program;
+    cl::Kernel m_ComputeCentroidBounds;
+    cl::Kernel m_ReduceBounds;
+    cl::Kernel m_ComputeMortonCodes;
+    cl::Kernel m_RadixCountZeros;
+    cl::Kernel m_ScanGroupZeros;
+    cl::Kernel m_RadixScatter;
+    cl::Kernel m_BuildHierarchy;
+    cl::Kernel m_ComputeNodeBounds;
+    cl::Kernel m_OptimizeTreelets;
+    cl::Kernel m_EmitLinearNodes;
+    cl::Kernel m_GatherTriangles;
+
     cl::Buffer m_NodeBuffer;
-    BVHBuildNode* m_Root;
+    cl::Buffer m_SourceTriangleBuffer;
+    cl::Buffer m_SourceAttributeBuffer;
+    cl::Buffer m_PartialBoundsBuffer;
+    cl::Buffer m_SceneBoundsBuffer;
+    cl::Buffer m_KeyBuffers[2];
+    cl::Buffer m_ValueBuffers[2];
+    cl::Buffer m_GroupZerosBuffer;
+    cl::Buffer m_ChildrenBuffer;
+    cl::Buffer m_ParentBuffer;
+    cl::Buffer m_NodeBoundsBuffer;
+    cl::Buffer m_NodeCostBuffer;
+    cl::Buffer m_NodeSizeBuffer;
+    cl::Buffer m_FlagBuffer;
 
 };
 
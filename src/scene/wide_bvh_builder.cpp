@@ -0,0 +1,256 @@
+#include "wide_bvh_builder.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+static const unsigned int INVALID_NODE = ~0u;
+
+// Interior node of the binary tree, or a contiguous range of triangles
+struct WideBVHBuilder::Child
+{
+    Bounds3 bounds;
+    unsigned int binaryNode;
+    unsigned int first, count;
+
+    bool IsRange() const { return binaryNode == INVALID_NODE; }
+
+};
+
+WideBVHBuilder::WideBVHBuilder(unsigned int width)
+    : m_Width(std::min(std::max(width, 2u), static_cast<unsigned int>(WIDE_BVH_MAX_WIDTH))),
+    m_BinaryNodes(nullptr), m_Nodes(nullptr), m_PrimitiveIndices(nullptr)
+{
+}
+
+WideBVHBuilder::Child WideBVHBuilder::MakeChild(const std::vector<LinearBVHNode>& binaryNodes, unsigned int index)
+{
+    const LinearBVHNode& node = binaryNodes[index];
+    Child child;
+    child.bounds = node.bounds;
+    if (node.nPrimitives > 0)
+    {
+        child.binaryNode = INVALID_NODE;
+        child.first = node.offset;
+        child.count = node.nPrimitives;
+    }
+    else
+    {
+        child.binaryNode = index;
+        child.first = child.count = 0;
+    }
+    return child;
+}
+
+void WideBVHBuilder::Build(const std::vector<LinearBVHNode>& binaryNodes,
+    std::vector<WideBVHNode>& nodes,
+    std::vector<unsigned int>& primitiveIndices)
+{
+    assert(!binaryNodes.empty());
+
+    m_BinaryNodes = &binaryNodes;
+    m_Nodes = &nodes;
+    m_PrimitiveIndices = &primitiveIndices;
+
+    nodes.clear();
+    nodes.reserve(binaryNodes.size() / (m_Width - 1) + 1);
+    nodes.resize(1);
+    primitiveIndices.clear();
+
+    EmitNode(MakeChild(binaryNodes, 0), 0);
+
+    m_BinaryNodes = nullptr;
+    m_Nodes = nullptr;
+    m_PrimitiveIndices = nullptr;
+
+}
+
+unsigned int WideBVHBuilder::ComputeDepth(const WideBVHNode* nodes, size_t nodeCount)
+{
+    if (nodeCount == 0)
+    {
+        return 0;
+    }
+
+    // Node and its level, the greedy collapse puts no bound on the depth, so no recursion
+    std::vector<std::pair<unsigned int, unsigned int>> stack = { { 0u, 1u } };
+    unsigned int depth = 0;
+    size_t visited = 0;
+    while (!stack.empty())
+    {
+        unsigned int index = stack.back().first;
+        unsigned int level = stack.back().second;
+        stack.pop_back();
+        // A tree visits every node once, more visits mean a corrupt file with shared or cyclic children
+        if (++visited > nodeCount)
+        {
+            return 0;
+        }
+        depth = std::max(depth, level);
+
+        const WideBVHNode& node = nodes[index];
+        for (unsigned int i = 0; i < WIDE_BVH_MAX_WIDTH; ++i)
+        {
+            if ((node.innerMask >> i) & 1)
+            {
+                size_t child = size_t(node.childBaseIndex) + node.meta[i];
+                if (child >= nodeCount)
+                {
+                    return 0;
+                }
+                stack.push_back(std::make_pair(static_cast<unsigned int>(child), level + 1));
+            }
+        }
+    }
+    return depth;
+}
+
+void WideBVHBuilder::CollectChildren(const Child& parent, std::vector<Child>& children) const
+{
+    children.clear();
+
+    if (parent.IsRange())
+    {
+        // Oversized leaves are spread over leaf slots, or over interior children if they need more than _m_Width_ slots
+        unsigned int slots = (parent.count + MAX_LEAF_TRIANGLES - 1) / MAX_LEAF_TRIANGLES;
+        unsigned int nChildren = std::min(slots, m_Width);
+        unsigned int first = parent.first;
+        for (unsigned int i = 0; i < nChildren; ++i)
+        {
+            unsigned int last = parent.first + static_cast<unsigned int>(uint64_t(parent.count) * (i + 1) / nChildren);
+            Child child;
+            child.bounds = parent.bounds;
+            child.binaryNode = INVALID_NODE;
+            child.first = first;
+            child.count = last - first;
+            children.push_back(child);
+            first = last;
+        }
+        return;
+    }
+
+    const std::vector<LinearBVHNode>& binaryNodes = *m_BinaryNodes;
+    const LinearBVHNode& node = binaryNodes[parent.binaryNode];
+    children.push_back(MakeChild(binaryNodes, parent.binaryNode + 1));
+    children.push_back(MakeChild(binaryNodes, node.offset));
+
+    // Open the interior child with the largest surface area until the node is full
+    while (children.size() < m_Width)
+    {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (unsigned int i = 0; i < children.size(); ++i)
+        {
+            if (!children[i].IsRange() && children[i].bounds.SurfaceArea() > largestArea)
+            {
+                largest = static_cast<int>(i);
+                largestArea = children[i].bounds.SurfaceArea();
+            }
+        }
+        if (largest < 0)
+        {
+            break;
+        }
+
+        unsigned int index = children[largest].binaryNode;
+        children[largest] = MakeChild(binaryNodes, index + 1);
+        children.push_back(MakeChild(binaryNodes, binaryNodes[index].offset));
+    }
+
+}
+
+void WideBVHBuilder::EmitNode(const Child& item, unsigned int nodeIndex)
+{
+    std::vector<Child> children;
+    CollectChildren(item, children);
+    assert(!children.empty() && children.size() <= m_Width);
+
+    // Small ranges become leaf slots as long as their offset can be encoded
+    std::vector<Child> interiorChildren;
+    unsigned char meta[WIDE_BVH_MAX_WIDTH] = {};
+    unsigned char innerMask = 0;
+    unsigned int leafOffset = 0;
+    unsigned int triangleBaseIndex = static_cast<unsigned int>(m_PrimitiveIndices->size());
+    for (unsigned int i = 0; i < children.size(); ++i)
+    {
+        const Child& child = children[i];
+        if (child.IsRange() && child.count <= MAX_LEAF_TRIANGLES && leafOffset <= MAX_LEAF_OFFSET)
+        {
+            meta[i] = static_cast<unsigned char>((child.count << 5) | leafOffset);
+            leafOffset += child.count;
+            for (unsigned int j = 0; j < child.count; ++j)
+            {
+                m_PrimitiveIndices->push_back(child.first + j);
+            }
+        }
+        else
+        {
+            meta[i] = static_cast<unsigned char>(interiorChildren.size());
+            innerMask |= 1 << i;
+            interiorChildren.push_back(child);
+        }
+    }
+
+    unsigned int childBaseIndex = static_cast<unsigned int>(m_Nodes->size());
+    m_Nodes->resize(childBaseIndex + interiorChildren.size());
+
+    WideBVHNode& node = (*m_Nodes)[nodeIndex];
+    memset(static_cast<void*>(&node), 0, sizeof(WideBVHNode));
+    node.innerMask = innerMask;
+    node.childBaseIndex = childBaseIndex;
+    node.triangleBaseIndex = triangleBaseIndex;
+    memcpy(node.meta, meta, sizeof(meta));
+    Quantize(node, children);
+
+    for (unsigned int i = 0; i < interiorChildren.size(); ++i)
+    {
+        EmitNode(interiorChildren[i], childBaseIndex + i);
+    }
+
+}
+
+void WideBVHBuilder::Quantize(WideBVHNode& node, const std::vector<Child>& children) const
+{
+    Bounds3 bounds;
+    for (const Child& child : children)
+    {
+        bounds = Union(bounds, child.bounds);
+    }
+
+    for (unsigned int axis = 0; axis < 3; ++axis)
+    {
+        // Smallest power of two step that covers the node extent with 255 steps
+        float origin = bounds.min[axis];
+        float extent = bounds.max[axis] - origin;
+        int exponent = extent > 0.0f ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+        exponent = clamp(exponent, -126, 127);
+        float scale = std::ldexp(1.0f, exponent);
+        while (exponent < 127 && origin + 255.0f * scale < bounds.max[axis])
+        {
+            scale = std::ldexp(1.0f, ++exponent);
+        }
+
+        node.origin[axis] = origin;
+        node.exponent[axis] = static_cast<unsigned char>(exponent + 127);
+
+        // Round outwards, the quantized boxes must contain the exact ones
+        for (unsigned int i = 0; i < children.size(); ++i)
+        {
+            const Bounds3& childBounds = children[i].bounds;
+            int lo = clamp(static_cast<int>(std::floor((childBounds.min[axis] - origin) / scale)), 0, 255);
+            int hi = clamp(static_cast<int>(std::ceil((childBounds.max[axis] - origin) / scale)), 0, 255);
+            while (lo > 0 && origin + lo * scale > childBounds.min[axis])
+            {
+                --lo;
+            }
+            while (hi < 255 && origin + hi * scale < childBounds.max[axis])
+            {
+                ++hi;
+            }
+            node.qlo[axis][i] = static_cast<unsigned char>(lo);
+            node.qhi[axis][i] = static_cast<unsigned char>(hi);
+        }
+    }
+
+}
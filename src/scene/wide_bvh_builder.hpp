@@ -0,0 +1,47 @@
+#ifndef WIDE_BVH_BUILDER_HPP
+#define WIDE_BVH_BUILDER_HPP
+
+#include "mathlib/mathlib.hpp"
+#include "utils/shared_structs.hpp"
+#include <cstddef>
+#include <vector>
+
+// Collapses a binary BVH into a 4- or 8-ary BVH with quantized child boxes.
+// Every wide node greedily opens the child with the largest surface area
+// until it is full.
+class WideBVHBuilder
+{
+public:
+    WideBVHBuilder(unsigned int width);
+
+    // _binaryNodes_ in the depth-first layout of BVHBuilder, leaves index the
+    // triangle array directly. Fills _primitiveIndices_ with the triangle order
+    // the wide leaves expect, every triangle occurs exactly once.
+    void Build(const std::vector<LinearBVHNode>& binaryNodes,
+        std::vector<WideBVHNode>& nodes,
+        std::vector<unsigned int>& primitiveIndices);
+
+    // Levels of wide nodes below and including the root of _nodes_, the traversal stack of the kernel grows with it.
+    // Returns 0 if a child index leaves the node array or nodes are reached more than once.
+    static unsigned int ComputeDepth(const WideBVHNode* nodes, size_t nodeCount);
+
+    static const unsigned int MAX_LEAF_TRIANGLES = 7;
+    static const unsigned int MAX_LEAF_OFFSET = 31;
+
+private:
+    struct Child;
+
+    static Child MakeChild(const std::vector<LinearBVHNode>& binaryNodes, unsigned int index);
+    void CollectChildren(const Child& parent, std::vector<Child>& children) const;
+    void EmitNode(const Child& item, unsigned int nodeIndex);
+    void Quantize(WideBVHNode& node, const std::vector<Child>& children) const;
+
+private:
+    unsigned int m_Width;
+    const std::vector<LinearBVHNode>* m_BinaryNodes;
+    std::vector<WideBVHNode>* m_Nodes;
+    std::vector<unsigned int>* m_PrimitiveIndices;
+
+};
+
+#endif // WIDE_BVH_BUILDER_HPP
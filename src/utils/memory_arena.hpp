@@ -0,0 +1,81 @@
+#ifndef MEMORY_ARENA_HPP
+#define MEMORY_ARENA_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Bump allocator for short-lived build data, everything is released at once
+// on Reset() or destruction. Destructors of allocated objects are never run.
+// Not thread-safe, use one arena per thread.
+class MemoryArena
+{
+public:
+    explicit MemoryArena(size_t blockSize = 256 * 1024)
+        : m_BlockSize(blockSize), m_CurrentBlock(nullptr), m_CurrentOffset(0), m_CurrentSize(0), m_TotalBytes(0)
+    {}
+
+    ~MemoryArena() { Reset(); }
+
+    template <typename T>
+    T* Alloc(size_t count = 1)
+    {
+        T* ptr = static_cast<T*>(AllocBytes(count * sizeof(T)));
+        for (size_t i = 0; i < count; ++i)
+        {
+            new (&ptr[i]) T();
+        }
+        return ptr;
+    }
+
+    void Reset()
+    {
+        for (char* block : m_Blocks)
+        {
+            std::free(block);
+        }
+        m_Blocks.clear();
+        m_CurrentBlock = nullptr;
+        m_CurrentOffset = m_CurrentSize = m_TotalBytes = 0;
+    }
+
+    size_t GetTotalAllocated() const { return m_TotalBytes; }
+
+private:
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    void* AllocBytes(size_t bytes)
+    {
+        // Keep every allocation 16-byte aligned for float3 members
+        bytes = (bytes + 15) & ~size_t(15);
+        if (m_CurrentOffset + bytes > m_CurrentSize)
+        {
+            m_CurrentSize = std::max(bytes, m_BlockSize);
+            m_CurrentBlock = static_cast<char*>(std::malloc(m_CurrentSize));
+            if (!m_CurrentBlock)
+            {
+                throw std::bad_alloc();
+            }
+            m_Blocks.push_back(m_CurrentBlock);
+            m_CurrentOffset = 0;
+            m_TotalBytes += m_CurrentSize;
+        }
+
+        void* ptr = m_CurrentBlock + m_CurrentOffset;
+        m_CurrentOffset += bytes;
+        return ptr;
+    }
+
+private:
+    size_t m_BlockSize;
+    char* m_CurrentBlock;
+    size_t m_CurrentOffset;
+    size_t m_CurrentSize;
+    size_t m_TotalBytes;
+    std::vector<char*> m_Blocks;
+
+};
+
+#endif // MEMORY_ARENA_HPP
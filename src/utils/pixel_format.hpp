@@ -0,0 +1,13 @@
+#ifndef PIXEL_FORMAT_HPP
+#define PIXEL_FORMAT_HPP
+
+// Packed output pixels, one 32-bit word each with red in the lowest bits
+enum class PixelFormat_t : unsigned int
+{
+    // 8 bits per channel
+    RGBA8,
+    // 10 bits per color channel, 2 bit alpha
+    RGB10A2,
+};
+
+#endif // PIXEL_FORMAT_HPP
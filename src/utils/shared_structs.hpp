@@ -85,6 +85,85 @@ typedef struct Triangle
 
 } Triangle;
 
+// Triangle data read by the intersection test, 48 bytes
+typedef struct TriangleGeometry
+{
+#ifdef __cplusplus
+    TriangleGeometry() {}
+    TriangleGeometry(const float3& p0, const float3& p1, const float3& p2)
+        : v0(p0), e1(p1 - p0), e2(p2 - p0)
+    {}
+#endif
+
+    float3 v0;
+    float3 e1;
+    float3 e2;
+
+} TriangleGeometry;
+
+// Shading data of a triangle, only read for the closest hit, 16 bytes.
+// _vertices_ index the welded VertexAttributes of the scene.
+typedef struct TriangleAttributes
+{
+    unsigned int vertices[3];
+    unsigned int mtlIndex;
+
+} TriangleAttributes;
+
+// Shading data of a welded vertex, shared by all triangles using it, 32 bytes
+typedef struct VertexAttributes
+{
+#ifdef __cplusplus
+    VertexAttributes() {}
+    VertexAttributes(const float3& normal, const float2& texcoord)
+        : normal(normal), texcoord(texcoord), padding(0.0f)
+    {}
+#endif
+
+    float3 normal;
+    float2 texcoord;
+    float2 padding;
+
+} VertexAttributes;
+
+// VertexAttributes with an octahedral snorm16 normal and a half precision texcoord, 8 bytes
+typedef struct CompressedVertexAttributes
+{
+#ifdef __cplusplus
+    CompressedVertexAttributes() {}
+    CompressedVertexAttributes(const VertexAttributes& vertex)
+        : normal(EncodeOctahedral(vertex.normal)),
+        texcoord(FloatToHalf(vertex.texcoord.x) | (static_cast<unsigned int>(FloatToHalf(vertex.texcoord.y)) << 16))
+    {}
+#endif
+
+    unsigned int normal;
+    unsigned int texcoord;
+
+} CompressedVertexAttributes;
+
+// Mip level of the environment map, texels are half precision RGB triplets.
+// _offset_ counts texels from the start of the mip chain.
+typedef struct EnvironmentLevel
+{
+    unsigned int offset;
+    unsigned int width;
+    unsigned int height;
+    unsigned int padding;
+
+} EnvironmentLevel;
+
+// Alias table entry of an environment texel. A light sample picks a texel
+// uniformly and keeps it with probability _threshold_, otherwise takes _alias_.
+// _pdf_ is the probability of ending up at this texel.
+typedef struct EnvironmentAlias
+{
+    float threshold;
+    unsigned int alias;
+    float pdf;
+
+} EnvironmentAlias;
+
 typedef struct CellData
 {
     unsigned int start_index;
@@ -109,4 +188,29 @@ typedef struct LinearBVHNode
 
 } LinearBVHNode;
 
+// Maximum number of children of a WideBVHNode
+#define WIDE_BVH_MAX_WIDTH 8
+
+typedef struct WideBVHNode
+{
+#ifdef __cplusplus
+    WideBVHNode() {}
+#endif
+    // 16 bytes, child boxes are stored relative to _origin_ in steps of 2^(exponent - 127)
+    float origin[3];
+    unsigned char exponent[3];
+    unsigned char innerMask;     // bit i set -> child i is an interior node
+    // 8 bytes
+    unsigned int childBaseIndex;    // interior children are stored consecutively from here
+    unsigned int triangleBaseIndex; // leaf children reference triangles from here
+    // 8 bytes, interior child: index relative to _childBaseIndex_
+    // leaf child: triangle count (high 3 bits) and offset relative to _triangleBaseIndex_ (low 5 bits),
+    // a leaf slot with meta 0 is empty
+    unsigned char meta[WIDE_BVH_MAX_WIDTH];
+    // 48 bytes, quantized child boxes per axis
+    unsigned char qlo[3][WIDE_BVH_MAX_WIDTH];
+    unsigned char qhi[3][WIDE_BVH_MAX_WIDTH];
+
+} WideBVHNode;
+
 #endif // TRIANGLE_HPP
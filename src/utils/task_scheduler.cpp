@@ -0,0 +1,157 @@
+#include "task_scheduler.hpp"
+#include <algorithm>
+
+static thread_local unsigned int t_ThreadIndex = 0;
+
+TaskScheduler& TaskScheduler::Get()
+{
+    static TaskScheduler scheduler(std::max(1u, std::thread::hardware_concurrency()));
+    return scheduler;
+}
+
+TaskScheduler::TaskScheduler(unsigned int threadCount)
+    : m_QueuedTasks(0), m_Shutdown(false)
+{
+    for (unsigned int i = 0; i < threadCount; ++i)
+    {
+        m_Queues.emplace_back(new TaskQueue);
+    }
+
+    // Thread 0 is the main thread, it joins in while waiting on a group
+    for (unsigned int i = 1; i < threadCount; ++i)
+    {
+        m_Workers.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+    }
+
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+        m_Shutdown = true;
+    }
+    m_SleepCondition.notify_all();
+
+    for (std::thread& worker : m_Workers)
+    {
+        worker.join();
+    }
+}
+
+unsigned int TaskScheduler::GetThreadIndex()
+{
+    return t_ThreadIndex;
+}
+
+void TaskScheduler::Spawn(TaskGroup& group, Task task)
+{
+    group.m_Pending++;
+
+    TaskQueue& queue = *m_Queues[t_ThreadIndex];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back({ std::move(task), &group });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_SleepMutex);
+        m_QueuedTasks++;
+    }
+    m_SleepCondition.notify_one();
+
+}
+
+bool TaskScheduler::TryRunTask(unsigned int threadIndex)
+{
+    TaskEntry entry;
+    bool found = false;
+
+    // Own queue first, newest task keeps the working set hot
+    {
+        TaskQueue& queue = *m_Queues[threadIndex];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            entry = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    // Steal the oldest (and usually largest) task from another thread
+    for (size_t i = 1; !found && i < m_Queues.size(); ++i)
+    {
+        TaskQueue& queue = *m_Queues[(threadIndex + i) % m_Queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty())
+        {
+            entry = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        return false;
+    }
+
+    m_QueuedTasks--;
+    entry.task();
+    entry.group->m_Pending--;
+
+    return true;
+}
+
+void TaskScheduler::Wait(TaskGroup& group)
+{
+    while (group.m_Pending > 0)
+    {
+        if (!TryRunTask(t_ThreadIndex))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TaskScheduler::WorkerLoop(unsigned int threadIndex)
+{
+    t_ThreadIndex = threadIndex;
+
+    while (true)
+    {
+        if (TryRunTask(threadIndex))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_SleepMutex);
+        m_SleepCondition.wait(lock, [this]() { return m_Shutdown || m_QueuedTasks > 0; });
+        if (m_Shutdown)
+        {
+            break;
+        }
+    }
+
+}
+
+void TaskScheduler::ParallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body)
+{
+    if (end - begin <= grainSize || m_Queues.size() == 1)
+    {
+        body(begin, end);
+        return;
+    }
+
+    TaskGroup group;
+    for (size_t first = begin + grainSize; first < end; first += grainSize)
+    {
+        size_t last = std::min(first + grainSize, end);
+        Spawn(group, [&body, first, last]() { body(first, last); });
+    }
+    body(begin, std::min(begin + grainSize, end));
+
+    Wait(group);
+
+}
@@ -0,0 +1,77 @@
+#ifndef TASK_SCHEDULER_HPP
+#define TASK_SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counter of outstanding tasks, TaskScheduler::Wait() returns once it drops to zero
+class TaskGroup
+{
+public:
+    TaskGroup() : m_Pending(0) {}
+
+private:
+    friend class TaskScheduler;
+    std::atomic<int> m_Pending;
+
+};
+
+// Work-stealing scheduler: every thread owns a deque, pops its own tasks
+// from the back (depth-first) and steals from the front of others (breadth-first)
+class TaskScheduler
+{
+public:
+    typedef std::function<void()> Task;
+
+    static TaskScheduler& Get();
+
+    ~TaskScheduler();
+
+    void Spawn(TaskGroup& group, Task task);
+    // The calling thread executes pending tasks until the group is finished
+    void Wait(TaskGroup& group);
+
+    // Calls body(first, last) for chunks of at most grainSize indices
+    void ParallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& body);
+
+    unsigned int GetThreadCount() const { return static_cast<unsigned int>(m_Queues.size()); }
+    // 0 for the main thread, 1..GetThreadCount()-1 for the workers
+    static unsigned int GetThreadIndex();
+
+private:
+    struct TaskEntry
+    {
+        Task task;
+        TaskGroup* group;
+    };
+
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<TaskEntry> tasks;
+    };
+
+    explicit TaskScheduler(unsigned int threadCount);
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    void WorkerLoop(unsigned int threadIndex);
+    bool TryRunTask(unsigned int threadIndex);
+
+private:
+    std::vector<std::unique_ptr<TaskQueue>> m_Queues;
+    std::vector<std::thread> m_Workers;
+    std::atomic<int> m_QueuedTasks;
+    std::atomic<bool> m_Shutdown;
+    std::mutex m_SleepMutex;
+    std::condition_variable m_SleepCondition;
+
+};
+
+#endif // TASK_SCHEDULER_HPP
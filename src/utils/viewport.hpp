@@ -9,13 +9,9 @@ public:
     Viewport(size_t width, size_t height)
         : width(width), height(height)
     {
-        pixels = new float[width * height * 4]; // RGBA
     }
 
-    ~Viewport() { if (pixels) delete[] pixels; }
-
     unsigned int width, height;
-    float* pixels;
 
 };
 